@@ -89,6 +89,13 @@ namespace XLua
 
     }
 
+    //生成代码把该方法、属性或字段的函数注册为可延迟调用，xlua.defer/xlua.defer_set记录的调用由LuaEnv.FlushCommands直接在C#里执行
+    [AttributeUsage(AttributeTargets.Method | AttributeTargets.Property | AttributeTargets.Field)]
+    public class DeferrableAttribute : Attribute
+    {
+
+    }
+
     [Flags]
     public enum HotfixFlag
     {
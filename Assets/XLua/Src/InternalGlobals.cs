@@ -26,6 +26,10 @@ namespace XLua
     {
 #if !THREAD_SAFE && !HOTFIX_ENABLE
         internal static byte[] strBuff = new byte[256];
+
+        //lua_tostring decode buffer, longer strings use a temporary one
+        internal const int MaxCharBuffSize = 4096;
+        internal static char[] charBuff = new char[256];
 #endif
 
         internal delegate bool TryArrayGet(Type type, RealStatePtr L, ObjectTranslator translator, object obj, int index);
@@ -18,6 +18,9 @@ namespace XLua.LuaDLL
     [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
     public delegate int lua_CSFunction(IntPtr L);
 
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    public delegate void lua_MemoryQuotaCallback(IntPtr L, IntPtr used, IntPtr limit, int hard);
+
 #if GEN_CODE_MINIMIZE
     [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
     public delegate int CSharpWrapperCaller(IntPtr L, int funcidx, int top);
@@ -25,6 +28,8 @@ namespace XLua.LuaDLL
 #else
     public delegate int lua_CSFunction(IntPtr L);
 
+    public delegate void lua_MemoryQuotaCallback(IntPtr L, IntPtr used, IntPtr limit, int hard);
+
 #if GEN_CODE_MINIMIZE
     public delegate int CSharpWrapperCaller(IntPtr L, int funcidx, int top);
 #endif
@@ -92,6 +97,67 @@ namespace XLua.LuaDLL
 		[DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
 		public static extern void lua_close(IntPtr L);
 
+        //limits are in bytes, 0 means no limit
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_newstate_quota(IntPtr soft_limit, IntPtr hard_limit);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern bool xlua_set_memory_quota(IntPtr L, IntPtr soft_limit, IntPtr hard_limit);
+
+        //the callback is called inside the allocator, it must not call any lua api
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern bool xlua_set_memory_quota_callback(IntPtr L, lua_MemoryQuotaCallback callback);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_memory_used(IntPtr L);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_memory_peak(IntPtr L);
+
+        //runs the full gc queued by a soft limit crossing outside the allocator
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_memory_quota_collect(IntPtr L);
+
+        //chunk_size: bytes per region chunk, 0 for the default(1M)
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_newstate_arena(IntPtr chunk_size);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_arena_reserved(IntPtr L);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern bool xlua_set_bytecode_cache(string dir, bool strip);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern bool xlua_add_archive(IntPtr L, string path, int index);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_verify_files(string root, byte[] manifest, int len, int threads, StringBuilder failed, int failed_size);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_verify_trust(byte[] manifest, int len);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern bool xlua_verify_buffer(byte[] data, int len);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_template_new(int capacity, byte[] warmup, int warmup_len, string chunkname);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_template_acquire(IntPtr tpl);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_template_wait(IntPtr tpl, int count);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_template_ready(IntPtr tpl);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_template_error(IntPtr tpl);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void xlua_template_delete(IntPtr tpl);
+
 		[DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)] //[-0, +0, m]
         public static extern void luaopen_xlua(IntPtr L);
 
@@ -201,6 +267,29 @@ namespace XLua.LuaDLL
 			luaL_unref(L,LuaIndexes.LUA_REGISTRYINDEX,reference);
 		}
 
+        //releases count refs, isDelegate[i] != 0 also clears the function -> ref entry of a delegate bridge
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void xlua_unref_batch(IntPtr L, int[] refs, int[] isDelegate, int count);
+
+        //deferred command buffer, see xlua.defer
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_cmdbuf_flush(IntPtr L);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_cmdbuf_next(IntPtr L, out int wrapperid, out IntPtr fn);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void xlua_cmdbuf_set_replay(IntPtr L);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_cmdbuf_mark(IntPtr L, int index);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_cmdbuf_pending(IntPtr L);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void xlua_cmdbuf_clear(IntPtr L);
+
 		[DllImport(LUADLL,CallingConvention=CallingConvention.Cdecl)]
 		public static extern bool lua_isstring(IntPtr L, int index);
 
@@ -245,34 +334,38 @@ namespace XLua.LuaDLL
 
         public static string lua_tostring(IntPtr L, int index)
 		{
-            IntPtr strlen;
-
-            IntPtr str = lua_tolstring(L, index, out strlen);
-            if (str != IntPtr.Zero)
-			{
-#if XLUA_GENERAL || (UNITY_WSA && !UNITY_EDITOR)
-                int len = strlen.ToInt32();
-                byte[] buffer = new byte[len];
-                Marshal.Copy(str, buffer, 0, len);
-                return Encoding.UTF8.GetString(buffer);
-#else
-                string ret = Marshal.PtrToStringAnsi(str, strlen.ToInt32());
-                if (ret == null)
+#if !THREAD_SAFE && !HOTFIX_ENABLE
+            char[] buffer = InternalGlobals.charBuff;
+            int len = xlua_toutf16(L, index, buffer, buffer.Length);
+            if (len > buffer.Length)
+            {
+                buffer = new char[len];
+                if (len <= InternalGlobals.MaxCharBuffSize)
                 {
-                    int len = strlen.ToInt32();
-                    byte[] buffer = new byte[len];
-                    Marshal.Copy(str, buffer, 0, len);
-                    return Encoding.UTF8.GetString(buffer);
+                    InternalGlobals.charBuff = buffer;
                 }
-                return ret;
-#endif
+                len = xlua_toutf16(L, index, buffer, len);
             }
-            else
-			{
+#else
+            int len = xlua_toutf16(L, index, null, 0);
+            char[] buffer = null;
+            if (len > 0)
+            {
+                buffer = new char[len];
+                len = xlua_toutf16(L, index, buffer, len);
+            }
+#endif
+            if (len < 0)
+            {
                 return null;
-			}
+            }
+            return len == 0 ? string.Empty : new string(buffer, 0, len);
 		}
 
+        //decodes the utf-8 string at index into buf, returns its utf-16 length (only the first size chars are written), -1 if not a string or number
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+        public static extern int xlua_toutf16(IntPtr L, int index, [Out] char[] buf, int size);
+
         [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
 		public static extern IntPtr lua_atpanic(IntPtr L, lua_CSFunction panicf);
 
@@ -300,28 +393,50 @@ namespace XLua.LuaDLL
             }
             else
             {
-#if !THREAD_SAFE && !HOTFIX_ENABLE
-                if (Encoding.UTF8.GetByteCount(str) > InternalGlobals.strBuff.Length)
-                {
-                    byte[] bytes = Encoding.UTF8.GetBytes(str);
-                    xlua_pushlstring(L, bytes, bytes.Length);
-                }
-                else
-                {
-                    int bytes_len = Encoding.UTF8.GetBytes(str, 0, str.Length, InternalGlobals.strBuff, 0);
-                    xlua_pushlstring(L, InternalGlobals.strBuff, bytes_len);
-                }
-#else
-                var bytes = Encoding.UTF8.GetBytes(str);
-                xlua_pushlstring(L, bytes, bytes.Length);
-#endif
+                xlua_pushutf16(L, str, str.Length);
             }
         }
 #endif
 
+        //pushes str encoded as utf-8, the conversion is done natively on the string chars
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+        public static extern void xlua_pushutf16(IntPtr L, string str, int len);
+
         [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern void xlua_pushlstring(IntPtr L, byte[] str, int size);
 
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr xlua_tostrid(IntPtr L, int index, out uint hash, out int len, out int isShort, out uint epoch);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern uint xlua_strid_reset(IntPtr L, int limit);
+
+        //writes the entries of the table at index as records into buf, cursor starts at 0 and is -1 once done.
+        //returns the bytes written, minus the size needed if the next record does not fit, -2 if not a table
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_table_export(IntPtr L, int index, ref int cursor, byte[] buf, int size);
+
+        //copies t[1..count] into buf, returns how many were copied, it stops at the first element that does not fit the type
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_table_todoubles(IntPtr L, int index, [Out] double[] buf, int count);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_table_tofloats(IntPtr L, int index, [Out] float[] buf, int count);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_table_toints(IntPtr L, int index, [Out] int[] buf, int count);
+
+        //registers a struct layout (types are the gen_css_access tags, 10 for a nested schema given in subs), returns its registry ref or -1
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_schema_register(IntPtr L, int size, int nfields, string[] names, int[] offsets, int[] types, int[] counts, int[] subs);
+
+        //fills buf from the table at index, 0 if a field can not be converted
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_table_tostruct(IntPtr L, int index, int schemaRef, IntPtr buf);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_struct_totable(IntPtr L, int schemaRef, IntPtr buf, int metaRef);
+
         public static void xlua_pushasciistring(IntPtr L, string str) // for inner use only
         {
             if (str == null)
@@ -397,6 +512,10 @@ namespace XLua.LuaDLL
         [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern int xluaL_loadbuffer(IntPtr L, byte[] buff, int size, string name);
 
+        //skips the bytecode cache, for chunks that were verified as they are
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xluaL_loadbuffer_nocache(IntPtr L, byte[] buff, int size, string name);
+
         public static int luaL_loadbuffer(IntPtr L, string buff, string name)//[-0, +1, m]
         {
             byte[] bytes = Encoding.UTF8.GetBytes(buff);
@@ -536,6 +655,20 @@ namespace XLua.LuaDLL
         [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern int xlua_pgettable_bypath(IntPtr L, int idx, string path);
 
+        //returns the registry ref of the compiled path, -1 if it has too many segments
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_path_compile(IntPtr L, string path);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_pgettable_bypathref(IntPtr L, int idx, int pathRef);
+
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_psettable_bypathref(IntPtr L, int idx, int pathRef);
+
+        //pushes the values of n compiled paths
+        [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int xlua_pgettable_bypathrefs(IntPtr L, int idx, int[] pathRefs, int n);
+
         [DllImport(LUADLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern int xlua_psettable_bypath(IntPtr L, int idx, string path);
 
@@ -61,7 +61,33 @@ namespace XLua
 
         const int LIB_VERSION_EXPECT = 105;
 
-        public LuaEnv()
+        public LuaEnv() : this(0, 0)
+        {
+        }
+
+        //memorySoftLimit: bytes, crossing it queues a full gc for the next Tick
+        //memoryHardLimit: bytes, allocations beyond it raise a lua memory error
+        //0 means no limit
+        public LuaEnv(long memorySoftLimit, long memoryHardLimit) : this(memorySoftLimit, memoryHardLimit, false)
+        {
+        }
+
+        //useArena: allocate from a region that is released at once on Dispose, memory freed
+        //by lua is not reused, only for short-lived env such as battle simulation
+        public LuaEnv(bool useArena) : this(0, 0, useArena)
+        {
+        }
+
+        //preparedL: a state that already ran luaopen_xlua and luaopen_i64lib, see LuaEnvTemplate
+        internal LuaEnv(RealStatePtr preparedL) : this(0, 0, false, preparedL)
+        {
+        }
+
+        private LuaEnv(long memorySoftLimit, long memoryHardLimit, bool useArena) : this(memorySoftLimit, memoryHardLimit, useArena, RealStatePtr.Zero)
+        {
+        }
+
+        private LuaEnv(long memorySoftLimit, long memoryHardLimit, bool useArena, RealStatePtr preparedL)
         {
             if (LuaAPI.xlua_get_lib_version() != LIB_VERSION_EXPECT)
             {
@@ -78,11 +104,29 @@ namespace XLua
                 LuaAPI.xlua_set_csharp_wrapper_caller(InternalGlobals.CSharpWrapperCallerPtr);
 #endif
                 // Create State
-                rawL = LuaAPI.luaL_newstate();
+                if (preparedL != RealStatePtr.Zero)
+                {
+                    rawL = preparedL;
+                }
+                else if (useArena)
+                {
+                    rawL = LuaAPI.xlua_newstate_arena(IntPtr.Zero);
+                }
+                else if (memorySoftLimit > 0 || memoryHardLimit > 0)
+                {
+                    rawL = LuaAPI.xlua_newstate_quota(toSizeT(memorySoftLimit), toSizeT(memoryHardLimit));
+                }
+                else
+                {
+                    rawL = LuaAPI.luaL_newstate();
+                }
 
                 //Init Base Libs
-                LuaAPI.luaopen_xlua(rawL);
-                LuaAPI.luaopen_i64lib(rawL);
+                if (preparedL == RealStatePtr.Zero)
+                {
+                    LuaAPI.luaopen_xlua(rawL);
+                    LuaAPI.luaopen_i64lib(rawL);
+                }
 
                 translator = new ObjectTranslator(this, rawL);
                 translator.createFunctionMetatable(rawL);
@@ -91,6 +135,9 @@ namespace XLua
 
                 LuaAPI.lua_atpanic(rawL, StaticLuaCallbacks.Panic);
 
+                LuaAPI.lua_pushstdcallcfunction(rawL, StaticLuaCallbacks.ReplayCommands);
+                LuaAPI.xlua_cmdbuf_set_replay(rawL);
+
 #if !XLUA_GENERAL
                 LuaAPI.lua_pushstdcallcfunction(rawL, StaticLuaCallbacks.Print);
                 if (0 != LuaAPI.xlua_setglobal(rawL, "print"))
@@ -316,6 +363,20 @@ namespace XLua
 #endif
         }
 
+        //map a script pack written by luac_batch and resolve require from it natively, without going
+        //through the c# loaders. index is the position in package.searchers, 2 is right after preload
+        public bool AddScriptArchive(string path, int index = 2)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnvLock)
+            {
+#endif
+                return LuaAPI.xlua_add_archive(L, path, index);
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
         public void Alias(Type type, string alias)
         {
             translator.Alias(type, alias);
@@ -343,12 +404,24 @@ namespace XLua
                 var _L = L;
                 lock (refQueue)
                 {
-                    while (refQueue.Count > 0)
+                    int count = refQueue.Count;
+                    if (count > 0)
                     {
-                        GCAction gca = refQueue.Dequeue();
-                        translator.ReleaseLuaBase(_L, gca.Reference, gca.IsDelegate);
+                        if (releaseRefs.Length < count)
+                        {
+                            releaseRefs = new int[Math.Max(count, releaseRefs.Length * 2)];
+                            releaseIsDelegate = new int[releaseRefs.Length];
+                        }
+                        for (int i = 0; i < count; i++)
+                        {
+                            GCAction gca = refQueue.Dequeue();
+                            releaseRefs[i] = gca.Reference;
+                            releaseIsDelegate[i] = gca.IsDelegate ? 1 : 0;
+                        }
+                        translator.ReleaseLuaBases(_L, releaseRefs, releaseIsDelegate, count);
                     }
                 }
+                LuaAPI.xlua_memory_quota_collect(_L);
 #if !XLUA_GENERAL
                 last_check_point = translator.objects.Check(last_check_point, max_check_per_tick, object_valid_checker, translator.reverseMap);
 #endif
@@ -382,6 +455,73 @@ namespace XLua
 #endif
         }
 
+        //runs the calls recorded by xlua.defer/xlua.defer_set in the order they were made, call it
+        //at the sync point of the frame. if one of them fails the exception is thrown here and the
+        //calls after it stay queued for the next flush
+        public void FlushCommands()
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnvLock)
+            {
+#endif
+                var _L = L;
+                int oldTop = LuaAPI.lua_gettop(_L);
+                if (LuaAPI.xlua_cmdbuf_flush(_L) != 0)
+                {
+                    ThrowExceptionFromError(oldTop);
+                }
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
+        //drops the recorded calls without running them
+        public void ClearCommands()
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnvLock)
+            {
+#endif
+                LuaAPI.xlua_cmdbuf_clear(L);
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
+        //bytes of recorded calls waiting for FlushCommands
+        public int PendingCommandBytes
+        {
+            get
+            {
+#if THREAD_SAFE || HOTFIX_ENABLE
+                lock (luaEnvLock)
+                {
+#endif
+                    return LuaAPI.xlua_cmdbuf_pending(L);
+#if THREAD_SAFE || HOTFIX_ENABLE
+                }
+#endif
+            }
+        }
+
+        //splits and interns a dotted path once, see LuaTable.GetInPath(LuaPath)
+        public LuaPath CompilePath(string path)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnvLock)
+            {
+#endif
+                int reference = LuaAPI.xlua_path_compile(L, path);
+                if (reference == -1)
+                {
+                    throw new ArgumentException("too many segments in path " + path);
+                }
+                return new LuaPath(reference, this, path);
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
         private bool disposed = false;
 
         public void Dispose()
@@ -452,6 +592,10 @@ namespace XLua
 
         Queue<GCAction> refQueue = new Queue<GCAction>();
 
+        // Tick hands the queued refs to the native side in one call
+        int[] releaseRefs = new int[64];
+        int[] releaseIsDelegate = new int[64];
+
         internal void equeueGCAction(GCAction action)
         {
             lock (refQueue)
@@ -729,6 +873,58 @@ namespace XLua
 #endif
         }
 
+        //cache compiled chunks of xluaL_loadbuffer in dir (must exist), shared by all env in the process.
+        //strip drops debug info from the cached bytecode. null turns the cache off. scripts of a
+        //SignatureLoader are never cached
+        public static bool SetBytecodeCache(string dir, bool strip = false)
+        {
+            return LuaAPI.xlua_set_bytecode_cache(dir, strip);
+        }
+
+        //only works for env created with memory limits
+        public bool SetMemoryQuota(long memorySoftLimit, long memoryHardLimit)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnvLock)
+            {
+#endif
+                return LuaAPI.xlua_set_memory_quota(L, toSizeT(memorySoftLimit), toSizeT(memoryHardLimit));
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
+        //bytes in use, read from the allocator without running lua_gc for env created with memory limits
+        public long MemoryUsed
+        {
+            get
+            {
+#if THREAD_SAFE || HOTFIX_ENABLE
+                lock (luaEnvLock)
+                {
+#endif
+                    return fromSizeT(LuaAPI.xlua_memory_used(L));
+#if THREAD_SAFE || HOTFIX_ENABLE
+                }
+#endif
+            }
+        }
+
+        //size_t is 32 bits on 32 bits platforms, new IntPtr(long) would throw there
+        static IntPtr toSizeT(long size)
+        {
+            if (IntPtr.Size == 4)
+            {
+                return new IntPtr(unchecked((int)(uint)Math.Min(Math.Max(size, 0), uint.MaxValue)));
+            }
+            return new IntPtr(size);
+        }
+
+        static long fromSizeT(IntPtr size)
+        {
+            return IntPtr.Size == 4 ? (long)(uint)size.ToInt32() : size.ToInt64();
+        }
+
         public int Memroy
         {
             get
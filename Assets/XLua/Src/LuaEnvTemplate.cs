@@ -0,0 +1,82 @@
+﻿/*
+ * Tencent is pleased to support the open source community by making xLua available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+using LuaAPI = XLua.LuaDLL.Lua;
+
+namespace XLua
+{
+    using System;
+    using System.Runtime.InteropServices;
+    using System.Text;
+
+    //keeps a few lua states warmed up on a native worker thread, Acquire hands one out as a LuaEnv.
+    //the warmup chunk runs before the c# side is attached, so it must not touch CS, only plain lua
+    //modules (package.path, package.preload) can be required there.
+    public class LuaEnvTemplate : IDisposable
+    {
+        IntPtr tpl;
+
+        public LuaEnvTemplate(int capacity, string warmup = null, string chunkName = "template")
+        {
+            byte[] bytes = warmup == null ? null : Encoding.UTF8.GetBytes(warmup);
+            tpl = LuaAPI.xlua_template_new(capacity, bytes, bytes == null ? 0 : bytes.Length, "@" + chunkName);
+            if (tpl == IntPtr.Zero)
+            {
+                throw new OutOfMemoryException("create lua env template fail!");
+            }
+        }
+
+        //number of states ready to be acquired without blocking
+        public int Ready
+        {
+            get
+            {
+                return LuaAPI.xlua_template_ready(checkedTemplate);
+            }
+        }
+
+        //block until count states are ready, returns the number of ready states
+        public int Wait(int count)
+        {
+            return LuaAPI.xlua_template_wait(checkedTemplate, count);
+        }
+
+        //builds the state on the calling thread if none is ready
+        public LuaEnv Acquire()
+        {
+            IntPtr L = LuaAPI.xlua_template_acquire(checkedTemplate);
+            if (L == IntPtr.Zero)
+            {
+                IntPtr err = LuaAPI.xlua_template_error(tpl);
+                throw new LuaException("warmup lua env fail: " + (err == IntPtr.Zero ? "unknown" : Marshal.PtrToStringAnsi(err)));
+            }
+            return new LuaEnv(L);
+        }
+
+        IntPtr checkedTemplate
+        {
+            get
+            {
+                if (tpl == IntPtr.Zero)
+                {
+                    throw new InvalidOperationException("this lua env template had disposed!");
+                }
+                return tpl;
+            }
+        }
+
+        public void Dispose()
+        {
+            if (tpl != IntPtr.Zero)
+            {
+                LuaAPI.xlua_template_delete(tpl);
+                tpl = IntPtr.Zero;
+            }
+        }
+    }
+}
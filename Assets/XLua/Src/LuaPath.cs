@@ -0,0 +1,35 @@
+﻿/*
+ * Tencent is pleased to support the open source community by making xLua available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+namespace XLua
+{
+    //a dotted path split and interned once by LuaEnv.CompilePath, for the LuaTable.GetInPath/SetInPath
+    //overloads that read it without parsing and hashing the path again
+    public class LuaPath : LuaBase
+    {
+        readonly string path;
+
+        public LuaPath(int reference, LuaEnv luaenv, string path) : base(reference, luaenv)
+        {
+            this.path = path;
+        }
+
+        internal int Reference
+        {
+            get
+            {
+                return luaReference;
+            }
+        }
+
+        public override string ToString()
+        {
+            return "path :" + path;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+﻿/*
+ * Tencent is pleased to support the open source community by making xLua available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+using LuaAPI = XLua.LuaDLL.Lua;
+using RealStatePtr = System.IntPtr;
+
+namespace XLua
+{
+    using System;
+    using System.Collections.Generic;
+
+    //System.String of short lua strings keyed by their address, for keys and enum names that cross
+    //to c# over and over. the native side anchors every string handed out (see xlua_tostrid) and
+    //starts a new epoch when it drops them, so an address is only trusted within its epoch
+    public class LuaStringCache
+    {
+        readonly Dictionary<IntPtr, string> strings = new Dictionary<IntPtr, string>();
+        uint epoch = 0;
+
+        public string Get(RealStatePtr L, int index)
+        {
+            uint hash, cur_epoch;
+            int len, is_short;
+            IntPtr id = LuaAPI.xlua_tostrid(L, index, out hash, out len, out is_short, out cur_epoch);
+            if (id == IntPtr.Zero || is_short == 0)
+            {
+                return LuaAPI.lua_tostring(L, index);
+            }
+            if (cur_epoch != epoch)
+            {
+                strings.Clear();
+                epoch = cur_epoch;
+            }
+            string str;
+            if (!strings.TryGetValue(id, out str))
+            {
+                str = LuaAPI.lua_tostring(L, index);
+                strings.Add(id, str);
+            }
+            return str;
+        }
+
+        //releases the anchored strings, limit > 0 also sets how many are kept before an automatic reset
+        public void Reset(RealStatePtr L, int limit = 0)
+        {
+            epoch = LuaAPI.xlua_strid_reset(L, limit);
+            strings.Clear();
+        }
+    }
+}
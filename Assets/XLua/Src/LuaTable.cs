@@ -190,6 +190,103 @@ namespace XLua
 #endif
         }
 
+        public T GetInPath<T>(LuaPath path)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnv.luaEnvLock)
+            {
+#endif
+                var L = luaEnv.L;
+                var translator = luaEnv.translator;
+                int oldTop = LuaAPI.lua_gettop(L);
+                LuaAPI.lua_getref(L, luaReference);
+                if (0 != LuaAPI.xlua_pgettable_bypathref(L, -1, path.Reference))
+                {
+                    luaEnv.ThrowExceptionFromError(oldTop);
+                }
+                LuaTypes lua_type = LuaAPI.lua_type(L, -1);
+                if (lua_type == LuaTypes.LUA_TNIL && typeof(T).IsValueType())
+                {
+                    throw new InvalidCastException("can not assign nil to " + typeof(T).GetFriendlyName());
+                }
+
+                T value;
+                try
+                {
+                    translator.Get(L, -1, out value);
+                }
+                finally
+                {
+                    LuaAPI.lua_settop(L, oldTop);
+                }
+                return value;
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
+        // reads all the paths in one native call, values[i] gets paths[i]
+        public void GetInPaths<T>(LuaPath[] paths, T[] values)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnv.luaEnvLock)
+            {
+#endif
+                var L = luaEnv.L;
+                var translator = luaEnv.translator;
+                int oldTop = LuaAPI.lua_gettop(L);
+                int[] refs = new int[paths.Length];
+                for (int i = 0; i < paths.Length; i++)
+                {
+                    refs[i] = paths[i].Reference;
+                }
+                LuaAPI.lua_getref(L, luaReference);
+                if (0 != LuaAPI.xlua_pgettable_bypathrefs(L, -1, refs, refs.Length))
+                {
+                    luaEnv.ThrowExceptionFromError(oldTop);
+                }
+                try
+                {
+                    for (int i = 0; i < paths.Length; i++)
+                    {
+                        int idx = oldTop + 2 + i;
+                        if (LuaAPI.lua_type(L, idx) == LuaTypes.LUA_TNIL && typeof(T).IsValueType())
+                        {
+                            throw new InvalidCastException("can not assign nil to " + typeof(T).GetFriendlyName());
+                        }
+                        translator.Get(L, idx, out values[i]);
+                    }
+                }
+                finally
+                {
+                    LuaAPI.lua_settop(L, oldTop);
+                }
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
+        public void SetInPath<T>(LuaPath path, T val)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnv.luaEnvLock)
+            {
+#endif
+                var L = luaEnv.L;
+                int oldTop = LuaAPI.lua_gettop(L);
+                LuaAPI.lua_getref(L, luaReference);
+                luaEnv.translator.PushByType(L, val);
+                if (0 != LuaAPI.xlua_psettable_bypathref(L, -2, path.Reference))
+                {
+                    luaEnv.ThrowExceptionFromError(oldTop);
+                }
+
+                LuaAPI.lua_settop(L, oldTop);
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+
         [Obsolete("use no boxing version: GetInPath/SetInPath Get/Set instead!")]
         public object this[string field]
         {
@@ -366,6 +463,52 @@ namespace XLua
 #endif
         }
 
+#if !USE_UNI_LUA
+        const int exportBufferSize = 4096;
+
+        // reads the table in batches of records instead of a lua_next per entry, values of
+        // LuaTableRecordType.Other are not copied, read them with Get if needed.
+        // as with ForEach, the action must not add keys to the table.
+        public void ForEachRecord(Action<LuaTableRecord> action)
+        {
+#if THREAD_SAFE || HOTFIX_ENABLE
+            lock (luaEnv.luaEnvLock)
+            {
+#endif
+                var L = luaEnv.L;
+                int oldTop = LuaAPI.lua_gettop(L);
+                byte[] buffer = new byte[exportBufferSize];
+                try
+                {
+                    LuaAPI.lua_getref(L, luaReference);
+                    int cursor = 0;
+                    while (cursor != -1)
+                    {
+                        int size = LuaAPI.xlua_table_export(L, -1, ref cursor, buffer, buffer.Length);
+                        if (size < 0)
+                        {
+                            buffer = new byte[-size];
+                            continue;
+                        }
+                        int offset = 0;
+                        while (offset < size)
+                        {
+                            LuaTableRecord record;
+                            offset += LuaTableRecord.Read(buffer, offset, out record);
+                            action(record);
+                        }
+                    }
+                }
+                finally
+                {
+                    LuaAPI.lua_settop(L, oldTop);
+                }
+#if THREAD_SAFE || HOTFIX_ENABLE
+            }
+#endif
+        }
+#endif
+
         internal override void push(RealStatePtr L)
         {
             LuaAPI.lua_getref(L, luaReference);
@@ -375,4 +518,54 @@ namespace XLua
             return "table :" + luaReference;
         }
     }
+
+    public enum LuaTableRecordType : byte
+    {
+        Nil = 0,
+        Boolean = 1,
+        Integer = 2,
+        Number = 3,
+        String = 4,
+        Other = 5,
+    }
+
+    // one table entry as written by xlua_table_export
+    public struct LuaTableRecord
+    {
+        const int headerSize = 32;
+
+        public LuaTableRecordType KeyType;
+        public LuaTableRecordType ValueType;
+
+        long keyBits;
+        long valueBits;
+        string keyString;
+        string valueString;
+
+        public long KeyInteger { get { return keyBits; } }
+        public double KeyNumber { get { return KeyType == LuaTableRecordType.Integer ? keyBits : BitConverter.Int64BitsToDouble(keyBits); } }
+        public bool KeyBoolean { get { return keyBits != 0; } }
+        public string KeyString { get { return keyString; } }
+
+        public long ValueInteger { get { return valueBits; } }
+        public double ValueNumber { get { return ValueType == LuaTableRecordType.Integer ? valueBits : BitConverter.Int64BitsToDouble(valueBits); } }
+        public bool ValueBoolean { get { return valueBits != 0; } }
+        public string ValueString { get { return valueString; } }
+        // the lua type of a value of LuaTableRecordType.Other
+        public LuaTypes ValueLuaType { get { return ValueType == LuaTableRecordType.Other ? (LuaTypes)valueBits : LuaTypes.LUA_TNONE; } }
+
+        // layout: key tag(1) value tag(1) reserved(2) size(4) key len(4) value len(4) key(8) value(8), then the strings
+        internal static int Read(byte[] buffer, int offset, out LuaTableRecord record)
+        {
+            int keyLen = BitConverter.ToInt32(buffer, offset + 8);
+            int valueLen = BitConverter.ToInt32(buffer, offset + 12);
+            record.KeyType = (LuaTableRecordType)buffer[offset];
+            record.ValueType = (LuaTableRecordType)buffer[offset + 1];
+            record.keyBits = BitConverter.ToInt64(buffer, offset + 16);
+            record.valueBits = BitConverter.ToInt64(buffer, offset + 24);
+            record.keyString = record.KeyType == LuaTableRecordType.String ? Encoding.UTF8.GetString(buffer, offset + headerSize, keyLen) : null;
+            record.valueString = record.ValueType == LuaTableRecordType.String ? Encoding.UTF8.GetString(buffer, offset + headerSize + keyLen, valueLen) : null;
+            return BitConverter.ToInt32(buffer, offset + 4);
+        }
+    }
 }
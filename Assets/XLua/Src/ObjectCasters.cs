@@ -491,7 +491,7 @@ namespace XLua
                     LuaTypes lua_type = LuaAPI.lua_type(L, idx);
                     if (lua_type == LuaTypes.LUA_TSTRING)
                     {
-                        return Enum.Parse(type, LuaAPI.lua_tostring(L, idx));
+                        return Enum.Parse(type, translator.stringCache.Get(L, idx));
                     }
                     else if (lua_type == LuaTypes.LUA_TNUMBER)
                     {
@@ -522,7 +522,21 @@ namespace XLua
                     {
                         throw new Exception("stack overflow while cast to Array");
                     }
-                    for (int i = 0; i < len; ++i)
+                    int copied = 0;
+                    // number arrays are copied in one call, the rest falls back to the per element path
+                    if (type == typeof(double[]))
+                    {
+                        copied = LuaAPI.xlua_table_todoubles(L, idx, (double[])ary, Math.Min((int)len, ary.Length));
+                    }
+                    else if (type == typeof(float[]))
+                    {
+                        copied = LuaAPI.xlua_table_tofloats(L, idx, (float[])ary, Math.Min((int)len, ary.Length));
+                    }
+                    else if (type == typeof(int[]))
+                    {
+                        copied = LuaAPI.xlua_table_toints(L, idx, (int[])ary, Math.Min((int)len, ary.Length));
+                    }
+                    for (int i = copied; i < len; ++i)
                     {
                         LuaAPI.lua_pushnumber(L, i + 1);
                         LuaAPI.lua_rawget(L, idx);
@@ -645,6 +659,11 @@ namespace XLua
                         return null;
                     }
 
+                    if (type.IsValueType() && translator.structSchemas.TryGet(L, idx, type, target, out obj))
+                    {
+                        return obj;
+                    }
+
                     obj = target == null ? Activator.CreateInstance(type) : target;
 
                     int n = LuaAPI.lua_gettop(L);
@@ -107,6 +107,14 @@ namespace XLua
         internal MethodWrapsCache methodWrapsCache;
         internal ObjectCheckers objectCheckers;
         internal ObjectCasters objectCasters;
+        internal readonly LuaStringCache stringCache = new LuaStringCache();
+
+        internal readonly StructSchemaCache structSchemas = new StructSchemaCache();
+
+#if !GEN_CODE_MINIMIZE
+        //c function pointer -> wrapper of the functions registered by Utils.RegisterDeferrableFunc
+        internal readonly Dictionary<IntPtr, LuaCSFunction> deferrableFunctions = new Dictionary<IntPtr, LuaCSFunction>();
+#endif
 
         internal readonly ObjectPool objects = new ObjectPool();
         internal readonly Dictionary<object, int> reverseMap = new Dictionary<object, int>(new ReferenceEqualsComparer());
@@ -596,6 +604,19 @@ namespace XLua
             }
         }
 
+        //ReleaseLuaBase for the refs queued by finalizers, in one native call
+        internal void ReleaseLuaBases(RealStatePtr L, int[] references, int[] isDelegate, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (isDelegate[i] != 0)
+                {
+                    delegate_bridges.Remove(references[i]);
+                }
+            }
+            LuaAPI.xlua_unref_batch(L, references, isDelegate, count);
+        }
+
 		public object CreateInterfaceBridge(RealStatePtr L, Type interfaceType, int idx)
         {
             Func<int, LuaEnv, LuaBase> creator;
@@ -1208,7 +1229,7 @@ namespace XLua
             }
             else if (lt == LuaTypes.LUA_TSTRING)
             {
-                string sflags = LuaAPI.lua_tostring(L, idx);
+                string sflags = stringCache.Get(L, idx);
                 res = Enum.Parse(type, sflags);
             }
             else 
@@ -1658,6 +1679,12 @@ namespace XLua
             });
         }
 
+        //pushes a struct of number fields as a plain table in one native call, false if its type is not supported
+        public bool TryPushAsTable(RealStatePtr L, object val)
+        {
+            return structSchemas.TryPushAsTable(L, val);
+        }
+
         int decimal_type_id = -1;
 
         public void PushDecimal(RealStatePtr L, decimal val)
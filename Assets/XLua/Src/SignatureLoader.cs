@@ -5,12 +5,15 @@ using Windows.Security.Cryptography;
 using Windows.Security.Cryptography.Core;
 #endif
 using System;
+using System.Text;
+using LuaAPI = XLua.LuaDLL.Lua;
 
 namespace XLua
 {
     public class SignatureLoader
     {
         private LuaEnv.CustomLoader userLoader;
+        private bool useManifest = false;
 #if !UNITY_WSA || UNITY_EDITOR
         RSACryptoServiceProvider rsa;
         SHA1 sha;
@@ -32,6 +35,28 @@ namespace XLua
             userLoader = loader;
         }
 
+        //signedManifest: sha256sum style manifest signed by "FilesSignature -manifest", its signature is
+        //checked once here, scripts are then checked natively against their sha256 and carry no signature.
+        //root: if not null, every file of the manifest under root is hashed now on worker threads, e.g.
+        //a script archive, so a modified file fails here instead of at require
+        public SignatureLoader(string publicKey, byte[] signedManifest, string root, LuaEnv.CustomLoader loader) : this(publicKey, loader)
+        {
+            byte[] manifest = verify(signedManifest, "manifest");
+            if (root != null)
+            {
+                StringBuilder failed = new StringBuilder(1024);
+                int bad = LuaAPI.xlua_verify_files(root, manifest, manifest.Length, 0, failed, failed.Capacity);
+                if (bad != 0)
+                {
+                    throw new InvalidProgramException(bad < 0 ? "malformed manifest!" : failed + " does not match the manifest!");
+                }
+            }
+            else if (LuaAPI.xlua_verify_trust(manifest, manifest.Length) < 0)
+            {
+                throw new InvalidProgramException("malformed manifest!");
+            }
+            useManifest = true;
+        }
 
         byte[] load_and_verify(ref string filepath)
         {
@@ -40,6 +65,19 @@ namespace XLua
             {
                 return null;
             }
+            if (useManifest)
+            {
+                if (!LuaAPI.xlua_verify_buffer(data, data.Length))
+                {
+                    throw new InvalidProgramException(filepath + " is not in the manifest!");
+                }
+                return data;
+            }
+            return verify(data, filepath);
+        }
+
+        byte[] verify(byte[] data, string filepath)
+        {
             if (data.Length < 128)
             {
                 throw new InvalidProgramException(filepath + " length less than 128!");
@@ -116,6 +116,32 @@ namespace XLua
             }
         }
 
+        //runs the deferred calls of functions marked deferrable, the others are called by the native side
+        [MonoPInvokeCallback(typeof(LuaCSFunction))]
+        internal static int ReplayCommands(RealStatePtr L)
+        {
+            try
+            {
+                ObjectTranslator translator = ObjectTranslatorPool.Instance.Find(L);
+                int wrapperid;
+                IntPtr fn;
+                int kind;
+                while ((kind = LuaAPI.xlua_cmdbuf_next(L, out wrapperid, out fn)) > 0)
+                {
+#if GEN_CODE_MINIMIZE
+                    translator.CallCSharpWrapper(L, wrapperid, LuaAPI.lua_gettop(L));
+#else
+                    translator.deferrableFunctions[fn](L);
+#endif
+                }
+                return kind < 0 ? 1 : 0; //-1: the error is on the top, raised when we return
+            }
+            catch (Exception e)
+            {
+                return LuaAPI.luaL_error(L, "c# exception in ReplayCommands:" + e);
+            }
+        }
+
 #if GEN_CODE_MINIMIZE
         [MonoPInvokeCallback(typeof(LuaDLL.CSharpWrapperCaller))]
         internal static int CSharpWrapperCallerImpl(RealStatePtr L, int funcidx, int top)
@@ -786,7 +812,10 @@ namespace XLua
                     byte[] bytes = loader(ref real_file_path);
                     if (bytes != null)
                     {
-                        if (LuaAPI.xluaL_loadbuffer(L, bytes, bytes.Length, "@" + real_file_path) != 0)
+                        //a cached chunk could be swapped on disk, signed scripts are always compiled from the checked bytes
+                        int status = loader.Target is SignatureLoader ? LuaAPI.xluaL_loadbuffer_nocache(L, bytes, bytes.Length, "@" + real_file_path)
+                            : LuaAPI.xluaL_loadbuffer(L, bytes, bytes.Length, "@" + real_file_path);
+                        if (status != 0)
                         {
                             return LuaAPI.luaL_error(L, String.Format("error loading module {0} from CustomLoader, {1}",
                                 LuaAPI.lua_tostring(L, 1), LuaAPI.lua_tostring(L, -1)));
@@ -0,0 +1,156 @@
+﻿/*
+ * Tencent is pleased to support the open source community by making xLua available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+using LuaAPI = XLua.LuaDLL.Lua;
+using RealStatePtr = System.IntPtr;
+
+namespace XLua
+{
+    using System;
+    using System.Collections.Generic;
+    using System.Reflection;
+    using System.Runtime.CompilerServices;
+    using System.Runtime.InteropServices;
+
+    //native schemas of structs whose public fields are all numbers, nested structs of the same kind
+    //or fixed buffers of numbers. a table is copied into such a struct (or a struct into a new
+    //table) in one call, see build/struct_schema.c. other types get a null schema and keep going
+    //through the reflection casters
+    public class StructSchemaCache
+    {
+        // same tags as gen_css_access
+        const int T_STRUCT = 10;
+
+        static readonly Dictionary<Type, int> primitiveTags = new Dictionary<Type, int>()
+        {
+            {typeof(sbyte), 0}, {typeof(byte), 1}, {typeof(short), 2}, {typeof(ushort), 3},
+            {typeof(int), 4}, {typeof(uint), 5}, {typeof(long), 6}, {typeof(ulong), 7},
+            {typeof(float), 8}, {typeof(double), 9},
+        };
+
+        class Schema
+        {
+            public int Reference;
+            public byte[] Buffer;
+        }
+
+        readonly Dictionary<Type, Schema> schemas = new Dictionary<Type, Schema>();
+
+        Schema get(RealStatePtr L, Type type)
+        {
+            Schema schema;
+            if (!schemas.TryGetValue(type, out schema))
+            {
+                schema = register(L, type);
+                schemas.Add(type, schema);
+            }
+            return schema;
+        }
+
+        Schema register(RealStatePtr L, Type type)
+        {
+            if (!type.IsValueType() || type.IsEnum() || type.IsPrimitive() || type.IsGenericType())
+            {
+                return null;
+            }
+            FieldInfo[] fields = type.GetFields(BindingFlags.Public | BindingFlags.Instance);
+            if (fields.Length == 0)
+            {
+                return null;
+            }
+            string[] names = new string[fields.Length];
+            int[] offsets = new int[fields.Length];
+            int[] types = new int[fields.Length];
+            int[] counts = new int[fields.Length];
+            int[] subs = new int[fields.Length];
+            try
+            {
+                for (int i = 0; i < fields.Length; i++)
+                {
+                    Type fieldType = fields[i].FieldType;
+                    names[i] = fields[i].Name;
+                    offsets[i] = (int)Marshal.OffsetOf(type, fields[i].Name);
+                    counts[i] = 1;
+                    subs[i] = -1;
+                    object[] fixedBuffer = fields[i].GetCustomAttributes(typeof(FixedBufferAttribute), false);
+                    if (fixedBuffer.Length > 0)
+                    {
+                        fieldType = (fixedBuffer[0] as FixedBufferAttribute).ElementType;
+                        counts[i] = (fixedBuffer[0] as FixedBufferAttribute).Length;
+                    }
+                    if (!primitiveTags.TryGetValue(fieldType, out types[i]))
+                    {
+                        Schema sub = fixedBuffer.Length > 0 ? null : get(L, fieldType);
+                        if (sub == null)
+                        {
+                            return null;
+                        }
+                        types[i] = T_STRUCT;
+                        subs[i] = sub.Reference;
+                    }
+                }
+                int size = Marshal.SizeOf(type);
+                int reference = LuaAPI.xlua_schema_register(L, size, fields.Length, names, offsets, types, counts, subs);
+                return reference == -1 ? null : new Schema() { Reference = reference, Buffer = new byte[size] };
+            }
+            catch (ArgumentException) // no marshaling layout
+            {
+                return null;
+            }
+        }
+
+        //copies the table at idx into a new struct, or into a copy of target when it is not null.
+        //false if the type has no schema or a field holds a value the native side does not convert
+        public bool TryGet(RealStatePtr L, int idx, Type type, object target, out object obj)
+        {
+            obj = null;
+            Schema schema = get(L, type);
+            if (schema == null)
+            {
+                return false;
+            }
+            GCHandle handle = GCHandle.Alloc(schema.Buffer, GCHandleType.Pinned);
+            try
+            {
+                IntPtr buffer = handle.AddrOfPinnedObject();
+                Marshal.StructureToPtr(target ?? Activator.CreateInstance(type), buffer, false);
+                if (LuaAPI.xlua_table_tostruct(L, idx, schema.Reference, buffer) == 0)
+                {
+                    return false;
+                }
+                obj = Marshal.PtrToStructure(buffer, type);
+                return true;
+            }
+            finally
+            {
+                handle.Free();
+            }
+        }
+
+        //pushes val as a table of its fields, false (nothing pushed) if its type has no schema
+        public bool TryPushAsTable(RealStatePtr L, object val)
+        {
+            Schema schema = val == null ? null : get(L, val.GetType());
+            if (schema == null)
+            {
+                return false;
+            }
+            GCHandle handle = GCHandle.Alloc(schema.Buffer, GCHandleType.Pinned);
+            try
+            {
+                IntPtr buffer = handle.AddrOfPinnedObject();
+                Marshal.StructureToPtr(val, buffer, false);
+                return LuaAPI.xlua_struct_totable(L, schema.Reference, buffer, -1) != 0;
+            }
+            finally
+            {
+                handle.Free();
+            }
+        }
+    }
+}
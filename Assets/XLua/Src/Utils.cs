@@ -1167,6 +1167,17 @@ namespace XLua
             translator.PushCSharpWrapper(L, func);
             LuaAPI.lua_rawset(L, idx);
         }
+
+        //RegisterFunc for the members tagged Deferrable, xlua.defer(f, ...) of them is replayed by LuaEnv.FlushCommands without going back through lua
+        public static void RegisterDeferrableFunc(RealStatePtr L, int idx, string name, CSharpWrapper func)
+        {
+            ObjectTranslator translator = ObjectTranslatorPool.Instance.Find(L);
+            idx = abs_idx(LuaAPI.lua_gettop(L), idx);
+            LuaAPI.xlua_pushasciistring(L, name);
+            translator.PushCSharpWrapper(L, func);
+            LuaAPI.xlua_cmdbuf_mark(L, -1);
+            LuaAPI.lua_rawset(L, idx);
+        }
 #else
 		public static void RegisterFunc(RealStatePtr L, int idx, string name, LuaCSFunction func)
 		{
@@ -1175,6 +1186,21 @@ namespace XLua
 			LuaAPI.lua_pushstdcallcfunction(L, func);
 			LuaAPI.lua_rawset(L, idx);
 		}
+
+        //RegisterFunc for the members tagged Deferrable, xlua.defer(f, ...) of them is replayed by LuaEnv.FlushCommands without going back through lua
+        public static void RegisterDeferrableFunc(RealStatePtr L, int idx, string name, LuaCSFunction func)
+        {
+            ObjectTranslator translator = ObjectTranslatorPool.Instance.Find(L);
+            idx = abs_idx(LuaAPI.lua_gettop(L), idx);
+            LuaAPI.xlua_pushasciistring(L, name);
+            LuaAPI.lua_pushstdcallcfunction(L, func);
+            IntPtr fn = LuaAPI.xlua_cmdbuf_mark(L, -1);
+            if (fn != IntPtr.Zero)
+            {
+                translator.deferrableFunctions[fn] = func;
+            }
+            LuaAPI.lua_rawset(L, idx);
+        }
 #endif
 
 		public static void RegisterLazyFunc(RealStatePtr L, int idx, string name, Type type, LazyMemberTypes memberType, bool isStatic)
@@ -1,6 +1,7 @@
 using System;
 using System.IO;
 using System.Security.Cryptography;
+using System.Text;
 
 namespace XLua
 {
@@ -9,6 +10,38 @@ namespace XLua
         static void usage()
         {
             Console.WriteLine("FilesSignature from_path to_path");
+            Console.WriteLine("FilesSignature -manifest from_path manifest_file");
+        }
+
+        static void doManifest(string root, string dir, SHA256 sha256, StringBuilder manifest)
+        {
+            foreach (var filename in Directory.GetFiles(dir))
+            {
+                byte[] digest = sha256.ComputeHash(File.ReadAllBytes(filename));
+                manifest.Append(BitConverter.ToString(digest).Replace("-", "").ToLower());
+                manifest.Append("  ");
+                manifest.Append(filename.Substring(root.Length).TrimStart('/', '\\').Replace('\\', '/'));
+                manifest.Append('\n');
+            }
+            foreach (var subdir in Directory.GetDirectories(dir))
+            {
+                doManifest(root, subdir, sha256, manifest);
+            }
+        }
+
+        //a signed sha256 manifest of every file under from, for SignatureLoader(publicKey, signedManifest, ...)
+        static void doSignedManifest(string from, string to, SHA1 sha, RSACryptoServiceProvider rsa)
+        {
+            StringBuilder manifest = new StringBuilder();
+            doManifest(from, from, new SHA256Managed(), manifest);
+            byte[] content = Encoding.UTF8.GetBytes(manifest.ToString());
+            byte[] sig = rsa.SignData(content, sha);
+            using (FileStream fs = new FileStream(to, FileMode.Create))
+            {
+                fs.Write(sig, 0, sig.Length);
+                fs.Write(content, 0, content.Length);
+                fs.Flush();
+            }
         }
 
         static void doSignature(string from, string to, SHA1 sha, RSACryptoServiceProvider rsa)
@@ -44,7 +77,8 @@ namespace XLua
                 return;
             }
 
-            if (args.Length != 2)
+            bool manifest = args.Length == 3 && args[0] == "-manifest";
+            if (args.Length != 2 && !manifest)
             {
                 usage();
                 return;
@@ -53,7 +87,14 @@ namespace XLua
             SHA1 sha = new SHA1CryptoServiceProvider();
             RSACryptoServiceProvider rsa = new RSACryptoServiceProvider();
             rsa.FromXmlString(File.ReadAllText("key_rsa"));
-            doSignature(args[0], args[1], sha, rsa);
+            if (manifest)
+            {
+                doSignedManifest(args[1], args[2], sha, rsa);
+            }
+            else
+            {
+                doSignature(args[0], args[1], sha, rsa);
+            }
         }
     }
 }
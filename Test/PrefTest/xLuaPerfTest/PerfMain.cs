@@ -65,6 +65,9 @@ public class PerfMain : MonoBehaviour {
 			StartAddRemoveCB ();
 			StartCSCallLuaCB ();
 			StartConstruct ();
+			StartStateLifetime ();
+			StartMsgpack ();
+			StartCjson ();
 
 			sw.Close ();
 		}
@@ -324,6 +327,91 @@ public class PerfMain : MonoBehaviour {
         PerformentTest("lua construct struct : ", LOOP_TIMES, func);
 	}
 
+    //a short-lived state: create, open libs, 2000 units updated for 20 rounds, close
+    const string STATE_LIFETIME_SCRIPT = @"
+local units = {}
+for i = 1, 2000 do
+    units[i] = { id = i, hp = 100, pos = { x = i, y = i }, name = 'u' .. i, buffs = {} }
+end
+for round = 1, 20 do
+    for i = 1, #units do
+        local u = units[i]
+        u.hp = u.hp - 1
+        u.buffs[#u.buffs + 1] = { round = round }
+        u.pos = { x = u.pos.x + 1, y = u.pos.y }
+    end
+end";
+
+	private void StartStateLifetime()
+	{
+        int LOOP_TIMES = 200;
+        Debug.Log ("lua state create & close :");
+		sw.WriteLine ("lua state create & close :");
+
+        PerformentTest("lua state create & close : default allocator : ", LOOP_TIMES, loop_times =>
+        {
+            for (int i = 0; i < loop_times; i++)
+            {
+                using (LuaEnv env = new LuaEnv())
+                {
+                    env.DoString(STATE_LIFETIME_SCRIPT);
+                }
+            }
+        });
+
+        PerformentTest("lua state create & close : arena allocator : ", LOOP_TIMES, loop_times =>
+        {
+            for (int i = 0; i < loop_times; i++)
+            {
+                using (LuaEnv env = new LuaEnv(true))
+                {
+                    env.DoString(STATE_LIFETIME_SCRIPT);
+                }
+            }
+        });
+	}
+
+	private void StartMsgpack()
+	{
+        int LOOP_TIMES = 100000;
+        Debug.Log ("msgpack nested message :");
+		sw.WriteLine ("msgpack nested message :");
+
+		PerfTest func = luaenv.Global.Get<PerfTest> ("MsgpackPackNested");
+        PerformentTest("msgpack nested message : pack : ", LOOP_TIMES, func);
+
+		func = luaenv.Global.Get<PerfTest> ("MsgpackPackNestedLength");
+        PerformentTest("msgpack nested message : pack, length mode : ", LOOP_TIMES, func);
+
+		func = luaenv.Global.Get<PerfTest> ("MsgpackUnpackNested");
+        PerformentTest("msgpack nested message : unpack : ", LOOP_TIMES, func);
+	}
+
+	private void StartCjson()
+	{
+        int LOOP_TIMES = 100000;
+        Debug.Log ("cjson :");
+		sw.WriteLine ("cjson :");
+
+		PerfTest func = luaenv.Global.Get<PerfTest> ("CjsonEncodeEvent");
+        PerformentTest("cjson : encode event : ", LOOP_TIMES, func);
+
+		func = luaenv.Global.Get<PerfTest> ("CjsonDecodeEvent");
+        PerformentTest("cjson : decode event : ", LOOP_TIMES, func);
+
+		func = luaenv.Global.Get<PerfTest> ("CjsonEncodeDoubles");
+        PerformentTest("cjson : encode 100 doubles, precision 14 : ", LOOP_TIMES / 10, func);
+
+		func = luaenv.Global.Get<PerfTest> ("CjsonEncodeDoublesRoundTrip");
+        PerformentTest("cjson : encode 100 doubles, precision 0 : ", LOOP_TIMES / 10, func);
+
+		func = luaenv.Global.Get<PerfTest> ("CjsonEncodeLongString");
+        PerformentTest("cjson : encode 90KB string : ", LOOP_TIMES / 100, func);
+
+		func = luaenv.Global.Get<PerfTest> ("CjsonDecodeLongString");
+        PerformentTest("cjson : decode 90KB string : ", LOOP_TIMES / 100, func);
+	}
+
 	private void StartAddRemoveCB()
 	{
         int LOOP_TIMES = 200000;
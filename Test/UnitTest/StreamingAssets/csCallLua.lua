@@ -623,6 +623,20 @@ function CMyTestCaseCSCallLua.testLuaTableGetSetKeyValue_struct(self)
 	ASSERT_EQ(ret.result, true)
 end
 
+function CMyTestCaseCSCallLua.testLuaTableGetSetKeyValue_schemaStruct(self)
+    self.count = 1 + self.count
+	local ret = self.tcForTestCSCallLuaObj:testLuaTableGetSetKeyValue_schemaStruct()
+	print(ret.msg)
+	ASSERT_EQ(ret.result, true)
+end
+
+function CMyTestCaseCSCallLua.testDeferSetStruct(self)
+    self.count = 1 + self.count
+	local ret = self.tcForTestCSCallLuaObj:testDeferSetStruct()
+	print(ret.msg)
+	ASSERT_EQ(ret.result, true)
+end
+
 function CMyTestCaseCSCallLua.testLuaTableGetSetKeyValue_class(self)
     self.count = 1 + self.count
 	local ret = self.tcForTestCSCallLuaObj:testLuaTableGetSetKeyValue_class()
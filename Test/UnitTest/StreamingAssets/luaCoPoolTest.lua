@@ -0,0 +1,99 @@
+require("ltest.init")
+
+-- for test case
+CMyTestCaseLuaCoPool = TestCase:new()
+function CMyTestCaseLuaCoPool:new(oo)
+    local o = oo or {}
+    o.count = 1
+    
+    setmetatable(o, self)
+    self.__index = self
+    return o
+end
+
+function CMyTestCaseLuaCoPool.SetUpTestCase(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaCoPool.SetUpTestCase")
+end
+
+function CMyTestCaseLuaCoPool.TearDownTestCase(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaCoPool.TearDownTestCase")
+end
+
+function CMyTestCaseLuaCoPool.SetUp(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaCoPool.SetUp")
+end
+
+function CMyTestCaseLuaCoPool.TearDown(self)
+    self.count = 1 + self.count
+	xlua.co_pool(256)
+	print("CMyTestCaseLuaCoPool.TearDown")
+end
+
+function CMyTestCaseLuaCoPool.CaseSpawn_1(self)
+    self.count = 1 + self.count
+	local ok, sum, product = xlua.co_spawn(function(x, y) return x + y, x * y end, 3, 4)
+	ASSERT_EQ(ok, true)
+	ASSERT_EQ(sum, 7)
+	ASSERT_EQ(product, 12)
+	local ok2, err = xlua.co_spawn(function() error("boom") end)
+	ASSERT_EQ(ok2, false)
+	ASSERT_TRUE(string.find(err, "boom") ~= nil)
+end
+
+function CMyTestCaseLuaCoPool.CaseSpawn_2(self)
+    self.count = 1 + self.count
+	local waiting = {}
+	local done = 0
+	for i = 1, 10 do
+		xlua.co_spawn(function(i)
+			waiting[i] = coroutine.running()
+			ASSERT_EQ(coroutine.yield(), i * 2)
+			done = done + 1
+		end, i)
+	end
+	for i = 1, 10 do
+		ASSERT_EQ(coroutine.resume(waiting[i], i * 2), true)
+	end
+	ASSERT_EQ(done, 10)
+end
+
+function CMyTestCaseLuaCoPool.CaseSpawn_3(self)
+    self.count = 1 + self.count
+	local co
+	xlua.co_spawn(function() co = coroutine.running() end)
+	ASSERT_EQ(coroutine.status(co), "dead")
+	local ok = coroutine.resume(co)
+	ASSERT_EQ(ok, false)
+end
+
+function CMyTestCaseLuaCoPool.CasePool_1(self)
+    self.count = 1 + self.count
+	for i = 1, 8 do
+		xlua.co_spawn(function() end)
+	end
+	ASSERT_EQ(xlua.co_pool(2), 256)
+	ASSERT_TRUE(xlua.co_stats().idle <= 2)
+	ASSERT_EQ(xlua.co_pool(), 2)
+	xlua.co_pool(0)
+	ASSERT_EQ(xlua.co_stats().idle, 0)
+end
+
+function CMyTestCaseLuaCoPool.CaseStats_1(self)
+    self.count = 1 + self.count
+	if _VERSION == "Lua 5.1" then -- luajit and 5.1 builds create a thread per spawn
+		return
+	end
+	xlua.co_spawn(function() end)
+	local before = xlua.co_stats()
+	for i = 1, 100 do
+		xlua.co_spawn(function() end)
+	end
+	local after = xlua.co_stats()
+	ASSERT_EQ(after.capacity, 256)
+	ASSERT_EQ(after.recycled - before.recycled, 100)
+	ASSERT_EQ(after.reused - before.reused, 100)
+	ASSERT_EQ(after.created, before.created)
+end
@@ -0,0 +1,129 @@
+require("ltest.init")
+
+local msgpack = msgpack or require 'msgpack'
+
+local function first_byte(s)
+	return string.byte(s, 1)
+end
+
+local function count_keys(t)
+	local n = 0
+	for _ in pairs(t) do n = n + 1 end
+	return n
+end
+
+-- for test case
+CMyTestCaseLuaMsgpack = TestCase:new()
+function CMyTestCaseLuaMsgpack:new(oo)
+    local o = oo or {}
+    o.count = 1
+    
+    setmetatable(o, self)
+    self.__index = self
+    return o
+end
+
+function CMyTestCaseLuaMsgpack.SetUpTestCase(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaMsgpack.SetUpTestCase")
+end
+
+function CMyTestCaseLuaMsgpack.TearDownTestCase(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaMsgpack.TearDownTestCase")
+end
+
+function CMyTestCaseLuaMsgpack.SetUp(self)
+    self.count = 1 + self.count
+	print("CMyTestCaseLuaMsgpack.SetUp")
+end
+
+function CMyTestCaseLuaMsgpack.TearDown(self)
+    self.count = 1 + self.count
+	msgpack.set_pack_mode("exact")
+	print("CMyTestCaseLuaMsgpack.TearDown")
+end
+
+function CMyTestCaseLuaMsgpack.CaseArrayMt_1(self)
+    self.count = 1 + self.count
+	local s = msgpack.pack(setmetatable({}, msgpack.array_mt))
+	ASSERT_EQ(first_byte(s), 0x90)
+	ASSERT_EQ(count_keys(msgpack.unpack(s)), 0)
+end
+
+function CMyTestCaseLuaMsgpack.CaseArrayMt_2(self)
+    self.count = 1 + self.count
+	local s = msgpack.pack(setmetatable({1, 2, x = 3}, msgpack.array_mt))
+	ASSERT_EQ(first_byte(s), 0x92)
+	local t = msgpack.unpack(s)
+	ASSERT_EQ(count_keys(t), 2)
+	ASSERT_EQ(t[2], 2)
+	ASSERT_EQ(t.x, nil)
+end
+
+function CMyTestCaseLuaMsgpack.CaseMapMt_1(self)
+    self.count = 1 + self.count
+	local s = msgpack.pack(setmetatable({}, msgpack.map_mt))
+	ASSERT_EQ(first_byte(s), 0x80)
+end
+
+function CMyTestCaseLuaMsgpack.CaseMapMt_2(self)
+    self.count = 1 + self.count
+	local s = msgpack.pack(setmetatable({10, 20}, msgpack.map_mt))
+	ASSERT_EQ(first_byte(s), 0x82)
+	local t = msgpack.unpack(s)
+	ASSERT_EQ(t[1], 10)
+	ASSERT_EQ(t[2], 20)
+end
+
+function CMyTestCaseLuaMsgpack.CasePackMode_1(self)
+    self.count = 1 + self.count
+	ASSERT_EQ(first_byte(msgpack.pack({1, 2, x = 3})), 0x83)
+	ASSERT_EQ(msgpack.set_pack_mode("length"), "exact")
+	local s = msgpack.pack({1, 2, x = 3})
+	ASSERT_EQ(first_byte(s), 0x92)
+	ASSERT_EQ(count_keys(msgpack.unpack(s)), 2)
+	ASSERT_EQ(first_byte(msgpack.pack({x = 3})), 0x81)
+	ASSERT_EQ(first_byte(msgpack.pack(setmetatable({1, 2}, msgpack.map_mt))), 0x82)
+	ASSERT_EQ(msgpack.set_pack_mode("exact"), "length")
+	ASSERT_EQ(first_byte(msgpack.pack({1, 2, x = 3})), 0x83)
+end
+
+function CMyTestCaseLuaMsgpack.CasePackMode_2(self)
+    self.count = 1 + self.count
+	local ok, ret = pcall(msgpack.set_pack_mode, "bogus")
+	ASSERT_TRUE(not ok or ret == nil)
+	ASSERT_EQ(msgpack.set_pack_mode("exact"), "exact")
+end
+
+function CMyTestCaseLuaMsgpack.CaseNestedMessage_1(self)
+    self.count = 1 + self.count
+	local msg = {
+		cmd = "sync", seq = 7,
+		player = {id = 7, name = "player7", hp = 1200.5, pos = {x = 1.5, y = 2.5}, buffs = {101, 102}},
+		items = {{id = 1, count = 3}, {id = 2, count = 1}},
+	}
+	for _, mode in ipairs({"exact", "length"}) do
+		msgpack.set_pack_mode(mode)
+		local t = msgpack.unpack(msgpack.pack(msg))
+		ASSERT_EQ(t.cmd, "sync")
+		ASSERT_EQ(t.player.name, "player7")
+		ASSERT_EQ(t.player.pos.y, 2.5)
+		ASSERT_EQ(t.player.buffs[2], 102)
+		ASSERT_EQ(t.items[2].count, 1)
+	end
+end
+
+function CMyTestCaseLuaMsgpack.CaseDictLarge_1(self)
+    self.count = 1 + self.count
+	local keys = {}
+	for i = 1, 20000 do
+		keys[i] = "key" .. i
+	end
+	local dict = msgpack.newdict(keys)
+	ASSERT_EQ(dict:size(), 20000)
+	for i = 1, 20000, 97 do
+		ASSERT_EQ(dict:id(keys[i]), i - 1)
+	end
+	ASSERT_EQ(dict:id("key0"), nil)
+end
@@ -3,6 +3,8 @@ require("luaCallCs")
 require("luaCallCsReflect") 
 require("csCallLua")
 require("genCode")
+require("luaMsgpackTest")
+require("luaCoPoolTest")
 --require("luaTdrTest")
 function islua53() return not not math.type end
 -- for test case
@@ -35,6 +37,8 @@ co = coroutine.create(function()
 	AddLTestSuite(CMyTestCaseLuaCallCSReflect:new(), "CMyTestCaseLuaCallCSReflect", "Case")
 	--AddLTestSuite(CMyTestCaseGenCode:new(), "CMyTestCaseGenCode", "Case")
 	AddLTestSuite(CMyTestCaseCSCallLua:new(), "CMyTestCaseCSCallLua", "test")
+	AddLTestSuite(CMyTestCaseLuaMsgpack:new(), "CMyTestCaseLuaMsgpack", "Case")
+	AddLTestSuite(CMyTestCaseLuaCoPool:new(), "CMyTestCaseLuaCoPool", "Case")
 	--AddLTestSuite(CMyTestCaseLuaTdr:new(), "CMyTestCaseLuaTdr", "Case")
 	
 	RunAllTests(CMyTestEnv:new())
@@ -61,6 +65,8 @@ function main()
 	AddLTestSuite(CMyTestCaseLuaCallCSReflect:new(), "CMyTestCaseLuaCallCSReflect", "Case")
 	--AddLTestSuite(CMyTestCaseGenCode:new(), "CMyTestCaseGenCode", "Case")
 	AddLTestSuite(CMyTestCaseCSCallLua:new(), "CMyTestCaseCSCallLua", "test")
+	AddLTestSuite(CMyTestCaseLuaMsgpack:new(), "CMyTestCaseLuaMsgpack", "Case")
+	AddLTestSuite(CMyTestCaseLuaCoPool:new(), "CMyTestCaseLuaCoPool", "Case")
 	--AddLTestSuite(CMyTestCaseLuaTdr:new(), "CMyTestCaseLuaTdr", "Case")
 	RunAllTests(CMyTestEnv:new())
 	
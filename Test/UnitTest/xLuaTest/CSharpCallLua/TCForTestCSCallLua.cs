@@ -60,6 +60,31 @@ public struct TestStruct
     public Pedding e;
 }
 
+public struct SchemaStructInner
+{
+    public short x;
+    public ushort y;
+}
+
+// no GCOptimize, tables reach it through the struct schema of ObjectCasters
+public struct SchemaStruct
+{
+    public const int Version = 1;
+    public static float Epsilon = 1e-5f;
+    public int a;
+    public long b;
+    public float c;
+    public double d;
+    public SchemaStructInner inner;
+}
+
+[LuaCallCSharp]
+public class DeferTarget
+{
+    [Deferrable]
+    public static int StaticValue { get; set; }
+}
+
 [LuaCallCSharp]
 public class TCForTestCSCallLua{
 	public static LuaEnv luaEnv = LuaEnvSingletonForTest.Instance;
@@ -2889,6 +2914,99 @@ public class TCForTestCSCallLua{
         return result;
     }
 
+    static int SchemaStructToTable(IntPtr L)
+    {
+        ObjectTranslator translator = ObjectTranslatorPool.Instance.Find(L);
+        SchemaStruct val = (SchemaStruct)translator.GetObject(L, 1, typeof(SchemaStruct));
+        if (!translator.TryPushAsTable(L, val))
+        {
+            XLua.LuaDLL.Lua.lua_pushnil(L);
+        }
+        return 1;
+    }
+
+    public TestResult testLuaTableGetSetKeyValue_schemaStruct()
+    {
+
+        string caseName = "testLuaTableGetSetKeyValue_schemaStruct: ";
+        LOG("*************" + caseName);
+        TestResult result;
+
+        luaEnv.Global.Set("schemaStructToTable", new XLua.LuaDLL.lua_CSFunction(SchemaStructToTable));
+        luaEnv.DoString(@"
+            schemaTable1 = {a = -7, b = 1099511627776, c = 1.5, d = 0.25, inner = {x = -3, y = 65535}}
+            schemaTable2 = schemaStructToTable(schemaTable1)
+        ");
+
+        SchemaStruct s1 = luaEnv.Global.Get<SchemaStruct>("schemaTable1");
+        LOG("a = " + s1.a + ", b = " + s1.b + ", c = " + s1.c + ", d = " + s1.d + ", inner.x = " + s1.inner.x + ", inner.y = " + s1.inner.y + "; ");
+        if (s1.a == -7 && s1.b == 1099511627776 && s1.c == 1.5f && s1.d == 0.25 && s1.inner.x == -3 && s1.inner.y == 65535)
+        {
+            setResult(true, "pass", out result);
+        }
+        else
+        {
+            setResult(false, "(1) table to struct failed", out result);
+        }
+
+        LuaTable t2 = luaEnv.Global.Get<LuaTable>("schemaTable2");
+        if (t2 == null)
+        {
+            updateResult(false, "(2) struct to table returned nil", ref result);
+        }
+        else
+        {
+            SchemaStruct s2 = luaEnv.Global.Get<SchemaStruct>("schemaTable2");
+            if (!s1.Equals(s2) || t2.Get<LuaTable>("inner").Get<int>("y") != 65535)
+            {
+                updateResult(false, "(3) struct does not survive the round trip", ref result);
+            }
+            t2.Dispose();
+        }
+
+        LOG(caseName + result.ToString());
+        return result;
+    }
+
+    public TestResult testDeferSetStruct()
+    {
+
+        string caseName = "testDeferSetStruct: ";
+        LOG("*************" + caseName);
+        TestResult result;
+
+        DeferTarget.StaticValue = 0;
+        luaEnv.DoString(@"
+            deferStruct = CS.TestStruct(1, 2)
+            xlua.defer_set(deferStruct, 'a', 10)
+            xlua.defer_set(CS.DeferTarget, 'StaticValue', 20)
+        ");
+
+        if (luaEnv.Global.Get<TestStruct>("deferStruct").a != 1 || DeferTarget.StaticValue != 0)
+        {
+            setResult(false, "(1) defer_set ran before the flush", out result);
+        }
+        else
+        {
+            setResult(true, "pass", out result);
+        }
+
+        luaEnv.FlushCommands();
+        TestStruct s = luaEnv.Global.Get<TestStruct>("deferStruct");
+        LOG("deferStruct.a = " + s.a + ", DeferTarget.StaticValue = " + DeferTarget.StaticValue + "; ");
+        if (s.a != 10)
+        {
+            updateResult(false, "(2) the setter did not change the struct the receiver holds, a is " + s.a, ref result);
+        }
+        if (DeferTarget.StaticValue != 20)
+        {
+            updateResult(false, "(3) the static setter was not replayed, value is " + DeferTarget.StaticValue, ref result);
+        }
+
+        LOG(caseName + result.ToString());
+        return result;
+    }
+
     public TestResult testLuaTableGetSetKeyValue_class()
     {
 
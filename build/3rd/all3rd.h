@@ -11,71 +11,344 @@
 #include <ws2tcpip.h>
 #endif
 
+/*
+** XLUA_3RD_<NAME>=0 compiles a library out, see the XLUA_3RD_* options in CMakeLists.txt.
+** XLUA_3RD_LAZY=1 registers the libraries in package.preload, they are opened by the first
+** require or the first read of their global.
+*/
 
+#ifndef XLUA_3RD_LCSOCK
+#define XLUA_3RD_LCSOCK 1
+#endif
+#ifndef XLUA_3RD_LDUMP
+#define XLUA_3RD_LDUMP 1
+#endif
+#ifndef XLUA_3RD_MSGPACK
+#define XLUA_3RD_MSGPACK 1
+#endif
+#ifndef XLUA_3RD_CJSON
+#define XLUA_3RD_CJSON 1
+#endif
+#ifndef XLUA_3RD_LRC4
+#define XLUA_3RD_LRC4 1
+#endif
+#ifndef XLUA_3RD_MISC
+#define XLUA_3RD_MISC 1
+#endif
+#ifndef XLUA_3RD_LUNIQ
+#define XLUA_3RD_LUNIQ 1
+#endif
+#ifndef XLUA_3RD_PROC
+#define XLUA_3RD_PROC 1
+#endif
+#ifndef XLUA_3RD_LZF
+#define XLUA_3RD_LZF 1
+#endif
+#ifndef XLUA_3RD_LFS
+#define XLUA_3RD_LFS 1
+#endif
+#ifndef XLUA_3RD_LSINFO
+#define XLUA_3RD_LSINFO 1
+#endif
+#ifndef XLUA_3RD_LSKIPLIST
+#define XLUA_3RD_LSKIPLIST 1
+#endif
+#ifndef XLUA_3RD_LSPROTO
+#define XLUA_3RD_LSPROTO 1
+#endif
+#ifndef XLUA_3RD_LPEG
+#define XLUA_3RD_LPEG 1
+#endif
+#ifndef XLUA_3RD_LTRACE
+#define XLUA_3RD_LTRACE 1
+#endif
+#ifndef XLUA_3RD_LCOREDUMP
+#define XLUA_3RD_LCOREDUMP 1
+#endif
+#ifndef XLUA_3RD_LLZ4
+#define XLUA_3RD_LLZ4 1
+#endif
+#ifndef XLUA_3RD_LHEAP
+#define XLUA_3RD_LHEAP 1
+#endif
+#ifndef XLUA_3RD_LSQLITE3
+#define XLUA_3RD_LSQLITE3 1
+#endif
+#ifndef XLUA_3RD_LAZY
+#define XLUA_3RD_LAZY 0
+#endif
+
+#if XLUA_3RD_LCSOCK
 # include "lcsock.c"
+#define XX_LCSOCK(XX) XX(lcsock, luaopen_lcsock)
+#else
+#define XX_LCSOCK(XX)
+#endif
+
+#if XLUA_3RD_LDUMP
 # include "ldump.c"
+#define XX_LDUMP(XX) XX(ldump, luaopen_ldump)
+#else
+#define XX_LDUMP(XX)
+#endif
+
+#if XLUA_3RD_MSGPACK
 # include "lmsgpack.c"
+#define XX_MSGPACK(XX) XX(msgpack, luaopen_msgpack)
+#else
+#define XX_MSGPACK(XX)
+#endif
+
+#if XLUA_3RD_CJSON
 # include "lcjson/strbuf.c"
+# include "lcjson/fpconv.c"
 # include "lcjson/lcjson.c"
+#define XX_CJSON(XX) XX(cjson, luaopen_cjson)
+#else
+#define XX_CJSON(XX)
+#endif
+
+#if XLUA_3RD_LRC4
 #include "rc4/lrc4.c"
-#include "rc4/rc4.c"
+#define XX_LRC4(XX) XX(lrc4, luaopen_lrc4)
+#else
+#define XX_LRC4(XX)
+#endif
+#if XLUA_3RD_LRC4 || XLUA_3RD_MISC
+#include "rc4/rc4.c" //misc decrypts sources with it
+#endif
+
+#if XLUA_3RD_MISC
 # include "lmisc.c"
+#define XX_MISC(XX) XX(misc, luaopen_misc)
+#else
+#define XX_MISC(XX)
+#endif
+
+#if XLUA_3RD_LUNIQ
 # include "luniq/handlemap.c"
 # include "luniq/luniq.c"
+#define XX_LUNIQ(XX) XX(luniq, luaopen_luniq)
+#else
+#define XX_LUNIQ(XX)
+#endif
+
+#if XLUA_3RD_PROC
 # include "proc/proc.h"
 # include "proc/proc.c"
 # include "proc/lproc.c"
+#define XX_PROC(XX) XX(proc, luaopen_proc)
+#else
+#define XX_PROC(XX)
+#endif
+
+#if XLUA_3RD_LZF
 #include "llzf/lzf_c.c"
 #include "llzf/lzf_d.c"
 #include "llzf/llzf.c"
+#define XX_LZF(XX) XX(lzf, luaopen_lzf)
+#else
+#define XX_LZF(XX)
+#endif
+
+#if XLUA_3RD_LFS
 # include "lfs.c"
+#define XX_LFS(XX) XX(lfs, luaopen_lfs)
+#else
+#define XX_LFS(XX)
+#endif
 
+#if XLUA_3RD_LSINFO
 # include "lsinfo.c"
+#define XX_LSINFO(XX) XX(lsinfo, luaopen_lsinfo)
+#else
+#define XX_LSINFO(XX)
+#endif
+
+#if XLUA_3RD_LSKIPLIST
 #include "skiplist/skiplist.c"
 #include "skiplist/lskiplist.c"
+#define XX_LSKIPLIST(XX) XX(lskiplist, luaopen_lskiplist)
+#else
+#define XX_LSKIPLIST(XX)
+#endif
 
-
+#if XLUA_3RD_LSPROTO
 #include "sproto/sproto.c"
 #include "sproto/lsproto.c"
+#define XX_LSPROTO(XX) XX(lsproto, luaopen_lsproto)
+#else
+#define XX_LSPROTO(XX)
+#endif
 
+#if XLUA_3RD_LPEG
 #include "lpeg/lpcap.c"
 #include "lpeg/lpcode.c"
 #include "lpeg/lpprint.c"
 #include "lpeg/lptree.c"
 #include "lpeg/lpvm.c"
+#define XX_LPEG(XX) XX(lpeg, luaopen_lpeg)
+#else
+#define XX_LPEG(XX)
+#endif
+
+#if XLUA_3RD_LTRACE
 # include "ltrace.c"
+#define XX_LTRACE(XX) XX(ltrace, luaopen_ltrace)
+#else
+#define XX_LTRACE(XX)
+#endif
+
+#if XLUA_3RD_LCOREDUMP
 # include "lcoredump.c"
+#define XX_LCOREDUMP(XX) XX(lcoredump, luaopen_lcoredump)
+#else
+#define XX_LCOREDUMP(XX)
+#endif
+
+#if XLUA_3RD_LLZ4
 #include "llz4/lua_lz4.c"
+#define XX_LLZ4(XX) XX(llz4, luaopen_llz4)
+#else
+#include "llz4/lz4/lz4.c" //script_archive.c inflates with it
+#define XX_LLZ4(XX)
+#endif
+
+#if XLUA_3RD_LHEAP
 #include "lheap.c"
+#define XX_LHEAP(XX) XX(lheap, luaopen_lheap)
+#else
+#define XX_LHEAP(XX)
+#endif
 
+#if XLUA_3RD_LSQLITE3
 #define SQLITE_OMIT_PROGRESS_CALLBACK 1
 #include "lsqlite/sqlite3.h"
 #include "lsqlite/lsqlite3.c"
 #include "lsqlite/sqlite3.c"
+#define XX_LSQLITE3(XX) XX(lsqlite3, luaopen_lsqlite3)
+#else
+#define XX_LSQLITE3(XX)
+#endif
 
 
 
 #define EXTEND_LUA_LIB_MAP(XX)            \
-	XX(lcsock, luaopen_lcsock)        \
-	XX(ldump, luaopen_ldump)          \
-	XX(msgpack, luaopen_msgpack)      \
-	XX(cjson, luaopen_cjson)          \
-	XX(lrc4, luaopen_lrc4)            \
-	XX(misc, luaopen_misc)            \
-	XX(luniq, luaopen_luniq)          \
-	XX(proc, luaopen_proc)            \
-	XX(lzf, luaopen_lzf)              \
-	XX(lfs, luaopen_lfs)              \
-	XX(lsinfo, luaopen_lsinfo)        \
-	XX(lskiplist, luaopen_lskiplist)  \
-	XX(lsproto, luaopen_lsproto)      \
-	XX(lpeg, luaopen_lpeg)            \
-	XX(ltrace, luaopen_ltrace)        \
-	XX(lcoredump, luaopen_lcoredump)  \
-	XX(llz4, luaopen_llz4)\
-	XX(lheap, luaopen_lheap)\
-	XX(lsqlite3, luaopen_lsqlite3)    \
+	XX_LCSOCK(XX)                     \
+	XX_LDUMP(XX)                      \
+	XX_MSGPACK(XX)                    \
+	XX_CJSON(XX)                      \
+	XX_LRC4(XX)                       \
+	XX_MISC(XX)                       \
+	XX_LUNIQ(XX)                      \
+	XX_PROC(XX)                       \
+	XX_LZF(XX)                        \
+	XX_LFS(XX)                        \
+	XX_LSINFO(XX)                     \
+	XX_LSKIPLIST(XX)                  \
+	XX_LSPROTO(XX)                    \
+	XX_LPEG(XX)                       \
+	XX_LTRACE(XX)                     \
+	XX_LCOREDUMP(XX)                  \
+	XX_LLZ4(XX)                       \
+	XX_LHEAP(XX)                      \
+	XX_LSQLITE3(XX)                   \
+
+
+#if XLUA_3RD_LAZY
+
+#if LUA_VERSION_NUM == 501
+#define lazy3rd_pushglobals(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+#else
+#define lazy3rd_pushglobals(L) lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS)
+#endif
+
+static int lazy3rd_tag = 0;
+
+//package.preload entry, upvalue 1 is the luaopen function
+static int lazy3rd_open(lua_State *L)
+{
+	lua_settop(L, 1);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_call(L, 0, 1);
+	//keep the global the eager mode used to set
+	lazy3rd_pushglobals(L);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return 1;
+}
+
+//_G.__index, opens a library on the first read of its global
+static int lazy3rd_index(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_type(L, 2) != LUA_TSTRING) {
+		return 0;
+	}
+	lua_pushlightuserdata(L, &lazy3rd_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (!lua_isfunction(L, -1)) {
+		return 0;
+	}
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_getfield(L, -1, lua_tostring(L, 2));
+	if (!lua_isnil(L, -1)) { //already required, the global was removed on purpose
+		return 0;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, -3);
+	lua_pushvalue(L, 2);
+	lua_call(L, 1, 1);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_settable(L, -4); //package.loaded[name] = lib, like require does
+	return 1;
+}
 
+static void lazy3rd_register(lua_State *L, const char *name, lua_CFunction openfunc)
+{
+	//stack: preload, lazy
+	lua_pushcfunction(L, openfunc);
+	lua_pushcclosure(L, lazy3rd_open, 1);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -4, name);
+	lua_setfield(L, -2, name);
+}
+
+void luaopen_all3rd(lua_State *L)
+{
+	int top = lua_gettop(L);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_remove(L, -2);
+	lua_newtable(L);
+	lua_pushlightuserdata(L, &lazy3rd_tag);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+#define XX(libname, openfunc) lazy3rd_register(L, #libname, openfunc);
+	EXTEND_LUA_LIB_MAP(XX)
+#undef XX
+
+	//a metatable set later on _G replaces this one, require keeps working then
+	lazy3rd_pushglobals(L);
+	if (!lua_getmetatable(L, -1)) {
+		lua_newtable(L);
+		lua_pushcfunction(L, lazy3rd_index);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
+	}
+
+	lua_settop(L, top);
+}
+
+#else
 
 void luaopen_all3rd(lua_State *L)
 {
@@ -87,6 +360,8 @@ void luaopen_all3rd(lua_State *L)
 
 	lua_settop(L, top);
 }
+
+#endif
 #endif // SLUA_3RD_LOADED
 
 #endif // end of COMPILE_3RD
@@ -0,0 +1,340 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/* Shortest round-trip double to text with Grisu2 (Florian Loitsch,
+ * "Printing Floating-Point Numbers Quickly and Accurately with Integers",
+ * PLDI 2010). Grisu2 always yields digits that read back as the same
+ * double; in very rare cases they are one digit longer than the shortest
+ * possible. Integral values up to 2^53 skip it and are printed as
+ * integers. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "fpconv.h"
+
+typedef struct {
+    uint64_t f;
+    int e;
+} fp_diy;
+
+typedef struct {
+    uint64_t f;
+    int e;
+    int k;
+} fp_power;
+
+#define FP_ALPHA -60
+#define FP_GAMMA -32
+
+/* 10^k = f * 2^e, k = -300, -292, .. 324, f rounded to nearest */
+static const fp_power fp_powers[] = {
+    { 0xAB70FE17C79AC6CA, -1060, -300 }, { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+    { 0xBE5691EF416BD60C, -1007, -284 }, { 0x8DD01FAD907FFC3C,  -980, -276 },
+    { 0xD3515C2831559A83,  -954, -268 }, { 0x9D71AC8FADA6C9B5,  -927, -260 },
+    { 0xEA9C227723EE8BCB,  -901, -252 }, { 0xAECC49914078536D,  -874, -244 },
+    { 0x823C12795DB6CE57,  -847, -236 }, { 0xC21094364DFB5637,  -821, -228 },
+    { 0x9096EA6F3848984F,  -794, -220 }, { 0xD77485CB25823AC7,  -768, -212 },
+    { 0xA086CFCD97BF97F4,  -741, -204 }, { 0xEF340A98172AACE5,  -715, -196 },
+    { 0xB23867FB2A35B28E,  -688, -188 }, { 0x84C8D4DFD2C63F3B,  -661, -180 },
+    { 0xC5DD44271AD3CDBA,  -635, -172 }, { 0x936B9FCEBB25C996,  -608, -164 },
+    { 0xDBAC6C247D62A584,  -582, -156 }, { 0xA3AB66580D5FDAF6,  -555, -148 },
+    { 0xF3E2F893DEC3F126,  -529, -140 }, { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+    { 0x87625F056C7C4A8B,  -475, -124 }, { 0xC9BCFF6034C13053,  -449, -116 },
+    { 0x964E858C91BA2655,  -422, -108 }, { 0xDFF9772470297EBD,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88F,  -369,  -92 }, { 0xF8A95FCF88747D94,  -343,  -84 },
+    { 0xB94470938FA89BCF,  -316,  -76 }, { 0x8A08F0F8BF0F156B,  -289,  -68 },
+    { 0xCDB02555653131B6,  -263,  -60 }, { 0x993FE2C6D07B7FAC,  -236,  -52 },
+    { 0xE45C10C42A2B3B06,  -210,  -44 }, { 0xAA242499697392D3,  -183,  -36 },
+    { 0xFD87B5F28300CA0E,  -157,  -28 }, { 0xBCE5086492111AEB,  -130,  -20 },
+    { 0x8CBCCC096F5088CC,  -103,  -12 }, { 0xD1B71758E219652C,   -77,   -4 },
+    { 0x9C40000000000000,   -50,    4 }, { 0xE8D4A51000000000,   -24,   12 },
+    { 0xAD78EBC5AC620000,     3,   20 }, { 0x813F3978F8940984,    30,   28 },
+    { 0xC097CE7BC90715B3,    56,   36 }, { 0x8F7E32CE7BEA5C70,    83,   44 },
+    { 0xD5D238A4ABE98068,   109,   52 }, { 0x9F4F2726179A2245,   136,   60 },
+    { 0xED63A231D4C4FB27,   162,   68 }, { 0xB0DE65388CC8ADA8,   189,   76 },
+    { 0x83C7088E1AAB65DB,   216,   84 }, { 0xC45D1DF942711D9A,   242,   92 },
+    { 0x924D692CA61BE758,   269,  100 }, { 0xDA01EE641A708DEA,   295,  108 },
+    { 0xA26DA3999AEF774A,   322,  116 }, { 0xF209787BB47D6B85,   348,  124 },
+    { 0xB454E4A179DD1877,   375,  132 }, { 0x865B86925B9BC5C2,   402,  140 },
+    { 0xC83553C5C8965D3D,   428,  148 }, { 0x952AB45CFA97A0B3,   455,  156 },
+    { 0xDE469FBD99A05FE3,   481,  164 }, { 0xA59BC234DB398C25,   508,  172 },
+    { 0xF6C69A72A3989F5C,   534,  180 }, { 0xB7DCBF5354E9BECE,   561,  188 },
+    { 0x88FCF317F22241E2,   588,  196 }, { 0xCC20CE9BD35C78A5,   614,  204 },
+    { 0x98165AF37B2153DF,   641,  212 }, { 0xE2A0B5DC971F303A,   667,  220 },
+    { 0xA8D9D1535CE3B396,   694,  228 }, { 0xFB9B7CD9A4A7443C,   720,  236 },
+    { 0xBB764C4CA7A44410,   747,  244 }, { 0x8BAB8EEFB6409C1A,   774,  252 },
+    { 0xD01FEF10A657842C,   800,  260 }, { 0x9B10A4E5E9913129,   827,  268 },
+    { 0xE7109BFBA19C0C9D,   853,  276 }, { 0xAC2820D9623BF429,   880,  284 },
+    { 0x80444B5E7AA7CF85,   907,  292 }, { 0xBF21E44003ACDD2D,   933,  300 },
+    { 0x8E679C2F5E44FF8F,   960,  308 }, { 0xD433179D9C8CB841,   986,  316 },
+    { 0x9E19DB92B4E31BA9,  1013,  324 }
+};
+
+#define FP_POWERS_MIN_K -300
+#define FP_POWERS_STEP 8
+
+static fp_diy fp_mul(fp_diy x, fp_diy y)
+{
+    uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu;
+    uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFFu;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu);
+    fp_diy r;
+
+    mid += 1u << 31; /* round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static fp_diy fp_normalize(fp_diy x)
+{
+    while (!(x.f & ((uint64_t)1 << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* v and its boundaries m- and m+, all with the exponent of normalized m+ */
+static void fp_boundaries(double d, fp_diy *v, fp_diy *minus, fp_diy *plus)
+{
+    uint64_t bits, frac;
+    int bexp;
+    fp_diy w, m;
+
+    memcpy(&bits, &d, sizeof(bits));
+    frac = bits & (((uint64_t)1 << 52) - 1);
+    bexp = (int)(bits >> 52) & 0x7FF;
+    if (bexp) {
+        w.f = frac + ((uint64_t)1 << 52);
+        w.e = bexp - 1075;
+    } else {
+        w.f = frac;
+        w.e = -1074;
+    }
+
+    plus->f = (w.f << 1) + 1;
+    plus->e = w.e - 1;
+    *plus = fp_normalize(*plus);
+
+    /* The gap below a power of two is half the gap above it */
+    if (frac == 0 && bexp > 1) {
+        m.f = (w.f << 2) - 1;
+        m.e = w.e - 2;
+    } else {
+        m.f = (w.f << 1) - 1;
+        m.e = w.e - 1;
+    }
+    m.f <<= m.e - plus->e;
+    m.e = plus->e;
+    *minus = m;
+    *v = fp_normalize(w);
+}
+
+static void fp_round(char *buf, int len, uint64_t dist, uint64_t delta,
+                     uint64_t rest, uint64_t ten_k)
+{
+    while (rest < dist && delta - rest >= ten_k &&
+           (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+        buf[len - 1]--;
+        rest += ten_k;
+    }
+}
+
+/* Digits of a value in [lo, hi], as close to w as they get. Returns the
+ * digit count, *k becomes the decimal exponent of the last digit. */
+static int fp_digits(fp_diy lo, fp_diy w, fp_diy hi, char *buf, int *k)
+{
+    static const uint32_t pow10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000
+    };
+    uint64_t delta = hi.f - lo.f;
+    uint64_t dist = hi.f - w.f;
+    int shift = -hi.e;
+    uint64_t mask = ((uint64_t)1 << shift) - 1;
+    uint32_t p1 = (uint32_t)(hi.f >> shift);
+    uint64_t p2 = hi.f & mask;
+    int len = 0, n = 9;
+
+    while (n > 0 && p1 < pow10[n])
+        n--;
+    n++;
+
+    /* Integral part */
+    while (n > 0) {
+        uint32_t ten = pow10[n - 1];
+        uint64_t rest;
+
+        buf[len++] = (char)('0' + p1 / ten);
+        p1 %= ten;
+        n--;
+        rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += n;
+            fp_round(buf, len, dist, delta, rest, (uint64_t)ten << shift);
+            return len;
+        }
+    }
+
+    /* Fractional part */
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        dist *= 10;
+        buf[len++] = (char)('0' + (p2 >> shift));
+        p2 &= mask;
+        n--;
+        if (p2 <= delta)
+            break;
+    }
+    *k += n;
+    fp_round(buf, len, dist, delta, p2, (uint64_t)1 << shift);
+    return len;
+}
+
+/* Positive finite d into digits, returns the count, *k as above */
+static int fp_grisu2(double d, char *digits, int *k)
+{
+    fp_diy v, lo, hi;
+    const fp_power *c;
+    fp_diy cp;
+    int f, i;
+
+    fp_boundaries(d, &v, &lo, &hi);
+
+    /* The cached power that scales hi.e into [alpha, gamma] */
+    f = FP_ALPHA - hi.e - 1;
+    i = (f * 78913) / (1 << 18) + (f > 0);
+    c = &fp_powers[(i - FP_POWERS_MIN_K + FP_POWERS_STEP - 1) / FP_POWERS_STEP];
+    cp.f = c->f;
+    cp.e = c->e;
+
+    v = fp_mul(v, cp);
+    lo = fp_mul(lo, cp);
+    hi = fp_mul(hi, cp);
+    lo.f++;
+    hi.f--;
+    *k = -c->k;
+    return fp_digits(lo, v, hi, digits, k);
+}
+
+static int fp_exponent(int e, char *buf)
+{
+    int len = 0;
+
+    buf[len++] = 'e';
+    buf[len++] = e < 0 ? '-' : '+';
+    if (e < 0)
+        e = -e;
+    if (e >= 100)
+        buf[len++] = (char)('0' + e / 100);
+    buf[len++] = (char)('0' + e / 10 % 10);
+    buf[len++] = (char)('0' + e % 10);
+    return len;
+}
+
+/* The layout of printf "%.17g" for digits * 10^k: plain when the
+ * exponent of the first digit is in [-4, 17), e+XX otherwise */
+static int fp_format(const char *digits, int ndigits, int k, char *buf)
+{
+    int point = ndigits + k; /* digits before the decimal point */
+    int len = 0;
+
+    if (point > 17 || point < -3) {
+        buf[len++] = digits[0];
+        if (ndigits > 1) {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + 1, ndigits - 1);
+            len += ndigits - 1;
+        }
+        return len + fp_exponent(point - 1, buf + len);
+    }
+    if (point >= ndigits) {
+        memcpy(buf, digits, ndigits);
+        memset(buf + ndigits, '0', point - ndigits);
+        return point;
+    }
+    if (point > 0) {
+        memcpy(buf, digits, point);
+        buf[point] = '.';
+        memcpy(buf + point + 1, digits + point, ndigits - point);
+        return ndigits + 1;
+    }
+    buf[len++] = '0';
+    buf[len++] = '.';
+    memset(buf + len, '0', -point);
+    len += -point;
+    memcpy(buf + len, digits, ndigits);
+    return len + ndigits;
+}
+
+static int fp_utoa(uint64_t v, char *buf)
+{
+    char tmp[20];
+    int n = 0, len;
+
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (len = 0; n > 0; len++)
+        buf[len] = tmp[--n];
+    return len;
+}
+
+int fpconv_itoa(long long v, char *buf)
+{
+    int len;
+
+    if (v < 0) {
+        buf[0] = '-';
+        len = 1 + fp_utoa(0 - (uint64_t)v, buf + 1);
+    } else {
+        len = fp_utoa((uint64_t)v, buf);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+int fpconv_dtoa(double v, char *buf)
+{
+    char digits[20];
+    uint64_t bits;
+    int len = 0, ndigits, k;
+
+    memcpy(&bits, &v, sizeof(bits));
+    if (bits >> 63) {
+        buf[len++] = '-';
+        v = -v;
+    }
+
+    if (v != v) {
+        memcpy(buf + len, "nan", 4);
+        return len + 3;
+    }
+    if (v == 0) {
+        memcpy(buf + len, "0", 2);
+        return len + 1;
+    }
+    if (v > 1.7976931348623157e308) {
+        memcpy(buf + len, "inf", 4);
+        return len + 3;
+    }
+
+    if (v <= 9007199254740992.0 && v == (double)(uint64_t)v) {
+        len += fp_utoa((uint64_t)v, buf + len);
+    } else {
+        ndigits = fp_grisu2(v, digits, &k);
+        len += fp_format(digits, ndigits, k, buf + len);
+    }
+    buf[len] = '\0';
+    return len;
+}
@@ -0,0 +1,23 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#ifndef __FPCONV_H__
+#define __FPCONV_H__
+
+/* Longest output: -2.2250738585072014e-308 and the NUL */
+#define FPCONV_DTOA_BUFSIZE 32
+
+/* Writes the shortest text that reads back (strtod) as v, in the
+ * layout of "%.17g", and returns its length. buf is NUL terminated
+ * and must hold FPCONV_DTOA_BUFSIZE chars. */
+extern int fpconv_dtoa(double v, char *buf);
+
+/* Writes the decimal text of v, returns its length */
+extern int fpconv_itoa(long long v, char *buf);
+
+#endif /* __FPCONV_H__ */
@@ -41,6 +41,7 @@
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 /*
 #include "lua.h"
 #include "lauxlib.h"
@@ -51,6 +52,16 @@
 #endif
 
 #include "strbuf.h"
+#include "fpconv.h"
+
+/* Strings are scanned 16 bytes at a time for the bytes that need work */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define JSON_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define JSON_NEON 1
+#endif
 
 #if defined(WIN32) || defined(_WIN32)
 # define MISSING_ISINF 1
@@ -67,6 +78,7 @@
 #define DEFAULT_ENCODE_REFUSE_BADNUM 1
 #define DEFAULT_DECODE_REFUSE_BADNUM 0
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
+#define DEFAULT_NUMBER_PRECISION 14
 
 typedef enum {
     T_OBJ_BEGIN,
@@ -127,6 +139,7 @@ typedef struct {
 typedef struct {
     const char *data;
     int index;
+    int length;       /* of data, the NUL after it excluded */
     strbuf_t *tmp;    /* Temporary storage for strings */
     json_config_t *cfg;
 } json_parse_t;
@@ -289,7 +302,9 @@ static void json_set_number_precision(json_config_t *cfg, int prec)
     sprintf(cfg->number_fmt, "%%.%dg", prec);
 }
 
-/* Configures number precision when converting doubles to text */
+/* Configures number precision when converting doubles to text.
+ * 1-14 write "%.<precision>g", 0 writes the shortest text that decodes
+ * to the same double (and Lua 5.3+ integers exactly) */
 static int json_cfg_encode_number_precision(lua_State *l)
 {
     json_config_t *cfg;
@@ -300,8 +315,8 @@ static int json_cfg_encode_number_precision(lua_State *l)
 
     if (lua_gettop(l)) {
         precision = luaL_checkinteger(l, 1);
-        luaL_argcheck(l, 1 <= precision && precision <= 14, 1,
-                      "expected integer between 1 and 14");
+        luaL_argcheck(l, 0 <= precision && precision <= 14, 1,
+                      "expected integer between 0 and 14");
         json_set_number_precision(cfg, precision);
     }
 
@@ -406,7 +421,7 @@ static void json_create_config(lua_State *l)
     cfg->encode_refuse_badnum = DEFAULT_ENCODE_REFUSE_BADNUM;
     cfg->decode_refuse_badnum = DEFAULT_DECODE_REFUSE_BADNUM;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
-    json_set_number_precision(cfg, 14);
+    json_set_number_precision(cfg, DEFAULT_NUMBER_PRECISION);
 
     /* Decoding init */
 
@@ -491,6 +506,50 @@ static void json_encode_exception(lua_State *l, json_config_t *cfg, int lindex,
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
 
+/* Length of the leading run of str (at most len bytes) that is copied
+ * to JSON as is, ie. up to the first byte with a char2escape entry:
+ * controls, '"', '/', '\\' and DEL */
+static size_t json_plain_run(const char *str, size_t len)
+{
+    size_t i = 0;
+
+#if defined(JSON_SSE2)
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7F);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, quote));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, slash));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, bslash));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(hit))
+            break;
+    }
+#elif defined(JSON_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(str + i));
+        uint8x16_t hit = vcltq_u8(v, vdupq_n_u8(0x20));
+        uint64x2_t any;
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('"')));
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('/')));
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('\\')));
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(0x7F)));
+        any = vreinterpretq_u64_u8(hit);
+        if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1))
+            break;
+    }
+#endif
+    while (i < len && !char2escape[(unsigned char)str[i]])
+        i++;
+
+    return i;
+}
+
 /* json_append_string args:
  * - lua_State
  * - JSON strbuf
@@ -499,8 +558,7 @@ static void json_encode_exception(lua_State *l, json_config_t *cfg, int lindex,
  * Returns nothing. Doesn't remove string from Lua stack */
 static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
 {
-    const char *escstr;
-    int i;
+    size_t i, run;
     const char *str;
     size_t len;
 
@@ -514,11 +572,11 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
 
     strbuf_append_char_unsafe(json, '\"');
     for (i = 0; i < len; i++) {
-        escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
-            strbuf_append_string(json, escstr);
-        else
-            strbuf_append_char_unsafe(json, str[i]);
+        run = json_plain_run(str + i, len - i);
+        strbuf_append_mem_unsafe(json, str + i, run);
+        i += run;
+        if (i < len)
+            strbuf_append_string(json, char2escape[(unsigned char)str[i]]);
     }
     strbuf_append_char_unsafe(json, '\"');
 }
@@ -617,11 +675,27 @@ static void json_append_array(lua_State *l, json_config_t *cfg, strbuf_t *json,
 static void json_append_number(lua_State *l, strbuf_t *json, int index,
                                json_config_t *cfg)
 {
-    double num = lua_tonumber(l, index);
+    char buf[FPCONV_DTOA_BUFSIZE];
+    double num;
+
+#if LUA_VERSION_NUM >= 503
+    /* Round-trip mode writes integers exactly, all 64 bits of them */
+    if (cfg->encode_number_precision == 0 && lua_isinteger(l, index)) {
+        strbuf_append_mem(json, buf, fpconv_itoa(lua_tointeger(l, index), buf));
+        return;
+    }
+#endif
+
+    num = lua_tonumber(l, index);
 
     if (cfg->encode_refuse_badnum && (isinf(num) || isnan(num)))
         json_encode_exception(l, cfg, index, "must not be NaN or Inf");
 
+    if (cfg->encode_number_precision == 0) {
+        strbuf_append_mem(json, buf, fpconv_dtoa(num, buf));
+        return;
+    }
+
     /* Lowest double printed with %.14g is 21 characters long:
      * -1.7976931348623e+308
      *
@@ -898,6 +972,43 @@ static void json_set_token_error(json_token_t *token, json_parse_t *json,
     token->value.string = errtype;
 }
 
+/* Length of the leading run of str (at most len bytes) that a JSON
+ * string copies as is, ie. up to the first '"', '\\' or NUL */
+static int json_string_run(const char *str, int len)
+{
+    int i = 0;
+
+#if defined(JSON_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i nul = _mm_setzero_si128();
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                   _mm_cmpeq_epi8(v, bslash));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, nul));
+        if (_mm_movemask_epi8(hit))
+            break;
+    }
+#elif defined(JSON_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(str + i));
+        uint8x16_t hit = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                  vceqq_u8(v, vdupq_n_u8('\\')));
+        uint64x2_t any;
+        hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(0)));
+        any = vreinterpretq_u64_u8(hit);
+        if (vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1))
+            break;
+    }
+#endif
+    while (i < len && str[i] != '"' && str[i] != '\\' && str[i])
+        i++;
+
+    return i;
+}
+
 static void json_next_string_token(json_parse_t *json, json_token_t *token)
 {
     char *escape2char = json->cfg->escape2char;
@@ -912,7 +1023,15 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
     /* json->tmp is the temporary strbuf used to accumulate the
      * decoded string value. */
     strbuf_reset(json->tmp);
-    while ((ch = json->data[json->index]) != '"') {
+    while (1) {
+        /* Copy the run up to the next quote, backslash or NUL */
+        int run = json_string_run(json->data + json->index,
+                                  json->length - json->index);
+        strbuf_append_mem_unsafe(json->tmp, json->data + json->index, run);
+        json->index += run;
+
+        if ((ch = json->data[json->index]) == '"')
+            break;
         if (!ch) {
             /* Premature end of the string */
             json_set_token_error(token, json, "unexpected end of string");
@@ -1253,6 +1372,7 @@ static void lua_json_decode(lua_State *l, const char *json_text, int json_len)
     json.cfg = json_fetch_config(l);
     json.data = json_text;
     json.index = 0;
+    json.length = json_len;
 
     /* Ensure the temporary buffer can hold the entire string.
      * This means we no longer need to do length checks since the decoded
@@ -1293,6 +1413,343 @@ static int json_decode(lua_State *l)
     return 1;
 }
 
+/* ===== STREAMING DECODING ===== */
+
+/* cjson.sax(json_text | chunk_iter, handlers)
+ *
+ * Decodes without building tables: each token is handed to the matching
+ * function of handlers as it is read:
+ *   start_object(), end_object(), start_array(), end_array(),
+ *   key(string), value(string | number | boolean | cjson.null)
+ * Missing handlers are skipped. A handler returning false stops the
+ * decoding and cjson.sax() returns false, otherwise true once the whole
+ * text is read.
+ *
+ * chunk_iter is called for more text like the reader of load(): nil or
+ * "" ends the input. Only the unparsed tail of the text (one token at
+ * most) is kept between chunks. */
+
+typedef enum {
+    SAX_START_OBJECT,
+    SAX_END_OBJECT,
+    SAX_START_ARRAY,
+    SAX_END_ARRAY,
+    SAX_KEY,
+    SAX_VALUE,
+    SAX_HANDLERS
+} json_sax_event_t;
+
+static const char *json_sax_event_name[] = {
+    "start_object",
+    "end_object",
+    "start_array",
+    "end_array",
+    "key",
+    "value",
+    NULL
+};
+
+typedef struct {
+    strbuf_t buf;       /* Unparsed input, NUL terminated */
+    strbuf_t tmp;       /* Decoded strings */
+    strbuf_t ctx;       /* Open containers, '{' or '[' */
+    size_t offset;      /* Input bytes dropped from the front of buf */
+    int scan;           /* Bytes of the next token known to be incomplete */
+    int eof;
+} json_sax_t;
+
+static int json_sax_gc(lua_State *l)
+{
+    json_sax_t *sax = lua_touserdata(l, 1);
+
+    strbuf_free(&sax->buf);
+    strbuf_free(&sax->tmp);
+    strbuf_free(&sax->ctx);
+
+    return 0;
+}
+
+/* True when the token at json->index can't grow with more input.
+ * sax->scan remembers how far an incomplete token was checked, so a
+ * long string isn't scanned again from its start after every chunk. */
+static int json_sax_token_complete(json_parse_t *json, json_sax_t *sax)
+{
+    json_token_type_t *ch2token = json->cfg->ch2token;
+    const char *data = json->data;
+    int i = json->index;
+
+    if (sax->eof)
+        return 1;
+
+    if (sax->scan == 0) {
+        while (i < json->length &&
+               ch2token[(unsigned char)data[i]] == T_WHITESPACE)
+            i++;
+        json->index = i;    /* Whitespace is never needed again */
+
+        if (i == json->length)
+            return 0;
+    }
+    i = json->index + sax->scan;
+
+    if (data[json->index] == '"') {
+        for (i += (sax->scan == 0); i < json->length; i++) {
+            if (data[i] == '\\')
+                i++;
+            else if (data[i] == '"')
+                break;
+        }
+    } else if (ch2token[(unsigned char)data[json->index]] != T_UNKNOWN) {
+        return 1;
+    } else {
+        /* Numbers and literals end at the next delimiter */
+        for (; i < json->length; i++) {
+            json_token_type_t type = ch2token[(unsigned char)data[i]];
+            if (type != T_UNKNOWN && type != T_ERROR && data[i] != '\0')
+                break;
+        }
+    }
+
+    if (i < json->length) {
+        sax->scan = 0;
+        return 1;
+    }
+    sax->scan = i - json->index;
+    return 0;
+}
+
+/* Appends the next chunk to the unparsed input, sets sax->eof at the end */
+static void json_sax_fill(lua_State *l, json_parse_t *json, json_sax_t *sax,
+                          int iter)
+{
+    strbuf_t *buf = &sax->buf;
+    const char *chunk = NULL;
+    size_t len = 0;
+
+    /* Drop the parsed input */
+    if (json->index > 0) {
+        buf->length -= json->index;
+        memmove(buf->buf, buf->buf + json->index, buf->length);
+        sax->offset += json->index;
+        json->index = 0;
+    }
+
+    if (iter) {
+        lua_pushvalue(l, iter);
+        lua_call(l, 0, 1);
+        if (!lua_isnil(l, -1)) {
+            if (lua_type(l, -1) != LUA_TSTRING)
+                luaL_error(l, "chunk iterator must return a string");
+            chunk = lua_tolstring(l, -1, &len);
+        }
+    }
+
+    if (len == 0) {
+        sax->eof = 1;
+    } else {
+        /* Detect Unicode other than UTF-8, see json_decode() */
+        if (sax->offset == 0 && buf->length == 0 && len >= 2 &&
+            (!chunk[0] || !chunk[1]))
+            luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+        if (len > INT_MAX - 1 - (size_t)buf->length)
+            luaL_error(l, "JSON text too large");
+        strbuf_append_mem(buf, chunk, (int)len);
+    }
+    if (iter)
+        lua_pop(l, 1);
+
+    strbuf_ensure_null(buf);
+    json->data = buf->buf;
+    json->length = buf->length;
+
+    /* Strings decode into tmp without length checks */
+    strbuf_reset(&sax->tmp);
+    strbuf_ensure_empty_length(&sax->tmp, buf->length);
+}
+
+static void json_sax_next_token(lua_State *l, json_parse_t *json,
+                                json_sax_t *sax, int iter,
+                                json_token_t *token)
+{
+    while (!json_sax_token_complete(json, sax))
+        json_sax_fill(l, json, sax, iter);
+
+    json_next_token(json, token);
+
+    /* A NUL in the input is not the end of it */
+    if (token->type == T_END && json->index < json->length)
+        json_set_token_error(token, json, "invalid token");
+}
+
+static void json_sax_throw(lua_State *l, json_parse_t *json,
+                           json_sax_t *sax, const char *exp,
+                           json_token_t *token)
+{
+    size_t index = sax->offset + token->index;
+
+    token->index = index < INT_MAX ? (int)index : INT_MAX - 1;
+    json_throw_parse_error(l, json, exp, token);
+}
+
+/* Calls the handler of event with the value of token, if any.
+ * Returns 0 when the handler asks to stop. */
+static int json_sax_emit(lua_State *l, int handlers, json_sax_event_t event,
+                         json_token_t *token)
+{
+    int nargs = 0, stop;
+
+    if (lua_isnil(l, handlers + event))
+        return 1;
+
+    lua_pushvalue(l, handlers + event);
+    if (token) {
+        nargs = 1;
+        switch (token->type) {
+        case T_STRING:
+            lua_pushlstring(l, token->value.string, token->string_len);
+            break;
+        case T_NUMBER:
+            lua_pushnumber(l, token->value.number);
+            break;
+        case T_BOOLEAN:
+            lua_pushboolean(l, token->value.boolean);
+            break;
+        default:
+            lua_pushlightuserdata(l, NULL);
+        }
+    }
+    lua_call(l, nargs, 1);
+    stop = lua_isboolean(l, -1) && !lua_toboolean(l, -1);
+    lua_pop(l, 1);
+
+    return !stop;
+}
+
+static int json_sax(lua_State *l)
+{
+    enum {
+        SAX_WANT_VALUE, SAX_WANT_VALUE_OR_END, SAX_WANT_KEY, SAX_WANT_KEY_OR_END,
+        SAX_AFTER_VALUE
+    } state;
+    json_parse_t json;
+    json_token_t token;
+    json_sax_t *sax;
+    int iter = 0, handlers, i;
+    const char *text = NULL;
+    size_t len = 0;
+
+    json_verify_arg_count(l, 2);
+    if (lua_type(l, 1) == LUA_TSTRING)
+        text = lua_tolstring(l, 1, &len);
+    else
+        luaL_checktype(l, 1, LUA_TFUNCTION);
+    luaL_checktype(l, 2, LUA_TTABLE);
+
+    /* The handlers go to fixed stack slots, one per event */
+    luaL_checkstack(l, SAX_HANDLERS + 4, "too many nested calls");
+    handlers = lua_gettop(l) + 1;
+    for (i = 0; i < SAX_HANDLERS; i++) {
+        lua_getfield(l, 2, json_sax_event_name[i]);
+        if (!lua_isnil(l, -1) && !lua_isfunction(l, -1))
+            luaL_error(l, "handler %s must be a function",
+                       json_sax_event_name[i]);
+    }
+
+    /* Buffers are freed by __gc when a handler or the input throws */
+    sax = lua_newuserdata(l, sizeof(*sax));
+    memset(sax, 0, sizeof(*sax));
+    lua_newtable(l);
+    lua_pushcfunction(l, json_sax_gc);
+    lua_setfield(l, -2, "__gc");
+    lua_setmetatable(l, -2);
+    strbuf_init(&sax->buf, 0);
+    strbuf_init(&sax->tmp, 0);
+    strbuf_init(&sax->ctx, 0);
+
+    json.cfg = json_fetch_config(l);
+    json.data = sax->buf.buf;
+    json.index = 0;
+    json.length = 0;
+    json.tmp = &sax->tmp;
+
+    if (text) {
+        /* The whole text is parsed in place, as json_decode() */
+        if (len >= 2 && (!text[0] || !text[1]))
+            luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+        if (len > INT_MAX - 1)
+            luaL_error(l, "JSON text too large");
+        json.data = text;
+        json.length = (int)len;
+        strbuf_ensure_empty_length(&sax->tmp, json.length);
+        sax->eof = 1;
+    } else {
+        iter = 1;
+    }
+
+    /* token is the next one to handle at the top of the loop */
+    state = SAX_WANT_VALUE;
+    json_sax_next_token(l, &json, sax, iter, &token);
+    while (state != SAX_AFTER_VALUE || sax->ctx.length > 0) {
+        int ctx = sax->ctx.length ? sax->ctx.buf[sax->ctx.length - 1] : 0;
+
+        if ((state == SAX_WANT_KEY_OR_END && token.type == T_OBJ_END) ||
+            (state == SAX_WANT_VALUE_OR_END && token.type == T_ARR_END) ||
+            (state == SAX_AFTER_VALUE && token.type == T_OBJ_END && ctx == '{') ||
+            (state == SAX_AFTER_VALUE && token.type == T_ARR_END && ctx == '[')) {
+            sax->ctx.length--;
+            if (!json_sax_emit(l, handlers, ctx == '{' ? SAX_END_OBJECT :
+                               SAX_END_ARRAY, NULL))
+                goto stopped;
+            state = SAX_AFTER_VALUE;
+        } else if (state == SAX_AFTER_VALUE) {
+            if (token.type != T_COMMA)
+                json_sax_throw(l, &json, sax, ctx == '{' ?
+                               "comma or object end" : "comma or array end",
+                               &token);
+            state = ctx == '{' ? SAX_WANT_KEY : SAX_WANT_VALUE;
+        } else if (state == SAX_WANT_KEY || state == SAX_WANT_KEY_OR_END) {
+            if (token.type != T_STRING)
+                json_sax_throw(l, &json, sax, "object key string", &token);
+            if (!json_sax_emit(l, handlers, SAX_KEY, &token))
+                goto stopped;
+
+            json_sax_next_token(l, &json, sax, iter, &token);
+            if (token.type != T_COLON)
+                json_sax_throw(l, &json, sax, "colon", &token);
+            state = SAX_WANT_VALUE;
+        } else if (token.type == T_OBJ_BEGIN) {
+            if (!json_sax_emit(l, handlers, SAX_START_OBJECT, NULL))
+                goto stopped;
+            strbuf_append_char(&sax->ctx, '{');
+            state = SAX_WANT_KEY_OR_END;
+        } else if (token.type == T_ARR_BEGIN) {
+            if (!json_sax_emit(l, handlers, SAX_START_ARRAY, NULL))
+                goto stopped;
+            strbuf_append_char(&sax->ctx, '[');
+            state = SAX_WANT_VALUE_OR_END;
+        } else if (token.type == T_STRING || token.type == T_NUMBER ||
+                   token.type == T_BOOLEAN || token.type == T_NULL) {
+            if (!json_sax_emit(l, handlers, SAX_VALUE, &token))
+                goto stopped;
+            state = SAX_AFTER_VALUE;
+        } else {
+            json_sax_throw(l, &json, sax, "value", &token);
+        }
+        json_sax_next_token(l, &json, sax, iter, &token);
+    }
+
+    /* Ensure there is no more input left */
+    if (token.type != T_END)
+        json_sax_throw(l, &json, sax, "the end", &token);
+
+    lua_pushboolean(l, 1);
+    return 1;
+
+stopped:
+    lua_pushboolean(l, 0);
+    return 1;
+}
+
 /* ===== INITIALISATION ===== */
 
 int luaopen_cjson(lua_State *l)
@@ -1300,6 +1757,7 @@ int luaopen_cjson(lua_State *l)
     luaL_Reg reg[] = {
         { "encode", json_encode },
         { "decode", json_decode },
+        { "sax", json_sax },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
         { "encode_max_depth", json_cfg_encode_max_depth },
         { "encode_number_precision", json_cfg_encode_number_precision },
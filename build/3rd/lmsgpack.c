@@ -9,6 +9,9 @@
 #include "lauxlib.h"
 #endif
 
+#include "i64lib.h"
+#include "xlua_thread.h"
+
 #define LUACMSGPACK_NAME        "cmsgpack"
 /*
 #define LUACMSGPACK_SAFE_NAME   "cmsgpack_safe"
@@ -23,6 +26,14 @@
     #define LUACMSGPACK_MAX_NESTING  16 /* Max tables nesting. */
 #endif
 
+#ifndef LUACMSGPACK_BUF_KEEP
+    #define LUACMSGPACK_BUF_KEEP (256*1024) /* Larger pack buffers are not kept. */
+#endif
+
+#ifndef LUACMSGPACK_ASYNC_THREADS
+    #define LUACMSGPACK_ASYNC_THREADS 2 /* Max worker threads of unpack_async. */
+#endif
+
 /* Check if float or double can be an integer without loss of precision */
 #define IS_INT_TYPE_EQUIVALENT(x, T) (!isinf(x) && (T)(x) == (x))
 
@@ -44,19 +55,33 @@
 
 
 /*---------------------------------------------------------------------------------*/
-/* add by liwenkun 20170925; */
-typedef struct TString {
-	char *str;
-	size_t strLen;
-	int index;
-	struct TString * next;
-} TString;
-
+/* add by liwenkun 20170925; string dictionaries, see the end of the file */
+struct mp_dict;
 struct mp_cur;
 
+static int mp_dict_id(const struct mp_dict *d, const char *str, size_t len);
+static void mp_dict_record_miss(lua_State *L, const struct mp_dict *d, size_t len);
+static void push_dict_string(lua_State *L, struct mp_cur *c, size_t dictId);
+static const struct mp_dict *mp_push_default_dict(lua_State *L);
+static const struct mp_dict *mp_push_dict(lua_State *L, int idx);
+static void push_dict_strings(lua_State *L, const struct mp_dict *d);
+static uint64_t mp_dict_hash(const char *str, size_t len);
+
 int mp_init(lua_State *L);
-int query_dict_id(const char * str, size_t strLen);
-void push_dict_string(lua_State *L, struct mp_cur *c, size_t dictId);
+int mp_newdict(lua_State *L);
+int mp_setdict(lua_State *L);
+int mp_getdict(lua_State *L);
+int mp_pack_dict(lua_State *L);
+int mp_unpack_dict(lua_State *L);
+int mp_decoder_new(lua_State *L);
+int mp_safe(lua_State *L);
+int mp_register_struct(lua_State *L);
+int mp_unpack_async(lua_State *L);
+int mp_poll(lua_State *L);
+int mp_set_pack_mode(lua_State *L);
+
+/* table_export.c, the entry count of a table read from its slots */
+LUA_API int xlua_table_shape(lua_State *L, int index, size_t *count);
 
 /*------------------------------------------------------------------------------------*/
 
@@ -116,6 +141,8 @@ void memrevifle(void *ptr, size_t len) {
 typedef struct mp_buf {
     unsigned char *b;
     size_t len, free;
+    const struct mp_dict *dict; /* strings packed as ids, NULL for none */
+    int mode;                   /* MP_PACK_*, how tables are told apart */
 } mp_buf;
 
 void *mp_realloc(lua_State *L, void *target, size_t osize,size_t nsize) {
@@ -124,7 +151,11 @@ void *mp_realloc(lua_State *L, void *target, size_t osize,size_t nsize) {
 
     local_realloc = lua_getallocf(L, &ud);
 
-    return local_realloc(ud, target, osize, nsize);
+    target = local_realloc(ud, target, osize, nsize);
+    /* a state with a memory quota refuses allocations past its hard limit */
+    if (target == NULL && nsize > 0)
+        luaL_error(L, "not enough memory");
+    return target;
 }
 
 mp_buf *mp_buf_new(lua_State *L) {
@@ -135,6 +166,8 @@ mp_buf *mp_buf_new(lua_State *L) {
 
     buf->b = NULL;
     buf->len = buf->free = 0;
+    buf->dict = NULL;
+    buf->mode = 0;
     return buf;
 }
 
@@ -155,6 +188,74 @@ void mp_buf_free(lua_State *L, mp_buf *buf) {
     mp_realloc(L, buf, sizeof(*buf), 0);
 }
 
+/* Each state keeps the storage of its last pack buffer (up to
+ * LUACMSGPACK_BUF_KEEP bytes) and the next pack starts from it, along with
+ * the pack mode of the state. A pack takes the storage out while it runs, so
+ * a pack started meanwhile, from a __gc, grows storage of its own. */
+
+typedef struct mp_bufcache {
+    unsigned char *b;
+    size_t size;
+    int mode;
+} mp_bufcache;
+
+static int mp_bufcache_tag = 0;
+
+static int mp_bufcache_gc(lua_State *L) {
+    mp_bufcache *bc = (mp_bufcache*)lua_touserdata(L,1);
+    mp_realloc(L, bc->b, bc->size, 0);
+    bc->b = NULL;
+    bc->size = 0;
+    return 0;
+}
+
+static mp_bufcache *mp_bufcache_get(lua_State *L) {
+    mp_bufcache *bc;
+
+    lua_pushlightuserdata(L, &mp_bufcache_tag);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    bc = (mp_bufcache*)lua_touserdata(L, -1);
+    lua_pop(L, 1); /* the registry keeps it */
+    if (bc == NULL) {
+        bc = (mp_bufcache*)lua_newuserdata(L, sizeof(*bc));
+        memset(bc, 0, sizeof(*bc));
+        lua_newtable(L);
+        lua_pushcfunction(L, mp_bufcache_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_pushlightuserdata(L, &mp_bufcache_tag);
+        lua_insert(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    return bc;
+}
+
+void mp_buf_acquire(lua_State *L, mp_buf *buf) {
+    mp_bufcache *bc = mp_bufcache_get(L);
+
+    buf->b = bc->b;
+    buf->len = 0;
+    buf->free = bc->size;
+    buf->dict = NULL;
+    buf->mode = bc->mode;
+    bc->b = NULL;
+    bc->size = 0;
+}
+
+void mp_buf_release(lua_State *L, mp_buf *buf) {
+    mp_bufcache *bc = mp_bufcache_get(L);
+    size_t size = buf->len + buf->free;
+
+    if (bc->b == NULL && size <= LUACMSGPACK_BUF_KEEP) {
+        bc->b = buf->b;
+        bc->size = size;
+    } else {
+        mp_realloc(L, buf->b, size, 0);
+    }
+    buf->b = NULL;
+    buf->len = buf->free = 0;
+}
+
 /* ---------------------------- String cursor ----------------------------------
  * This simple data structure is used for parsing. Basically you create a cursor
  * using a string pointer and a length, then it is possible to access the
@@ -168,17 +269,23 @@ void mp_buf_free(lua_State *L, mp_buf *buf) {
 #define MP_CUR_ERROR_EOF    1   /* Not enough data to complete operation. */
 #define MP_CUR_ERROR_BADFMT 2   /* Bad data format */
 #define MP_CUR_ERROR_BADDICT 3  /* Bad data DICT */
+#define MP_CUR_ERROR_BADEXT 4   /* Unknown ext type or struct id */
+#define MP_CUR_ERROR_NOMEM  5   /* Out of memory off the Lua allocator */
 
 typedef struct mp_cur {
     const unsigned char *p;
     size_t left;
     int err;
+    const struct mp_dict *dict; /* dictionary of the string ids, NULL for none */
+    int strings;                /* stack index of its id+1 -> string table */
 } mp_cur;
 
 void mp_cur_init(mp_cur *cursor, const unsigned char *s, size_t len) {
     cursor->p = s;
     cursor->left = len;
     cursor->err = MP_CUR_ERROR_NONE;
+    cursor->dict = NULL;
+    cursor->strings = 0;
 }
 
 #define mp_cur_consume(_c,_len) do { _c->p += _len; _c->left -= _len; } while(0)
@@ -393,13 +500,14 @@ void mp_encode_lua_string(lua_State *L, mp_buf *buf) {
 	int dictId ;
 	
 	s = lua_tolstring(L,-1,&len);
-	dictId = query_dict_id(s, len);
+	dictId = mp_dict_id(buf->dict, s, len);
 	if(dictId >= 0)
 	{
 		mp_encode_lua_string_dict(L, buf, dictId);
 	}
 	else
 	{
+		mp_dict_record_miss(L, buf->dict, len);
 		mp_encode_bytes(L,buf,(const unsigned char*)s,len);
 	}
 }
@@ -434,37 +542,19 @@ void mp_encode_lua_number(lua_State *L, mp_buf *buf) {
 
 void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level);
 
-/* Convert a lua table into a message pack list. */
-void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level) {
-#if LUA_VERSION_NUM < 502
-    size_t len = lua_objlen(L,-1), j;
-#else
-    size_t len = lua_rawlen(L,-1), j;
-#endif
+/* Convert the elements 1..len of a lua table into a message pack list. */
+void mp_encode_lua_table_as_array(lua_State *L, mp_buf *buf, int level, size_t len) {
+    size_t j;
 
     mp_encode_array(L,buf,len);
     for (j = 1; j <= len; j++) {
-        lua_pushnumber(L,j);
-        lua_gettable(L,-2);
+        lua_rawgeti(L,-1,(int)j);
         mp_encode_lua_type(L,buf,level+1);
     }
 }
 
-/* Convert a lua table into a message pack key-value map. */
-void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
-    size_t len = 0;
-
-    /* First step: count keys into table. No other way to do it with the
-     * Lua API, we need to iterate a first time. Note that an alternative
-     * would be to do a single run, and then hack the buffer to insert the
-     * map opcodes for message pack. Too hackish for this lib. */
-    lua_pushnil(L);
-    while(lua_next(L,-2)) {
-        lua_pop(L,1); /* remove value, keep key for next iteration. */
-        len++;
-    }
-
-    /* Step two: actually encoding of the map. */
+/* Convert a lua table of len keys into a message pack key-value map. */
+void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level, size_t len) {
     mp_encode_map(L,buf,len);
     lua_pushnil(L);
     while(lua_next(L,-2)) {
@@ -475,57 +565,281 @@ void mp_encode_lua_table_as_map(lua_State *L, mp_buf *buf, int level) {
     }
 }
 
-/* Returns true if the Lua table on top of the stack is exclusively composed
- * of keys from numerical keys from 1 up to N, with N being the total number
- * of elements, without any hole in the middle. */
-int table_is_an_array(lua_State *L) {
-    int count = 0, max = 0;
-#if LUA_VERSION_NUM < 503
-    lua_Number n;
+#define MP_PACK_EXACT   0   /* arrays are the tables with exactly the keys 1..n */
+#define MP_PACK_LENGTH  1   /* arrays are the tables with a length, other keys are dropped */
+
+#define MP_HINT_NONE    0
+#define MP_HINT_ARRAY   1
+#define MP_HINT_MAP     2
+
+/* The __msgpack field of the metatable of the table on the top, "array" or
+ * "map", see msgpack.array_mt and msgpack.map_mt. An array is packed as its
+ * elements 1..#t, holes as nil. */
+static int mp_table_hint(lua_State *L) {
+    int hint = MP_HINT_NONE;
+
+    if (lua_getmetatable(L,-1)) {
+        const char *s;
+        lua_pushliteral(L,"__msgpack");
+        lua_rawget(L,-2);
+        s = lua_tostring(L,-1);
+        if (s != NULL)
+            hint = strcmp(s,"array") == 0 ? MP_HINT_ARRAY : strcmp(s,"map") == 0 ? MP_HINT_MAP : MP_HINT_NONE;
+        lua_pop(L,2);
+    }
+    return hint;
+}
+
+/* A table is a message pack list if its keys are 1..n, without holes. The
+ * keys are counted from the table slots, no lua_next pass, so only the
+ * encoding walks the table. */
+void mp_encode_lua_table(lua_State *L, mp_buf *buf, int level) {
+    int hint = mp_table_hint(L);
+    size_t count;
+
+    if (hint == MP_HINT_ARRAY || (hint == MP_HINT_NONE && buf->mode == MP_PACK_LENGTH)) {
+#if LUA_VERSION_NUM < 502
+        size_t len = lua_objlen(L,-1);
 #else
-    lua_Integer n;
+        size_t len = lua_rawlen(L,-1);
 #endif
+        if (len > 0 || hint == MP_HINT_ARRAY) {
+            mp_encode_lua_table_as_array(L,buf,level,len);
+            return;
+        }
+    }
+    if (xlua_table_shape(L,-1,&count) && hint == MP_HINT_NONE)
+        mp_encode_lua_table_as_array(L,buf,level,count);
+    else
+        mp_encode_lua_table_as_map(L,buf,level,count);
+}
 
-    /* Stack top on function entry */
-    int stacktop;
+/* msgpack.set_pack_mode("exact" or "length"), returns the previous mode.
+ * "length" packs every table with a length (#t > 0) as a list of 1..#t
+ * without checking for other keys, for states that only pack plain
+ * sequences and records. */
+int mp_set_pack_mode(lua_State *L) {
+    static const char *const modes[] = {"exact", "length", NULL};
+    mp_bufcache *bc = mp_bufcache_get(L);
+    int old = bc->mode;
+
+    bc->mode = luaL_checkoption(L,1,NULL,modes);
+    lua_pushstring(L,modes[old]);
+    return 1;
+}
 
-    stacktop = lua_gettop(L);
+/* ------------------------------- Ext types ---------------------------------
+ * int64/uint64 boxes of i64lib (Lua 5.1 and LuaJIT) are packed as fixext 8
+ * (0xd7) of type MP_EXT_INT64/MP_EXT_UINT64, big endian. A CSharpStruct whose
+ * metatable got a type id from msgpack.register_struct is packed as ext 8/16/32
+ * (0xc7/0xc8/0xc9) of type MP_EXT_STRUCT: the id, 2 bytes big endian, then the
+ * struct bytes as they are in memory, so both ends need the same layout.
+ * 0xd4..0xd6 (fixext 1/2/4) are the dictionary string ids, see the end. */
 
-    lua_pushnil(L);
-    while(lua_next(L,-2)) {
-        /* Stack: ... key value */
-        lua_pop(L,1); /* Stack: ... key */
-        /* The <= 0 check is valid here because we're comparing indexes. */
-#if LUA_VERSION_NUM < 503
-        if ((LUA_TNUMBER != lua_type(L,-1)) || (n = lua_tonumber(L, -1)) <= 0 ||
-            !IS_INT_EQUIVALENT(n))
+#define MP_EXT_INT64    1
+#define MP_EXT_UINT64   2
+#define MP_EXT_STRUCT   3
+
+/* same layout as CSharpStruct in xlua.c */
+typedef struct mp_struct {
+    int fake_id;        /* -1, a C# object reference has its index here */
+    unsigned int len;
+    unsigned char data[1];
+} mp_struct;
+
+#define MP_STRUCT_HEADER (sizeof(int) + sizeof(unsigned int))
+
+/* registry table of the registered structs, id -> metatable and metatable -> id */
+static int mp_structs_tag = 0;
+
+void mp_encode_lua_null(lua_State *L, mp_buf *buf);
+
+static void mp_encode_ext_header(lua_State *L, mp_buf *buf, int type, size_t len) {
+    unsigned char b[6];
+    int enclen;
+
+    if (len == 8) {
+        b[0] = 0xd7;
+        b[1] = type;
+        enclen = 2;
+    } else if (len <= 0xff) {
+        b[0] = 0xc7;
+        b[1] = len;
+        b[2] = type;
+        enclen = 3;
+    } else if (len <= 0xffff) {
+        b[0] = 0xc8;
+        b[1] = (len & 0xff00) >> 8;
+        b[2] = len & 0xff;
+        b[3] = type;
+        enclen = 4;
+    } else {
+        b[0] = 0xc9;
+        b[1] = (len & 0xff000000) >> 24;
+        b[2] = (len & 0xff0000) >> 16;
+        b[3] = (len & 0xff00) >> 8;
+        b[4] = len & 0xff;
+        b[5] = type;
+        enclen = 6;
+    }
+    mp_buf_append(L,buf,b,enclen);
+}
+
+/* the id of the struct on the top, -1 if it is not a registered one */
+static int mp_struct_id(lua_State *L) {
+    int id = -1;
+
+    if (!lua_getmetatable(L,-1)) return -1;
+    lua_pushlightuserdata(L,&mp_structs_tag);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    if (lua_istable(L,-1)) {
+        lua_pushvalue(L,-2);
+        lua_rawget(L,-2);
+        if (lua_type(L,-1) == LUA_TNUMBER) id = (int)lua_tointeger(L,-1);
+        lua_pop(L,1);
+    }
+    lua_pop(L,2);
+    return id;
+}
+
+void mp_encode_lua_userdata(lua_State *L, mp_buf *buf) {
+    mp_struct *css = (mp_struct*)lua_touserdata(L,-1);
+    size_t size;
+    int id;
+
+#if LUA_VERSION_NUM == 501
+    if (lua_isint64(L,-1) || lua_isuint64(L,-1)) {
+        unsigned char b[8];
+        uint64_t n = lua_touint64(L,-1);
+        int i;
+
+        for (i = 7; i >= 0; i--, n >>= 8) b[i] = n & 0xff;
+        mp_encode_ext_header(L,buf,lua_isint64(L,-1) ? MP_EXT_INT64 : MP_EXT_UINT64,8);
+        mp_buf_append(L,buf,b,8);
+        return;
+    }
+    size = lua_objlen(L,-1);
 #else
-        if (!lua_isinteger(L,-1) || (n = lua_tointeger(L, -1)) <= 0)
+    size = lua_rawlen(L,-1);
 #endif
-        {
-            lua_settop(L, stacktop);
-            return 0;
+    if (css != NULL && size >= MP_STRUCT_HEADER && css->fake_id == -1 &&
+        css->len <= size - MP_STRUCT_HEADER && (id = mp_struct_id(L)) >= 0) {
+        unsigned char b[2];
+
+        b[0] = (id & 0xff00) >> 8;
+        b[1] = id & 0xff;
+        mp_encode_ext_header(L,buf,MP_EXT_STRUCT,css->len + 2);
+        mp_buf_append(L,buf,b,2);
+        mp_buf_append(L,buf,css->data,css->len);
+        return;
+    }
+    mp_encode_lua_null(L,buf);
+}
+
+/* Decodes an ext of len bytes after a hdrlen bytes header, its type is the
+ * last byte of the header. */
+void mp_decode_ext(lua_State *L, mp_cur *c, size_t hdrlen, size_t len) {
+    const unsigned char *p;
+    int type;
+
+    mp_cur_need(c,hdrlen);
+    if (c->left - hdrlen < len) {
+        c->err = MP_CUR_ERROR_EOF;
+        return;
+    }
+    p = c->p + hdrlen;
+    type = c->p[hdrlen-1];
+    if ((type == MP_EXT_INT64 || type == MP_EXT_UINT64) && len == 8) {
+        uint64_t n = 0;
+        int i;
+
+        for (i = 0; i < 8; i++) n = (n << 8) | p[i];
+#if LUA_VERSION_NUM == 501
+        if (type == MP_EXT_INT64)
+            lua_pushint64(L,(int64_t)n);
+        else
+            lua_pushuint64(L,n);
+#elif LUA_VERSION_NUM >= 503
+        lua_pushinteger(L,(lua_Integer)n);
+#else
+        lua_pushnumber(L,type == MP_EXT_INT64 ? (lua_Number)(int64_t)n : (lua_Number)n);
+#endif
+    } else if (type == MP_EXT_STRUCT && len >= 2) {
+        mp_struct *css;
+
+        luaL_checkstack(L,3,"msgpack struct");
+        lua_pushlightuserdata(L,&mp_structs_tag);
+        lua_rawget(L,LUA_REGISTRYINDEX);
+        if (!lua_istable(L,-1)) {
+            lua_pop(L,1);
+            c->err = MP_CUR_ERROR_BADEXT;
+            return;
+        }
+        lua_rawgeti(L,-1,(p[0] << 8) | p[1]);
+        if (!lua_istable(L,-1)) {
+            lua_pop(L,2);
+            c->err = MP_CUR_ERROR_BADEXT;
+            return;
         }
-        max = (n > max ? n : max);
-        count++;
+        css = (mp_struct*)lua_newuserdata(L,MP_STRUCT_HEADER + len - 2);
+        css->fake_id = -1;
+        css->len = (unsigned int)(len - 2);
+        memcpy(css->data,p + 2,len - 2);
+        lua_insert(L,-2);
+        lua_setmetatable(L,-2);
+        lua_replace(L,-2);
+    } else {
+        c->err = MP_CUR_ERROR_BADEXT;
+        return;
     }
-    /* We have the total number of elements in "count". Also we have
-     * the max index encountered in "max". We can't reach this code
-     * if there are indexes <= 0. If you also note that there can not be
-     * repeated keys into a table, you have that if max==count you are sure
-     * that there are all the keys form 1 to count (both included). */
-    lua_settop(L, stacktop);
-    return max == count;
+    mp_cur_consume(c,hdrlen+len);
 }
 
-/* If the length operator returns non-zero, that is, there is at least
- * an object at key '1', we serialize to message pack list. Otherwise
- * we use a map. */
-void mp_encode_lua_table(lua_State *L, mp_buf *buf, int level) {
-    if (table_is_an_array(L))
-        mp_encode_lua_table_as_array(L,buf,level);
-    else
-        mp_encode_lua_table_as_map(L,buf,level);
+/* msgpack.register_struct(id, struct or its metatable): packs the structs of
+ * that type as ext MP_EXT_STRUCT with id (0..65535), unpacks them back with the
+ * metatable. Both ends register the same ids. */
+int mp_register_struct(lua_State *L) {
+    lua_Integer id = luaL_checkinteger(L,1);
+
+    luaL_argcheck(L,id >= 0 && id <= 0xffff,1,"struct id out of range");
+    if (lua_type(L,2) == LUA_TUSERDATA) {
+        if (!lua_getmetatable(L,2)) luaL_argerror(L,2,"struct without metatable");
+        lua_replace(L,2);
+    }
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_settop(L,2);
+
+    lua_pushlightuserdata(L,&mp_structs_tag);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    if (!lua_istable(L,-1)) {
+        lua_pop(L,1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L,&mp_structs_tag);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,LUA_REGISTRYINDEX);
+    }
+    /* a type or an id registered again drops its old pairing */
+    lua_rawgeti(L,3,(int)id);
+    if (!lua_isnil(L,-1)) {
+        lua_pushnil(L);
+        lua_rawset(L,3);
+    } else {
+        lua_pop(L,1);
+    }
+    lua_pushvalue(L,2);
+    lua_rawget(L,3);
+    if (!lua_isnil(L,-1)) {
+        lua_pushnil(L);
+        lua_rawset(L,3);
+    } else {
+        lua_pop(L,1);
+    }
+    lua_pushvalue(L,2);
+    lua_rawseti(L,3,(int)id);
+    lua_pushvalue(L,2);
+    lua_pushinteger(L,id);
+    lua_rawset(L,3);
+    return 0;
 }
 
 void mp_encode_lua_null(lua_State *L, mp_buf *buf) {
@@ -556,25 +870,21 @@ void mp_encode_lua_type(lua_State *L, mp_buf *buf, int level) {
         break;
     #endif
     case LUA_TTABLE: mp_encode_lua_table(L,buf,level); break;
+    case LUA_TUSERDATA: mp_encode_lua_userdata(L,buf); break;
     default: mp_encode_lua_null(L,buf); break;
     }
     lua_pop(L,1);
 }
 
-/*
- * Packs all arguments as a stream for multiple upacking later.
- * Returns error if no arguments provided.
- */
-int mp_pack(lua_State *L) {
-    int nargs = lua_gettop(L);
+/* Packs the arguments first..last with the string ids of dict (NULL for none),
+ * the caller keeps dict on the stack. */
+static int mp_pack_range(lua_State *L, int first, int last, const struct mp_dict *dict) {
     int i;
-    mp_buf *buf;
+    mp_buf b, *buf = &b;
 
-    if (nargs == 0)
-        return luaL_argerror(L, 0, "MessagePack pack needs input.");
-
-    buf = mp_buf_new(L);
-    for(i = 1; i <= nargs; i++) {
+    mp_buf_acquire(L, buf);
+    buf->dict = dict;
+    for(i = first; i <= last; i++) {
         /* Copy argument i to top of stack for _encode processing;
          * the encode function pops it from the stack when complete. */
         lua_pushvalue(L, i);
@@ -589,13 +899,29 @@ int mp_pack(lua_State *L) {
         buf->free += buf->len;
         buf->len = 0;
     }
-    mp_buf_free(L, buf);
+    mp_buf_release(L, buf);
 
     /* Concatenate all nargs buffers together */
-    lua_concat(L, nargs);
+    lua_concat(L, last - first + 1);
     return 1;
 }
 
+/*
+ * Packs all arguments as a stream for multiple upacking later.
+ * Returns error if no arguments provided.
+ */
+int mp_pack(lua_State *L) {
+    int nargs = lua_gettop(L);
+    const struct mp_dict *dict;
+
+    if (nargs == 0)
+        return luaL_argerror(L, 0, "MessagePack pack needs input.");
+
+    /* stays on the stack, an init while packing can not free it */
+    dict = mp_push_default_dict(L);
+    return mp_pack_range(L, 1, nargs, dict);
+}
+
 /* ------------------------------- Decoding --------------------------------- */
 
 void mp_decode_to_lua_type(lua_State *L, mp_cur *c);
@@ -844,6 +1170,27 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
             mp_cur_consume(c,5);
         }
         break;
+    case 0xd7:  /* fixext 8 */
+        mp_decode_ext(L,c,2,8);
+        break;
+    case 0xc7:  /* ext 8 */
+        mp_cur_need(c,3);
+        mp_decode_ext(L,c,3,c->p[1]);
+        break;
+    case 0xc8:  /* ext 16 */
+        mp_cur_need(c,4);
+        mp_decode_ext(L,c,4,((size_t)c->p[1] << 8) | (size_t)c->p[2]);
+        break;
+    case 0xc9:  /* ext 32 */
+        mp_cur_need(c,6);
+        {
+            size_t l = ((size_t)c->p[1] << 24) |
+                       ((size_t)c->p[2] << 16) |
+                       ((size_t)c->p[3] << 8) |
+                       (size_t)c->p[4];
+            mp_decode_ext(L,c,6,l);
+        }
+        break;
     default:    /* types that can't be idenitified by first byte value. */
         if ((c->p[0] & 0x80) == 0) {   /* positive fixnum */
             lua_pushunsigned(L,c->p[0]);
@@ -870,12 +1217,15 @@ void mp_decode_to_lua_type(lua_State *L, mp_cur *c) {
     }
 }
 
-int mp_unpack_full(lua_State *L, int limit, int offset) {
+/* Decodes the string at 1 with the string ids of the dictionary at 2 (nil for none),
+ * nothing else on the stack. */
+static int mp_unpack_full_dict(lua_State *L, int limit, int offset) {
     size_t len;
     const char *s;
     mp_cur c;
     int cnt; /* Number of objects unpacked */
     int decode_all = (!limit && !offset);
+    const struct mp_dict *dict = (const struct mp_dict *)lua_touserdata(L, 2);
 
     s = luaL_checklstring(L,1,&len); /* if no match, exits */
 
@@ -890,6 +1240,13 @@ int mp_unpack_full(lua_State *L, int limit, int offset) {
     if (decode_all) limit = INT_MAX;
 
     mp_cur_init(&c,(const unsigned char *)s+offset,len-offset);
+    c.dict = dict;
+    if (dict) {
+        push_dict_strings(L, dict);
+        c.strings = 3;
+    } else {
+        lua_pushnil(L);
+    }
 
     /* We loop over the decode because this could be a stream
      * of multiple top-level values serialized together */
@@ -902,9 +1259,15 @@ int mp_unpack_full(lua_State *L, int limit, int offset) {
             return luaL_error(L,"Bad data format in input.");
         } else if (c.err == MP_CUR_ERROR_BADDICT) {
 			return luaL_error(L,"Bad DICT ID in input.");
-		}
+		} else if (c.err == MP_CUR_ERROR_BADEXT) {
+            return luaL_error(L,"Unknown ext type in input.");
+        }
     }
 
+    /* drop the dictionary and its strings, the results start at 2 again */
+    lua_remove(L, 3);
+    lua_remove(L, 2);
+
     if (!decode_all) {
         /* c->left is the remaining size of the input buffer.
          * subtract the entire buffer size from the unprocessed size
@@ -925,6 +1288,12 @@ int mp_unpack_full(lua_State *L, int limit, int offset) {
     return cnt;
 }
 
+int mp_unpack_full(lua_State *L, int limit, int offset) {
+    lua_settop(L, 1);
+    mp_push_default_dict(L);
+    return mp_unpack_full_dict(L, limit, offset);
+}
+
 int mp_unpack(lua_State *L) {
     return mp_unpack_full(L, 0, 0);
 }
@@ -945,6 +1314,942 @@ int mp_unpack_limit(lua_State *L) {
     return mp_unpack_full(L, limit, offset);
 }
 
+/* ---------------------------- Streaming decode ----------------------------
+ * msgpack.decoder([dict or version]) returns a decoder fed with the input in
+ * chunks of any size, e.g. straight from socket reads:
+ *
+ *   local out, n, used = dec:feed(chunk [, out])
+ *
+ * out[1..n] are the top level objects completed by this chunk (out[n+1] is
+ * nil), used is the offset in chunk right after the last of them. Containers
+ * are built while their elements arrive and the chunk is decoded in place,
+ * only an element split between two chunks is copied, up to its end. After
+ * an error the decoder drops what it was decoding and starts over with the
+ * next chunk. Without a dictionary the default one of each feed is used. */
+
+#define MP_DECODER_META "msgpack.decoder"
+#define MP_DECODER_MAX_DEPTH 64
+
+typedef struct mp_frame {
+    uint64_t left;      /* elements still expected, keys and values for maps */
+    uint32_t index;     /* last array index set */
+    int ismap;
+} mp_frame;
+
+typedef struct mp_decoder {
+    unsigned char *pending; /* start of an element split between chunks */
+    size_t pending_len, pending_cap;
+    int depth;
+    int broken;         /* a feed raised an error, reset on the next one */
+    int partials_ref;   /* [2*d-1] table being built at depth d, [2*d] its pending key */
+    int dict_ref;
+    mp_frame frames[MP_DECODER_MAX_DEPTH];
+} mp_decoder;
+
+/* Size of the element at p: the whole scalar, or the header of a container.
+ * While p holds less than the header it is the size needed to read the header,
+ * 0 if p[0] starts no element. */
+static size_t mp_element_size(const unsigned char *p, size_t left) {
+    size_t l;
+
+    if (left == 0) return 1;
+    switch(p[0]) {
+    case 0xc0: case 0xc2: case 0xc3:
+        return 1;
+    case 0xcc: case 0xd0: case 0xd4:
+        return 2;
+    case 0xcd: case 0xd1: case 0xd5: case 0xdc: case 0xde:
+        return 3;
+    case 0xce: case 0xd2: case 0xca: case 0xd6: case 0xdd: case 0xdf:
+        return 5;
+    case 0xcf: case 0xd3: case 0xcb:
+        return 9;
+    case 0xd7:
+        return 10;
+    case 0xc7:
+        return left < 3 ? 3 : 3 + (size_t)p[1];
+    case 0xc8:
+        return left < 4 ? 4 : 4 + (((size_t)p[1] << 8) | (size_t)p[2]);
+    case 0xc9:
+        if (left < 6) return 6;
+        l = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) |
+            ((size_t)p[3] << 8) | (size_t)p[4];
+        return l > (size_t)-1 - 6 ? 0 : 6 + l;
+    case 0xd9:
+        return left < 2 ? 2 : 2 + (size_t)p[1];
+    case 0xda:
+        return left < 3 ? 3 : 3 + (((size_t)p[1] << 8) | (size_t)p[2]);
+    case 0xdb:
+        if (left < 5) return 5;
+        l = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) |
+            ((size_t)p[3] << 8) | (size_t)p[4];
+        return l > (size_t)-1 - 5 ? 0 : 5 + l;
+    default:
+        if ((p[0] & 0x80) == 0 || (p[0] & 0xe0) == 0xe0) return 1;
+        if ((p[0] & 0xe0) == 0xa0) return 1 + (p[0] & 0x1f);
+        if ((p[0] & 0xf0) == 0x90 || (p[0] & 0xf0) == 0x80) return 1;
+        return 0;
+    }
+}
+
+/* 1 if the complete element at p is an array or map header */
+static int mp_container_header(const unsigned char *p, uint64_t *len, int *ismap) {
+    switch(p[0]) {
+    case 0xdc: case 0xde:
+        *len = ((uint64_t)p[1] << 8) | p[2];
+        *ismap = p[0] == 0xde;
+        return 1;
+    case 0xdd: case 0xdf:
+        *len = ((uint64_t)p[1] << 24) | ((uint64_t)p[2] << 16) |
+               ((uint64_t)p[3] << 8) | p[4];
+        *ismap = p[0] == 0xdf;
+        return 1;
+    default:
+        if ((p[0] & 0xf0) == 0x90 || (p[0] & 0xf0) == 0x80) {
+            *len = p[0] & 0xf;
+            *ismap = (p[0] & 0xf0) == 0x80;
+            return 1;
+        }
+        return 0;
+    }
+}
+
+/* Stores the value on the top into the container being built, closing the
+ * containers it completes. 1 if a top level object is complete, left on the
+ * top, 0 if the value went into a container (popped). */
+static int mp_decoder_put(lua_State *L, mp_decoder *dec, int partials) {
+    while (dec->depth > 0) {
+        mp_frame *f = &dec->frames[dec->depth-1];
+        int t = 2*dec->depth-1;
+
+        if (!f->ismap) {
+            lua_rawgeti(L, partials, t);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, ++f->index);
+            lua_pop(L, 1);
+        } else if (f->left % 2 == 0) { /* a key, kept until its value */
+            lua_rawseti(L, partials, t+1);
+        } else {
+            lua_rawgeti(L, partials, t);
+            lua_rawgeti(L, partials, t+1);
+            lua_pushvalue(L, -3);
+            lua_rawset(L, -3);
+            lua_pop(L, 2);
+            lua_pushnil(L);
+            lua_rawseti(L, partials, t+1);
+        }
+        if (--f->left > 0) return 0;
+
+        /* the container is complete, it is the value to store in its parent */
+        lua_rawgeti(L, partials, t);
+        lua_pushnil(L);
+        lua_rawseti(L, partials, t);
+        dec->depth--;
+    }
+    return 1;
+}
+
+/* Decodes the complete element at p (size bytes). 1 if it completed a top
+ * level object, left on the top. */
+static int mp_decoder_element(lua_State *L, mp_decoder *dec, const unsigned char *p,
+    size_t size, int partials, const struct mp_dict *dict, int strings) {
+    uint64_t len;
+    int ismap;
+
+    if (mp_container_header(p, &len, &ismap)) {
+        if (len == 0) {
+            lua_newtable(L);
+            return mp_decoder_put(L, dec, partials);
+        }
+        if (dec->depth == MP_DECODER_MAX_DEPTH)
+            return luaL_error(L, "Too deep nesting in input.");
+        /* the header says how many elements, not that they will come */
+        lua_createtable(L, ismap ? 0 : (int)(len < 64 ? len : 64), ismap ? (int)(len < 64 ? len : 64) : 0);
+        lua_rawseti(L, partials, 2*dec->depth+1);
+        dec->frames[dec->depth].left = ismap ? len*2 : len;
+        dec->frames[dec->depth].index = 0;
+        dec->frames[dec->depth].ismap = ismap;
+        dec->depth++;
+        return 0;
+    } else {
+        mp_cur c;
+        mp_cur_init(&c, p, size);
+        c.dict = dict;
+        c.strings = strings;
+        luaL_checkstack(L, 4, "msgpack decoder");
+        mp_decode_to_lua_type(L, &c);
+        if (c.err == MP_CUR_ERROR_BADDICT)
+            return luaL_error(L, "Bad DICT ID in input.");
+        else if (c.err == MP_CUR_ERROR_BADEXT)
+            return luaL_error(L, "Unknown ext type in input.");
+        else if (c.err != MP_CUR_ERROR_NONE)
+            return luaL_error(L, "Bad data format in input.");
+        return mp_decoder_put(L, dec, partials);
+    }
+}
+
+static void mp_decoder_reset(lua_State *L, mp_decoder *dec) {
+    dec->depth = 0;
+    dec->pending_len = 0;
+    dec->broken = 0;
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, dec->partials_ref);
+}
+
+static void mp_decoder_keep(lua_State *L, mp_decoder *dec, const unsigned char *s, size_t len) {
+    if (dec->pending_cap < dec->pending_len + len) {
+        size_t cap = (dec->pending_len + len) * 2;
+        if (cap < 64) cap = 64;
+        dec->pending = (unsigned char*)mp_realloc(L, dec->pending, dec->pending_cap, cap);
+        dec->pending_cap = cap;
+    }
+    memcpy(dec->pending + dec->pending_len, s, len);
+    dec->pending_len += len;
+}
+
+static int mp_decoder_feed(lua_State *L) {
+    mp_decoder *dec = (mp_decoder*)luaL_checkudata(L, 1, MP_DECODER_META);
+    size_t len, pos = 0, used = 0, need;
+    const unsigned char *s = (const unsigned char*)luaL_checklstring(L, 2, &len);
+    const struct mp_dict *dict;
+    int n = 0, strings = 0;
+
+    lua_settop(L, 3);
+    if (!lua_istable(L, 3)) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    if (dec->broken) mp_decoder_reset(L, dec);
+    dec->broken = 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->partials_ref);       /* 4 */
+    if (dec->dict_ref != LUA_NOREF) {                           /* 5 */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, dec->dict_ref);
+        dict = (const struct mp_dict *)lua_touserdata(L, -1);
+    } else {
+        dict = mp_push_default_dict(L);
+    }
+    if (dict) {                                                 /* 6 */
+        push_dict_strings(L, dict);
+        strings = 6;
+    }
+
+    /* first the element split by the previous chunks */
+    if (dec->pending_len > 0) {
+        while ((need = mp_element_size(dec->pending, dec->pending_len)) > dec->pending_len) {
+            size_t take = need - dec->pending_len;
+            if (take > len - pos) take = len - pos;
+            mp_decoder_keep(L, dec, s + pos, take);
+            pos += take;
+            if (pos == len && dec->pending_len < need) break;
+        }
+        if (need == 0)
+            return luaL_error(L, "Bad data format in input.");
+        if (need <= dec->pending_len) {
+            dec->pending_len = 0;
+            if (mp_decoder_element(L, dec, dec->pending, need, 4, dict, strings)) {
+                lua_rawseti(L, 3, ++n);
+                used = pos;
+            }
+        }
+    }
+
+    while (pos < len) {
+        need = mp_element_size(s + pos, len - pos);
+        if (need == 0)
+            return luaL_error(L, "Bad data format in input.");
+        if (need > len - pos) {
+            mp_decoder_keep(L, dec, s + pos, len - pos);
+            break;
+        }
+        if (mp_decoder_element(L, dec, s + pos, need, 4, dict, strings)) {
+            lua_rawseti(L, 3, ++n);
+            used = pos + need;
+        }
+        pos += need;
+    }
+
+    dec->broken = 0;
+    lua_pushnil(L);
+    lua_rawseti(L, 3, n + 1);
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, (lua_Integer)used);
+    return 3;
+}
+
+/* dec:pending(), the bytes kept from the previous chunks and the depth of the
+ * containers being built */
+static int mp_decoder_pending(lua_State *L) {
+    mp_decoder *dec = (mp_decoder*)luaL_checkudata(L, 1, MP_DECODER_META);
+    lua_pushinteger(L, dec->broken ? 0 : (lua_Integer)dec->pending_len);
+    lua_pushinteger(L, dec->broken ? 0 : dec->depth);
+    return 2;
+}
+
+static int mp_decoder_lua_reset(lua_State *L) {
+    mp_decoder *dec = (mp_decoder*)luaL_checkudata(L, 1, MP_DECODER_META);
+    mp_decoder_reset(L, dec);
+    return 0;
+}
+
+static int mp_decoder_gc(lua_State *L) {
+    mp_decoder *dec = (mp_decoder*)luaL_checkudata(L, 1, MP_DECODER_META);
+    mp_realloc(L, dec->pending, dec->pending_cap, 0);
+    dec->pending = NULL;
+    dec->pending_len = dec->pending_cap = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->partials_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->dict_ref);
+    dec->partials_ref = dec->dict_ref = LUA_NOREF;
+    return 0;
+}
+
+static const struct luaL_Reg mp_decoder_methods[] = {
+    {"feed", mp_decoder_feed},
+    {"pending", mp_decoder_pending},
+    {"reset", mp_decoder_lua_reset},
+    {0}
+};
+
+int mp_decoder_new(lua_State *L) {
+    mp_decoder *dec;
+    int i;
+
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1)) mp_push_dict(L, 1);           /* 2 */
+    dec = (mp_decoder*)lua_newuserdata(L, sizeof(*dec));
+    dec->pending = NULL;
+    dec->pending_len = dec->pending_cap = 0;
+    dec->depth = dec->broken = 0;
+    dec->partials_ref = dec->dict_ref = LUA_NOREF;
+    if (luaL_newmetatable(L, MP_DECODER_META)) {
+        lua_pushcfunction(L, mp_decoder_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        for (i = 0; mp_decoder_methods[i].name; i++) {
+            /* errors come back as nil, message like the msgpack functions */
+            lua_pushcfunction(L, mp_decoder_methods[i].func);
+            lua_pushcclosure(L, mp_safe, 1);
+            lua_setfield(L, -2, mp_decoder_methods[i].name);
+        }
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    dec->partials_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (!lua_isnil(L, 1)) {
+        lua_pushvalue(L, 2);
+        dec->dict_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 1;
+}
+
+/* ------------------------------ Async decode ------------------------------
+ * msgpack.unpack_async(s [, callback [, dict or version]]) returns a job and
+ * parses s on a worker thread into a native representation: the nodes in
+ * preorder with the size of every container, each distinct string once. The
+ * Lua values are built later on the state, in one pass with exact table sizes:
+ *
+ *   job:wait() returns the values like unpack, parsing s right away when no
+ *   worker took it yet, or waiting for the one that did.
+ *   msgpack.poll([max]) builds the parsed jobs that have a callback, in submit
+ *   order, and calls callback(values...) or callback(nil, message). Call it
+ *   from the frame update, it returns the callbacks run and the jobs left.
+ *
+ * Workers only read s, kept alive by the job, and allocate with malloc. The
+ * dictionary ids and ext types are decoded while building, on the state's
+ * thread. Without threads (XLUA_NO_THREAD) unpack_async parses s itself. */
+
+#define MP_JOB_META "msgpack.job"
+#define MP_IR_MAX_DEPTH 256
+
+#define MP_IR_NIL       0
+#define MP_IR_FALSE     1
+#define MP_IR_TRUE      2
+#define MP_IR_INT       3
+#define MP_IR_UINT      4
+#define MP_IR_FLOAT     5
+#define MP_IR_STR       6   /* v.u is the index of the distinct string */
+#define MP_IR_ARRAY     7   /* len elements follow */
+#define MP_IR_MAP       8   /* len keys and values follow */
+#define MP_IR_RAW       9   /* dictionary ids and ext types, len bytes at v.u */
+
+typedef struct mp_node {
+    uint8_t type;
+    uint32_t len;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    } v;
+} mp_node;
+
+typedef struct mp_irstr {
+    size_t off, len;
+    uint64_t hash;
+} mp_irstr;
+
+#define MP_JOB_QUEUED   0
+#define MP_JOB_RUNNING  1
+#define MP_JOB_DONE     2
+
+typedef struct mp_job {
+    const unsigned char *s;
+    size_t len;
+    int state;          /* changed under the pool lock */
+    int err;
+    int taken;          /* the values were built */
+    uint32_t count;     /* top level values */
+    mp_node *nodes;
+    size_t nnodes, nodecap;
+    mp_irstr *strs;
+    size_t nstrs, strcap;
+    uint32_t *index;    /* open addressing set of the strs, index+1 */
+    size_t indexcap;
+    struct mp_job *next;
+} mp_job;
+
+typedef struct mp_job_ud {
+    mp_job *job;
+    int ref;            /* registry ref of {s, callback, dict} */
+} mp_job_ud;
+
+/* worker threads shared by every state, they live as long as the process */
+static struct {
+    int threads;
+    mp_job *head, *tail;
+    xmutex_t lock;
+    xcond_t work, done;
+} mp_pool;
+
+/* registry list of the jobs with a callback, in submit order */
+static int mp_jobs_tag = 0;
+
+static mp_node *mp_ir_node(mp_job *job) {
+    if (job->nnodes == job->nodecap) {
+        size_t cap = job->nodecap ? job->nodecap * 2 : job->len / 4 + 16;
+        mp_node *nodes = (mp_node*)realloc(job->nodes, cap * sizeof(mp_node));
+        if (nodes == NULL) return NULL;
+        job->nodes = nodes;
+        job->nodecap = cap;
+    }
+    return &job->nodes[job->nnodes++];
+}
+
+static int mp_ir_grow_index(mp_job *job) {
+    size_t cap = job->indexcap ? job->indexcap * 2 : 64, i, k;
+    uint32_t *index = (uint32_t*)calloc(cap, sizeof(uint32_t));
+
+    if (index == NULL) return 0;
+    for (k = 0; k < job->nstrs; k++) {
+        for (i = (size_t)job->strs[k].hash & (cap - 1); index[i] != 0; i = (i + 1) & (cap - 1));
+        index[i] = (uint32_t)k + 1;
+    }
+    free(job->index);
+    job->index = index;
+    job->indexcap = cap;
+    return 1;
+}
+
+/* the index of the distinct string of len bytes at off, -1 out of memory */
+static int64_t mp_ir_string(mp_job *job, size_t off, size_t len) {
+    const unsigned char *str = job->s + off;
+    uint64_t hash = mp_dict_hash((const char*)str, len);
+    size_t i, mask;
+
+    if (job->nstrs * 2 >= job->indexcap && !mp_ir_grow_index(job)) return -1;
+    mask = job->indexcap - 1;
+    for (i = (size_t)hash & mask; job->index[i] != 0; i = (i + 1) & mask) {
+        const mp_irstr *e = &job->strs[job->index[i] - 1];
+        if (e->hash == hash && e->len == len && memcmp(job->s + e->off, str, len) == 0)
+            return job->index[i] - 1;
+    }
+    if (job->nstrs == job->strcap) {
+        size_t cap = job->strcap ? job->strcap * 2 : 64;
+        mp_irstr *strs = (mp_irstr*)realloc(job->strs, cap * sizeof(mp_irstr));
+        if (strs == NULL) return -1;
+        job->strs = strs;
+        job->strcap = cap;
+    }
+    job->strs[job->nstrs].off = off;
+    job->strs[job->nstrs].len = len;
+    job->strs[job->nstrs].hash = hash;
+    job->index[i] = (uint32_t)++job->nstrs;
+    return (int64_t)job->nstrs - 1;
+}
+
+static uint64_t mp_ir_be(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    while (n--) v = (v << 8) | *p++;
+    return v;
+}
+
+/* the node of the scalar of size bytes at off, 0 on error */
+static int mp_ir_scalar(mp_job *job, mp_node *n, size_t off, size_t size) {
+    const unsigned char *p = job->s + off;
+    size_t stroff = 0;
+
+    n->len = 0;
+    switch(p[0]) {
+    case 0xc0: n->type = MP_IR_NIL; return 1;
+    case 0xc2: n->type = MP_IR_FALSE; return 1;
+    case 0xc3: n->type = MP_IR_TRUE; return 1;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        n->type = MP_IR_UINT;
+        n->v.u = mp_ir_be(p + 1, (int)size - 1);
+        return 1;
+    case 0xd0: n->type = MP_IR_INT; n->v.i = (signed char)p[1]; return 1;
+    case 0xd1: n->type = MP_IR_INT; n->v.i = (int16_t)mp_ir_be(p + 1, 2); return 1;
+    case 0xd2: n->type = MP_IR_INT; n->v.i = (int32_t)mp_ir_be(p + 1, 4); return 1;
+    case 0xd3: n->type = MP_IR_INT; n->v.i = (int64_t)mp_ir_be(p + 1, 8); return 1;
+    case 0xca:
+        {
+            float f;
+            memcpy(&f,p+1,4);
+            memrevifle(&f,4);
+            n->type = MP_IR_FLOAT;
+            n->v.d = f;
+        }
+        return 1;
+    case 0xcb:
+        n->type = MP_IR_FLOAT;
+        memcpy(&n->v.d,p+1,8);
+        memrevifle(&n->v.d,8);
+        return 1;
+    case 0xd9: stroff = 2; break;
+    case 0xda: stroff = 3; break;
+    case 0xdb: stroff = 5; break;
+    default:
+        if ((p[0] & 0x80) == 0) {
+            n->type = MP_IR_UINT;
+            n->v.u = p[0];
+            return 1;
+        } else if ((p[0] & 0xe0) == 0xe0) {
+            n->type = MP_IR_INT;
+            n->v.i = (signed char)p[0];
+            return 1;
+        } else if ((p[0] & 0xe0) == 0xa0) {
+            stroff = 1;
+        }
+    }
+    if (stroff > 0) {
+        int64_t id = mp_ir_string(job, off + stroff, size - stroff);
+        if (id < 0) {
+            job->err = MP_CUR_ERROR_NOMEM;
+            return 0;
+        }
+        n->type = MP_IR_STR;
+        n->v.u = (uint64_t)id;
+    } else {
+        if (size > 0xffffffff) {
+            job->err = MP_CUR_ERROR_BADFMT;
+            return 0;
+        }
+        n->type = MP_IR_RAW;
+        n->len = (uint32_t)size;
+        n->v.u = off;
+    }
+    return 1;
+}
+
+/* worker side, the input into nodes and strings, no Lua call */
+static void mp_ir_parse(mp_job *job) {
+    uint64_t left[MP_IR_MAX_DEPTH];
+    int depth = 0;
+    size_t pos = 0;
+
+    while (pos < job->len) {
+        size_t size = mp_element_size(job->s + pos, job->len - pos);
+        uint64_t len;
+        int ismap;
+        mp_node *n;
+
+        if (size == 0) {
+            job->err = MP_CUR_ERROR_BADFMT;
+            return;
+        }
+        if (size > job->len - pos) {
+            job->err = MP_CUR_ERROR_EOF;
+            return;
+        }
+        if ((n = mp_ir_node(job)) == NULL) {
+            job->err = MP_CUR_ERROR_NOMEM;
+            return;
+        }
+        if (mp_container_header(job->s + pos, &len, &ismap)) {
+            n->type = ismap ? MP_IR_MAP : MP_IR_ARRAY;
+            n->len = (uint32_t)len;
+            n->v.u = 0;
+            pos += size;
+            if (len > 0) {
+                if (depth == MP_IR_MAX_DEPTH) {
+                    job->err = MP_CUR_ERROR_BADFMT;
+                    return;
+                }
+                left[depth++] = ismap ? len * 2 : len;
+                continue;
+            }
+        } else {
+            if (!mp_ir_scalar(job, n, pos, size)) return;
+            pos += size;
+        }
+        /* the element is complete, and the containers it was the last of */
+        while (depth > 0 && --left[depth-1] == 0) depth--;
+        if (depth == 0) job->count++;
+    }
+    if (depth > 0) job->err = MP_CUR_ERROR_EOF;
+}
+
+static void mp_ir_free(mp_job *job) {
+    free(job->nodes);
+    free(job->strs);
+    free(job->index);
+    job->nodes = NULL;
+    job->strs = NULL;
+    job->index = NULL;
+    job->nnodes = job->nodecap = job->nstrs = job->strcap = job->indexcap = 0;
+}
+
+static void mp_pool_worker(void *ud) {
+    (void)ud;
+    xmutex_lock(&mp_pool.lock);
+    for (;;) {
+        mp_job *job;
+
+        while (mp_pool.head == NULL)
+            xcond_wait(&mp_pool.work, &mp_pool.lock);
+        job = mp_pool.head;
+        mp_pool.head = job->next;
+        if (mp_pool.head == NULL) mp_pool.tail = NULL;
+        job->state = MP_JOB_RUNNING;
+        xmutex_unlock(&mp_pool.lock);
+        mp_ir_parse(job);
+        xmutex_lock(&mp_pool.lock);
+        job->state = MP_JOB_DONE;
+        xcond_broadcast(&mp_pool.done);
+    }
+}
+
+static xonce_t mp_pool_once = XONCE_INIT;
+
+static void mp_pool_init(void) {
+    int i, n;
+
+    xmutex_init(&mp_pool.lock);
+    xcond_init(&mp_pool.work);
+    xcond_init(&mp_pool.done);
+    n = xthread_cpu_count() - 1;
+    if (n > LUACMSGPACK_ASYNC_THREADS) n = LUACMSGPACK_ASYNC_THREADS;
+    if (n < 1) n = 1;
+    for (i = 0; i < n; i++) {
+        xthread_t t;
+        if (!xthread_create(&t, mp_pool_worker, NULL)) break;
+        mp_pool.threads++;
+    }
+}
+
+/* states on other threads may make their first unpack_async at the same time */
+static void mp_pool_start(void) {
+    xonce(&mp_pool_once, mp_pool_init);
+}
+
+/* parsed, or being parsed, when it returns */
+static void mp_job_take(mp_job *job, int wait) {
+    xmutex_lock(&mp_pool.lock);
+    if (job->state == MP_JOB_QUEUED) {
+        mp_job **p = &mp_pool.head;
+        mp_job *prev = NULL;
+        while (*p != job) {
+            prev = *p;
+            p = &(*p)->next;
+        }
+        *p = job->next;
+        if (mp_pool.tail == job) mp_pool.tail = prev;
+        job->state = MP_JOB_RUNNING;
+        xmutex_unlock(&mp_pool.lock);
+        if (wait) mp_ir_parse(job);
+        xmutex_lock(&mp_pool.lock);
+        job->state = MP_JOB_DONE;
+    }
+    while (wait && job->state != MP_JOB_DONE)
+        xcond_wait(&mp_pool.done, &mp_pool.lock);
+    xmutex_unlock(&mp_pool.lock);
+}
+
+static int mp_job_done(mp_job *job) {
+    int done;
+    xmutex_lock(&mp_pool.lock);
+    done = job->state == MP_JOB_DONE;
+    xmutex_unlock(&mp_pool.lock);
+    return done;
+}
+
+static void mp_ir_push(lua_State *L, mp_job *job, size_t *i, int strs, mp_cur *c) {
+    const mp_node *n = &job->nodes[(*i)++];
+    uint32_t k;
+
+    luaL_checkstack(L, 3, "msgpack unpack");
+    switch(n->type) {
+    case MP_IR_NIL: lua_pushnil(L); break;
+    case MP_IR_FALSE: lua_pushboolean(L,0); break;
+    case MP_IR_TRUE: lua_pushboolean(L,1); break;
+    case MP_IR_INT:
+#if LUA_VERSION_NUM < 503
+        lua_pushnumber(L,(lua_Number)n->v.i);
+#else
+        lua_pushinteger(L,(lua_Integer)n->v.i);
+#endif
+        break;
+    case MP_IR_UINT: lua_pushunsigned(L,n->v.u); break;
+    case MP_IR_FLOAT: lua_pushnumber(L,n->v.d); break;
+    case MP_IR_STR: lua_rawgeti(L,strs,(int)n->v.u + 1); break;
+    case MP_IR_ARRAY:
+        lua_createtable(L,(int)n->len,0);
+        for (k = 1; k <= n->len; k++) {
+            mp_ir_push(L,job,i,strs,c);
+            lua_rawseti(L,-2,(int)k);
+        }
+        break;
+    case MP_IR_MAP:
+        lua_createtable(L,0,(int)n->len);
+        for (k = 0; k < n->len; k++) {
+            mp_ir_push(L,job,i,strs,c);
+            mp_ir_push(L,job,i,strs,c);
+            lua_rawset(L,-3);
+        }
+        break;
+    default:
+        c->p = job->s + n->v.u;
+        c->left = n->len;
+        mp_decode_to_lua_type(L,c);
+        if (c->err == MP_CUR_ERROR_BADDICT)
+            luaL_error(L,"Bad DICT ID in input.");
+        else if (c->err == MP_CUR_ERROR_BADEXT)
+            luaL_error(L,"Unknown ext type in input.");
+        else if (c->err != MP_CUR_ERROR_NONE)
+            luaL_error(L,"Bad data format in input.");
+    }
+}
+
+/* the values of the parsed job at 1 */
+static int mp_job_build(lua_State *L) {
+    mp_job_ud *ud = (mp_job_ud*)lua_touserdata(L,1);
+    mp_job *job = ud->job;
+    const struct mp_dict *dict;
+    mp_cur c;
+    size_t i = 0, k;
+
+    if (job->taken)
+        return luaL_error(L,"Job values already taken.");
+    job->taken = 1;
+    switch(job->err) {
+    case MP_CUR_ERROR_NONE: break;
+    case MP_CUR_ERROR_EOF: return luaL_error(L,"Missing bytes in input.");
+    case MP_CUR_ERROR_NOMEM: return luaL_error(L,"Not enough memory to unpack.");
+    default: return luaL_error(L,"Bad data format in input.");
+    }
+
+    lua_settop(L,1);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,ud->ref);   /* 2 */
+    lua_rawgeti(L,2,3);                         /* 3 */
+    dict = (const struct mp_dict *)lua_touserdata(L,3);
+    if (dict)                                   /* 4 */
+        push_dict_strings(L,dict);
+    else
+        lua_pushnil(L);
+    mp_cur_init(&c,job->s,0);
+    c.dict = dict;
+    c.strings = 4;
+    lua_createtable(L,(int)job->nstrs,0);       /* 5 */
+    for (k = 0; k < job->nstrs; k++) {
+        lua_pushlstring(L,(const char*)job->s + job->strs[k].off,job->strs[k].len);
+        lua_rawseti(L,5,(int)k + 1);
+    }
+    luaL_checkstack(L,(int)job->count,
+        "too many return values at once; "
+        "use unpack_one or unpack_limit instead.");
+    for (k = 0; k < job->count; k++)
+        mp_ir_push(L,job,&i,5,&c);
+    mp_ir_free(job);
+    return (int)job->count;
+}
+
+/* job:wait() */
+static int mp_job_wait(lua_State *L) {
+    mp_job_ud *ud = (mp_job_ud*)luaL_checkudata(L,1,MP_JOB_META);
+    mp_job_take(ud->job,1);
+    return mp_job_build(L);
+}
+
+/* job:ready(), parsed and waiting to be built */
+static int mp_job_ready(lua_State *L) {
+    mp_job_ud *ud = (mp_job_ud*)luaL_checkudata(L,1,MP_JOB_META);
+    lua_pushboolean(L,!ud->job->taken && mp_job_done(ud->job));
+    return 1;
+}
+
+static int mp_job_gc(lua_State *L) {
+    mp_job_ud *ud = (mp_job_ud*)luaL_checkudata(L,1,MP_JOB_META);
+    if (ud->job) {
+        /* a queued job is dropped, a running one is waited for */
+        mp_job_take(ud->job,0);
+        xmutex_lock(&mp_pool.lock);
+        while (ud->job->state != MP_JOB_DONE)
+            xcond_wait(&mp_pool.done,&mp_pool.lock);
+        xmutex_unlock(&mp_pool.lock);
+        mp_ir_free(ud->job);
+        free(ud->job);
+        ud->job = NULL;
+    }
+    luaL_unref(L,LUA_REGISTRYINDEX,ud->ref);
+    ud->ref = LUA_NOREF;
+    return 0;
+}
+
+static const struct luaL_Reg mp_job_methods[] = {
+    {"wait", mp_job_wait},
+    {"ready", mp_job_ready},
+    {0}
+};
+
+int mp_unpack_async(lua_State *L) {
+    size_t len;
+    const char *s = luaL_checklstring(L,1,&len);
+    mp_job_ud *ud;
+    mp_job *job;
+    int i;
+
+    if (!lua_isnoneornil(L,2)) luaL_checktype(L,2,LUA_TFUNCTION);
+    lua_settop(L,3);
+    if (lua_isnil(L,3))                         /* 4 */
+        mp_push_default_dict(L);
+    else
+        mp_push_dict(L,3);
+    ud = (mp_job_ud*)lua_newuserdata(L,sizeof(*ud));
+    ud->job = NULL;
+    ud->ref = LUA_NOREF;
+    if (luaL_newmetatable(L,MP_JOB_META)) {
+        lua_pushcfunction(L,mp_job_gc);
+        lua_setfield(L,-2,"__gc");
+        lua_newtable(L);
+        for (i = 0; mp_job_methods[i].name; i++) {
+            lua_pushcfunction(L,mp_job_methods[i].func);
+            lua_pushcclosure(L,mp_safe,1);
+            lua_setfield(L,-2,mp_job_methods[i].name);
+        }
+        lua_setfield(L,-2,"__index");
+    }
+    lua_setmetatable(L,-2);
+    lua_createtable(L,3,0);
+    lua_pushvalue(L,1);
+    lua_rawseti(L,-2,1);
+    lua_pushvalue(L,2);
+    lua_rawseti(L,-2,2);
+    lua_pushvalue(L,4);
+    lua_rawseti(L,-2,3);
+    ud->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    job = (mp_job*)calloc(1,sizeof(mp_job));
+    if (job == NULL)
+        return luaL_error(L,"Not enough memory to unpack.");
+    job->s = (const unsigned char*)s;
+    job->len = len;
+    ud->job = job;
+
+    if (!lua_isnil(L,2)) {
+        lua_pushlightuserdata(L,&mp_jobs_tag);
+        lua_rawget(L,LUA_REGISTRYINDEX);
+        if (!lua_istable(L,-1)) {
+            lua_pop(L,1);
+            lua_newtable(L);
+            lua_pushlightuserdata(L,&mp_jobs_tag);
+            lua_pushvalue(L,-2);
+            lua_rawset(L,LUA_REGISTRYINDEX);
+        }
+        lua_pushvalue(L,5);
+#if LUA_VERSION_NUM < 502
+        lua_rawseti(L,-2,(int)lua_objlen(L,-2) + 1);
+#else
+        lua_rawseti(L,-2,(int)lua_rawlen(L,-2) + 1);
+#endif
+        lua_pop(L,1);
+    }
+
+    mp_pool_start();
+    if (mp_pool.threads > 0) {
+        xmutex_lock(&mp_pool.lock);
+        job->state = MP_JOB_QUEUED;
+        if (mp_pool.tail) mp_pool.tail->next = job; else mp_pool.head = job;
+        mp_pool.tail = job;
+        xcond_signal(&mp_pool.work);
+        xmutex_unlock(&mp_pool.lock);
+    } else {
+        mp_ir_parse(job);
+        job->state = MP_JOB_DONE;
+    }
+    lua_settop(L,5);
+    return 1;
+}
+
+/* msgpack.poll([max]) */
+int mp_poll(lua_State *L) {
+    int max = (int)luaL_optinteger(L,1,INT_MAX), ran = 0, n, k;
+
+    lua_settop(L,0);
+    lua_pushlightuserdata(L,&mp_jobs_tag);
+    lua_rawget(L,LUA_REGISTRYINDEX);            /* 1 */
+    if (!lua_istable(L,1)) {
+        lua_pushinteger(L,0);
+        lua_pushinteger(L,0);
+        return 2;
+    }
+    while (ran < max) {
+        mp_job_ud *ud = NULL;
+        int base;
+
+#if LUA_VERSION_NUM < 502
+        n = (int)lua_objlen(L,1);
+#else
+        n = (int)lua_rawlen(L,1);
+#endif
+        /* only the oldest job, a later one that is done waits for it */
+        if (n == 0) break;
+        lua_rawgeti(L,1,1);
+        ud = (mp_job_ud*)lua_touserdata(L,-1);
+        if (!mp_job_done(ud->job)) break;
+        /* off the list first, a failing callback does not run it again */
+        for (k = 1; k < n; k++) {
+            lua_rawgeti(L,1,k+1);
+            lua_rawseti(L,1,k);
+        }
+        lua_pushnil(L);
+        lua_rawseti(L,1,n);
+        if (ud->job->taken) { /* job:wait() got the values */
+            lua_settop(L,1);
+            continue;
+        }
+
+        lua_rawgeti(L,LUA_REGISTRYINDEX,ud->ref);
+        lua_rawgeti(L,-1,2);
+        lua_replace(L,-2);                      /* the callback */
+        base = lua_gettop(L);
+        lua_pushcfunction(L,mp_job_build);
+        lua_pushvalue(L,2);
+        if (lua_pcall(L,1,LUA_MULTRET,0) != 0) {
+            lua_pushnil(L);
+            lua_insert(L,-2);
+        }
+        lua_call(L,lua_gettop(L) - base,0);
+        lua_settop(L,1);
+        ran++;
+    }
+    lua_pushinteger(L,ran);
+#if LUA_VERSION_NUM < 502
+    lua_pushinteger(L,(lua_Integer)lua_objlen(L,1));
+#else
+    lua_pushinteger(L,(lua_Integer)lua_rawlen(L,1));
+#endif
+    return 2;
+}
+
 int mp_safe(lua_State *L) {
     int argc, err, total_results;
 
@@ -970,10 +2275,20 @@ int mp_safe(lua_State *L) {
 /* -------------------------------------------------------------------------- */
 const struct luaL_Reg cmds[] = {
 	{"init", mp_init},
+	{"newdict", mp_newdict},
+	{"setdict", mp_setdict},
+	{"getdict", mp_getdict},
     {"pack", mp_pack},
+    {"pack_dict", mp_pack_dict},
     {"unpack", mp_unpack},
+    {"unpack_dict", mp_unpack_dict},
     {"unpack_one", mp_unpack_one},
     {"unpack_limit", mp_unpack_limit},
+    {"decoder", mp_decoder_new},
+    {"register_struct", mp_register_struct},
+    {"unpack_async", mp_unpack_async},
+    {"poll", mp_poll},
+    {"set_pack_mode", mp_set_pack_mode},
     {0}
 };
 
@@ -988,6 +2303,16 @@ int luaopen_create(lua_State *L) {
         lua_setfield(L, -2, cmds[i].name);
     }
 
+    /* setmetatable(t, msgpack.array_mt) packs t as a list, map_mt as a map */
+    lua_newtable(L);
+    lua_pushliteral(L, "array");
+    lua_setfield(L, -2, "__msgpack");
+    lua_setfield(L, -2, "array_mt");
+    lua_newtable(L);
+    lua_pushliteral(L, "map");
+    lua_setfield(L, -2, "__msgpack");
+    lua_setfield(L, -2, "map_mt");
+
     /* Add metadata */
     lua_pushliteral(L, LUACMSGPACK_NAME);
     lua_setfield(L, -2, "_NAME");
@@ -1062,191 +2387,486 @@ LUALIB_API int luaopen_msgpack(lua_State *L) {
 ******************************************************************************/
 
 
+
+
 /*---------------------------------------------------------------------------------*/
-/* add by liwenkun 20170925; */
-/* lock free shared string dict */
+/* add by liwenkun 20170925; string dictionaries */
+/*
+ * a dictionary is a list of strings, a string found in it is packed as its id (0xd4/0xd5/0xd6
+ * and the id) instead of its bytes, ids count the distinct strings in list order.
+ *
+ * dictionaries belong to a state. msgpack.init sets the one pack/unpack use, msgpack.setdict
+ * registers one per protocol version for pack_dict/unpack_dict. replacing a dictionary (hot
+ * swap) only affects the calls made after it, a pack or unpack keeps the one it started with.
+ *
+ * lookups go through a perfect hash built with the dictionary (hash and displace): the hash of
+ * the string picks a bucket, the displacement of the bucket picks the slot, one compare tells
+ * if it is the string. unpack pushes the dictionary's own strings, nothing is interned again.
+ */
 
-/* hastable */
-static struct TString * s_msgpack_pHash = 0;
-static int s_msgpack_nSlotLen = 2048;
-static int s_msgpack_nNextIndex = 0;
+#define MP_DICT_META "msgpack.dict"
+#define MP_DICT_BUCKET_SIZE 4 /* average keys per bucket */
+#define MP_DICT_SLOT_TRIES 8 /* slot counts tried for one bucket seed */
+#define MP_DICT_SEED_TRIES 8 /* bucket seeds tried before giving up */
+
+typedef struct mp_dict_entry {
+	const char *str; /* owned by the strings table */
+	size_t len;
+} mp_dict_entry;
+
+typedef struct mp_dict {
+	uint32_t count;    /* distinct strings, the ids are 0..count-1 */
+	uint32_t nbuckets;
+	uint32_t nslots;   /* count unless building with that many failed */
+	uint32_t seed;     /* of the bucket function, 0 unless building with it failed */
+	int strings_ref;   /* registry ref of the id+1 -> string table */
+	int misses_ref;    /* registry ref of the string -> count table of misses, recording only */
+	mp_dict_entry *entries;
+	uint32_t *disp;    /* bucket -> displacement */
+	int32_t *slots;    /* slot -> id */
+} mp_dict;
+
+static int mp_dicts_tag = 0;
+static int mp_default_dict_tag = 0;
+
+static uint64_t mp_dict_hash(const char *str, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
 
-/* array */
-static struct TString ** s_msgpack_arrId2Str = 0;
-static size_t s_msgpack_arrId2StrLen = 0;
+/* seed 0 takes the high half as it is, another seed mixes the whole hash with it */
+static uint32_t mp_dict_bucket(uint64_t hash, uint32_t seed, uint32_t nbuckets) {
+	uint64_t x;
+	if (seed == 0)
+		return (uint32_t)((hash >> 32) % nbuckets);
+	x = hash ^ ((uint64_t)seed * 0xC2B2AE3D27D4EB4FULL);
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 31;
+	return (uint32_t)(x % nbuckets);
+}
 
-/* record */
-static int s_msgpack_doRecord = 0;
+static uint32_t mp_dict_slot(uint64_t hash, uint32_t disp, uint32_t nslots) {
+	uint64_t x = hash ^ ((uint64_t)disp * 0x9E3779B97F4A7C15ULL);
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	return (uint32_t)(x % nslots);
+}
 
-uint32_t CalcHash(const char * str, size_t strLen)
-{
-	uint32_t hash = 2166136261, ch;
-	size_t i ;
-	for(i = 0;i< strLen ;++i)
-    {  
-		ch = (uint32_t)str[i];
-        hash *= 16777619;  
-        hash ^= ch; 
-    }
-    return hash;  
+static int mp_dict_id(const struct mp_dict *d, const char *str, size_t len) {
+	uint64_t hash;
+	int32_t id;
+
+	if (d == NULL || d->count == 0)
+		return -1;
+	hash = mp_dict_hash(str, len);
+	id = d->slots[mp_dict_slot(hash, d->disp[mp_dict_bucket(hash, d->seed, d->nbuckets)], d->nslots)];
+	if (id < 0 || d->entries[id].len != len || memcmp(d->entries[id].str, str, len) != 0)
+		return -1;
+	return id;
+}
+
+/* counts the string on the top that was not in the dictionary, when it records them */
+static void mp_dict_record_miss(lua_State *L, const struct mp_dict *d, size_t len) {
+	if (d == NULL || d->misses_ref == LUA_NOREF || len <= 1)
+		return;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->misses_ref);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+	lua_replace(L, -2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
 }
 
-TString * dict_insert(const char * str, size_t strLen)
+static void push_dict_strings(lua_State *L, const struct mp_dict *d) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->strings_ref);
+}
+
+static void push_dict_string(lua_State *L, struct mp_cur *c, size_t dictId)
 {
-	struct TString *p;
-	uint32_t hash, slotId;
-	
-	if(query_dict_id(str, strLen) >= 0)
-		return 0;
-	
-	hash = CalcHash(str, strLen);
-	slotId = hash % s_msgpack_nSlotLen;
-	
-	p = &s_msgpack_pHash[slotId];
-	
-	if(p->str)
+	if (c->dict && dictId < c->dict->count)
 	{
-		while(p->next)
-		{
-			p = p->next;
-		}
-		
-		p->next =  (TString*)malloc(sizeof(TString));
-		memset(p->next, 0, sizeof(TString));
-		p = p->next;
+		lua_rawgeti(L, c->strings, (int)dictId + 1);
+	}
+	else
+	{
+		c->err = MP_CUR_ERROR_BADDICT;
+		lua_pushlstring(L, "__bad_dict_id___", 16);
 	}
-	
-	p->strLen = strLen;
-	p->str = malloc(strLen+1);
-	memcpy(p->str, str, strLen);
-	p->str[strLen]='\0';
-	p->index = s_msgpack_nNextIndex++;
-	return p;
 }
 
-int mp_init(lua_State *L)
-{
-	size_t j,len;
-	const char * str;
-	TString * saveStr;
-	
-	if(s_msgpack_pHash){
-		printf("Error init twice\n");
+static int mp_dict_gc(lua_State *L) {
+	mp_dict *d = (mp_dict *)luaL_checkudata(L, 1, MP_DICT_META);
+	luaL_unref(L, LUA_REGISTRYINDEX, d->strings_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, d->misses_ref);
+	d->strings_ref = d->misses_ref = LUA_NOREF;
+	d->count = 0;
+	return 0;
+}
+
+/* dict:id(str), the id of str or nil */
+static int mp_dict_lua_id(lua_State *L) {
+	mp_dict *d = (mp_dict *)luaL_checkudata(L, 1, MP_DICT_META);
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	int id = mp_dict_id(d, str, len);
+	if (id < 0)
+		return 0;
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+/* dict:str(id) */
+static int mp_dict_lua_str(lua_State *L) {
+	mp_dict *d = (mp_dict *)luaL_checkudata(L, 1, MP_DICT_META);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	if (id < 0 || id >= (lua_Integer)d->count)
 		return 0;
+	push_dict_strings(L, d);
+	lua_rawgeti(L, -1, (int)id + 1);
+	return 1;
+}
+
+static int mp_dict_lua_size(lua_State *L) {
+	mp_dict *d = (mp_dict *)luaL_checkudata(L, 1, MP_DICT_META);
+	lua_pushinteger(L, d->count);
+	return 1;
+}
+
+/* dict:misses(), string -> times packed without an id, nil unless the dictionary records */
+static int mp_dict_lua_misses(lua_State *L) {
+	mp_dict *d = (mp_dict *)luaL_checkudata(L, 1, MP_DICT_META);
+	if (d->misses_ref == LUA_NOREF)
+		return 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, d->misses_ref);
+	return 1;
+}
+
+static const struct luaL_Reg mp_dict_methods[] = {
+	{"id", mp_dict_lua_id},
+	{"str", mp_dict_lua_str},
+	{"size", mp_dict_lua_size},
+	{"misses", mp_dict_lua_misses},
+	{0}
+};
+
+typedef struct mp_dict_bucket_order {
+	uint32_t size;
+	uint32_t bucket;
+} mp_dict_bucket_order;
+
+static int mp_dict_cmp_bucket(const void *a, const void *b) {
+	const mp_dict_bucket_order *x = (const mp_dict_bucket_order *)a, *y = (const mp_dict_bucket_order *)b;
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+	return x->bucket < y->bucket ? -1 : (x->bucket > y->bucket ? 1 : 0);
+}
+
+/* places every bucket, largest first, into slots (nslots of them, -1 filled). 0 if a bucket
+ * found no displacement within its tries */
+static int mp_dict_place(const uint64_t *hashes, const uint32_t *keys, const uint32_t *first,
+	const mp_dict_bucket_order *order, uint32_t nbuckets, uint32_t *disp, int32_t *slots, uint32_t nslots) {
+	uint32_t b, i, j, tries = nslots * 16 + 1024;
+	uint32_t placed[64];
+
+	for (b = 0; b < nbuckets && order[b].size > 0; b++) {
+		uint32_t bucket = order[b].bucket, size = order[b].size, d;
+		const uint32_t *k = keys + first[bucket];
+		if (size > 64)
+			return 0;
+		for (d = 0; d < tries; d++) {
+			for (i = 0; i < size; i++) {
+				placed[i] = mp_dict_slot(hashes[k[i]], d, nslots);
+				if (slots[placed[i]] >= 0)
+					break;
+				for (j = 0; j < i && placed[j] != placed[i]; j++);
+				if (j < i)
+					break;
+			}
+			if (i == size)
+				break;
+		}
+		if (d == tries)
+			return 0;
+		disp[bucket] = d;
+		for (i = 0; i < size; i++)
+			slots[placed[i]] = (int32_t)k[i];
 	}
-	
-	luaL_checktype(L, 1, LUA_TTABLE);
-	
-	
+	return 1;
+}
+
+/* builds a dictionary from the list of strings at idx, pushes it */
+static mp_dict *mp_dict_build(lua_State *L, int idx, int record) {
+	int top = lua_gettop(L), strings = top + 1, seen = top + 2;
+	size_t n, i;
+	uint32_t count = 0, nbuckets, nslots, seed, b, j, tries;
+	uint64_t *hashes;
+	uint32_t *bucket_of, *first, *keys, *fill, *disp;
+	int32_t *slots;
+	mp_dict_bucket_order *order;
+	mp_dict *d;
+	char *p;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
 #if LUA_VERSION_NUM < 502
-    s_msgpack_arrId2StrLen = lua_objlen(L,1);
+	n = lua_objlen(L, idx);
 #else
-    s_msgpack_arrId2StrLen = lua_rawlen(L,1);
+	n = lua_rawlen(L, idx);
 #endif
-	
-	if(s_msgpack_arrId2StrLen <= 0)
-	{
-		return luaL_error(L, "empty dict");
+	if (n == 0)
+		luaL_error(L, "empty dict");
+	if (n >= 0x7fffffff)
+		luaL_error(L, "dict too large");
+
+	lua_newtable(L); /* id+1 -> string */
+	lua_newtable(L); /* string -> true */
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, (int)i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "dict entry %d is not a string", (int)i);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, seen);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, seen);
+			lua_rawseti(L, strings, (int)++count);
+		} else {
+			lua_pop(L, 2); /* duplicate, keeps the id of the first one */
+		}
 	}
-	
-	s_msgpack_nSlotLen = luaL_optinteger(L, 2, s_msgpack_arrId2StrLen * 4);
-	s_msgpack_doRecord = luaL_optinteger(L, 3, s_msgpack_doRecord);
-	if(s_msgpack_doRecord != 0)
-	{
-		printf("enable record\n");
+
+	nbuckets = count / MP_DICT_BUCKET_SIZE + 1;
+	p = (char *)lua_newuserdata(L, sizeof(uint64_t) * count + sizeof(uint32_t) * (count * 2 + nbuckets * 3)
+		+ sizeof(mp_dict_bucket_order) * nbuckets);
+	hashes = (uint64_t *)p;
+	bucket_of = (uint32_t *)(hashes + count);
+	keys = bucket_of + count;
+	first = keys + count;
+	fill = first + nbuckets;
+	disp = fill + nbuckets;
+	order = (mp_dict_bucket_order *)(disp + nbuckets);
+
+	for (i = 0; i < count; i++) {
+		size_t len;
+		const char *str;
+		lua_rawgeti(L, strings, (int)i + 1);
+		str = lua_tolstring(L, -1, &len);
+		hashes[i] = mp_dict_hash(str, len);
+		lua_pop(L, 1);
 	}
-	
-	s_msgpack_nNextIndex = 0;
-	s_msgpack_pHash = (struct TString*) malloc( sizeof(struct TString) * s_msgpack_nSlotLen);
-	memset(s_msgpack_pHash, 0, sizeof(TString) * s_msgpack_nSlotLen);
-	
 
-	s_msgpack_arrId2Str = (struct TString**)malloc( sizeof(struct TString*) * s_msgpack_arrId2StrLen );
-	memset(s_msgpack_arrId2Str, 0, sizeof(struct TString*) * s_msgpack_arrId2StrLen);
-	
-	
-    for (j = 1; j <= s_msgpack_arrId2StrLen; j++) {
-        lua_pushnumber(L,j);
-        lua_gettable(L,1);
-		len = 0;
-		str = luaL_checklstring(L, -1, &len);
-		/*printf("the str %s\n",str);*/
-		saveStr = dict_insert(str, len);
-		if(saveStr)
-		{
-			/*printf("insert dict str=[%s] index=%d\n", saveStr->str, saveStr->index);*/
-			assert(saveStr->index < s_msgpack_arrId2StrLen);
-			s_msgpack_arrId2Str[saveStr->index] = saveStr;
+	/* minimal first, a few more slots if some bucket can not be placed, then another seed */
+	for (seed = 0; ; seed++) {
+		if (seed == MP_DICT_SEED_TRIES)
+			luaL_error(L, "dict keys can not be placed");
+		memset(fill, 0, sizeof(uint32_t) * nbuckets);
+		memset(disp, 0, sizeof(uint32_t) * nbuckets);
+		for (i = 0; i < count; i++) {
+			bucket_of[i] = mp_dict_bucket(hashes[i], seed, nbuckets);
+			fill[bucket_of[i]]++;
 		}
-		else
-		{
-			printf("duplicate dict str=[%s]\n", str);
+		for (b = 0, i = 0; b < nbuckets; b++) {
+			first[b] = (uint32_t)i;
+			order[b].size = fill[b];
+			order[b].bucket = b;
+			i += fill[b];
+			fill[b] = 0;
 		}
-    }
-	return 0;
+		for (i = 0; i < count; i++)
+			keys[first[bucket_of[i]] + fill[bucket_of[i]]++] = (uint32_t)i;
+		/* two keys with the same hash share every slot, no seed or displacement helps */
+		for (b = 0; seed == 0 && b < nbuckets; b++) {
+			for (i = first[b]; i < first[b] + fill[b]; i++) {
+				for (j = first[b]; j < i; j++) {
+					if (hashes[keys[i]] == hashes[keys[j]]) {
+						lua_rawgeti(L, strings, (int)keys[j] + 1);
+						lua_rawgeti(L, strings, (int)keys[i] + 1);
+						luaL_error(L, "dict keys '%s' and '%s' have the same hash",
+							lua_tostring(L, -2), lua_tostring(L, -1));
+					}
+				}
+			}
+		}
+		qsort(order, nbuckets, sizeof(mp_dict_bucket_order), mp_dict_cmp_bucket);
+
+		for (tries = 0, nslots = count; tries < MP_DICT_SLOT_TRIES; tries++, nslots += count / 8 + 1) {
+			slots = (int32_t *)lua_newuserdata(L, sizeof(int32_t) * nslots);
+			memset(slots, 0xff, sizeof(int32_t) * nslots);
+			if (mp_dict_place(hashes, keys, first, order, nbuckets, disp, slots, nslots))
+				break;
+			lua_pop(L, 1);
+		}
+		if (tries < MP_DICT_SLOT_TRIES)
+			break;
+	}
+
+	d = (mp_dict *)lua_newuserdata(L, sizeof(mp_dict) + sizeof(mp_dict_entry) * count
+		+ sizeof(uint32_t) * nbuckets + sizeof(int32_t) * nslots);
+	d->count = 0; /* until the refs are set, for __gc */
+	d->strings_ref = d->misses_ref = LUA_NOREF;
+	if (luaL_newmetatable(L, MP_DICT_META)) {
+		lua_pushcfunction(L, mp_dict_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_newtable(L);
+		for (i = 0; mp_dict_methods[i].name; i++) {
+			lua_pushcfunction(L, mp_dict_methods[i].func);
+			lua_setfield(L, -2, mp_dict_methods[i].name);
+		}
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+
+	d->nbuckets = nbuckets;
+	d->nslots = nslots;
+	d->seed = seed;
+	d->entries = (mp_dict_entry *)(d + 1);
+	d->disp = (uint32_t *)(d->entries + count);
+	d->slots = (int32_t *)(d->disp + nbuckets);
+	memcpy(d->disp, disp, sizeof(uint32_t) * nbuckets);
+	memcpy(d->slots, slots, sizeof(int32_t) * nslots);
+	for (i = 0; i < count; i++) {
+		lua_rawgeti(L, strings, (int)i + 1);
+		d->entries[i].str = lua_tolstring(L, -1, &d->entries[i].len);
+		lua_pop(L, 1); /* the strings table keeps it */
+	}
+
+	lua_pushvalue(L, strings);
+	d->strings_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (record) {
+		lua_newtable(L);
+		d->misses_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	d->count = count;
+
+	lua_replace(L, strings);
+	lua_settop(L, strings);
+	return d;
+}
+
+static const struct mp_dict *mp_push_default_dict(lua_State *L) {
+	lua_pushlightuserdata(L, &mp_default_dict_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	return (const struct mp_dict *)lua_touserdata(L, -1);
 }
 
-int query_dict_id(const char * str, size_t strLen)
+/* pushes the dictionary at idx, or the one setdict registered for the version at idx */
+static const struct mp_dict *mp_push_dict(lua_State *L, int idx) {
+	if (lua_type(L, idx) == LUA_TUSERDATA) {
+		lua_pushvalue(L, idx);
+		return (const struct mp_dict *)luaL_checkudata(L, -1, MP_DICT_META);
+	}
+	lua_pushlightuserdata(L, &mp_dicts_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_istable(L, -1)) {
+		lua_pushvalue(L, idx);
+		lua_rawget(L, -2);
+		lua_remove(L, -2);
+		if (!lua_isnil(L, -1))
+			return (const struct mp_dict *)lua_touserdata(L, -1);
+	}
+	lua_pushvalue(L, idx);
+	luaL_error(L, "no msgpack dict for version %s", lua_tostring(L, -1) ? lua_tostring(L, -1) : luaL_typename(L, idx));
+	return NULL;
+}
+
+/* msgpack.init(list [, slots, record]): builds the dictionary used by pack and unpack, calling
+ * it again replaces it. slots is not used anymore, record keeps the strings packed without an
+ * id, see dict:misses() */
+int mp_init(lua_State *L)
 {
-	uint32_t hash, slotId;
-	struct TString * p;
-	
-	
-	if( 0 == s_msgpack_pHash)
-		return -1;
-	
-	
-	hash = CalcHash(str, strLen);
-	slotId = hash % s_msgpack_nSlotLen;
+	int record = (int)luaL_optinteger(L, 3, 0);
+	lua_settop(L, 1);
+	mp_dict_build(L, 1, record);
+	lua_pushlightuserdata(L, &mp_default_dict_tag);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	return 1;
+}
 
-	p = &s_msgpack_pHash[slotId];
+/* msgpack.newdict(list [, record]) */
+int mp_newdict(lua_State *L)
+{
+	int record = lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	mp_dict_build(L, 1, record);
+	return 1;
+}
 
-	while(p && p->str)
-	{
-		if(strLen == p->strLen && strcmp(str, p->str) == 0 )
-			return p->index;
-		
-		p = p->next;
+/* msgpack.setdict(version, dict or list or nil): the dictionary of a protocol version,
+ * replaces the previous one */
+int mp_setdict(lua_State *L)
+{
+	luaL_argcheck(L, !lua_isnoneornil(L, 1), 1, "version expected");
+	lua_settop(L, 2);
+	if (lua_istable(L, 2)) {
+		mp_dict_build(L, 2, 0);
+		lua_replace(L, 2);
+	} else if (!lua_isnil(L, 2)) {
+		luaL_checkudata(L, 2, MP_DICT_META);
 	}
-
-	/* record */
-	if(0 != s_msgpack_doRecord && strLen > 1)
-	{
-		printf("<query_dict_id> %s\n", str);
+	lua_pushlightuserdata(L, &mp_dicts_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, &mp_dicts_tag);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
 	}
-	
-	
-	return -1;
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return 1;
 }
 
-const char * query_dict_str(size_t dictId, size_t * len)
+/* msgpack.getdict([version]), the default dictionary without version */
+int mp_getdict(lua_State *L)
 {
-	if(dictId < 0 || dictId >= s_msgpack_arrId2StrLen)
-	{
-		return 0;
+	if (lua_isnoneornil(L, 1)) {
+		mp_push_default_dict(L);
+		return 1;
 	}
-	
-	assert(s_msgpack_arrId2Str[dictId]);
-	*len = s_msgpack_arrId2Str[dictId]->strLen;
-	return s_msgpack_arrId2Str[dictId]->str;
+	lua_pushlightuserdata(L, &mp_dicts_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1))
+		return 0;
+	lua_pushvalue(L, 1);
+	lua_rawget(L, -2);
+	return 1;
 }
 
-void push_dict_string(lua_State *L, struct mp_cur *c, size_t dictId)
+/* msgpack.pack_dict(dict or version, ...) */
+int mp_pack_dict(lua_State *L)
 {
-	size_t len = 0;
-	const char * str;
+	int nargs = lua_gettop(L);
+	const struct mp_dict *dict;
+
+	if (nargs < 2)
+		return luaL_argerror(L, 2, "MessagePack pack needs input.");
+	dict = mp_push_dict(L, 1);
+	lua_replace(L, 1);
+	return mp_pack_range(L, 2, nargs, dict);
+}
 
-	str = query_dict_str(dictId, &len);
-	/*printf("push_dict_string %d=%s\n", (int)dictId, str );*/
-	if(str)
-	{
-		lua_pushlstring(L, str, len);
-	}
-	else
-	{
-		c->err = MP_CUR_ERROR_BADDICT;
-		lua_pushlstring(L, "__bad_dict_id___", 16);
-	}
+/* msgpack.unpack_dict(dict or version, msg) */
+int mp_unpack_dict(lua_State *L)
+{
+	lua_settop(L, 2);
+	mp_push_dict(L, 1);
+	lua_replace(L, 1);
+	lua_insert(L, 1);
+	return mp_unpack_full_dict(L, 0, 0);
 }
 
 /*------------------------------------------------------------------------------------*/
@@ -495,6 +495,7 @@ static int addinstruction (CompileState *compst, Opcode op, int aux) {
   int i = nextinstruction(compst);
   getinstr(compst, i).i.code = op;
   getinstr(compst, i).i.aux = aux;
+  getinstr(compst, i).i.key = 0;  /* keep dumps deterministic */
   return i;
 }
 
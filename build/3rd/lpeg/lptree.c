@@ -5,6 +5,7 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stddef.h>
 #include <string.h>
 
 
@@ -363,6 +364,7 @@ static TTree *newtree (lua_State *L, int len) {
   lua_setuservalue(L, -3);
   lua_setmetatable(L, -2);
   p->code = NULL;  p->codesize = 0;
+  memset(p->tree, 0, len * sizeof(TTree));  /* unused fields are dumped */
   return p->tree;
 }
 
@@ -1177,6 +1179,356 @@ static int lp_match (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Dump and load
+** A dump holds a header, the tree, the compiled code and the
+** constants of the ktable. Trees and code only use relative
+** offsets, so they are copied as they are; the header rejects
+** dumps made by another LPeg version or with another layout, and
+** a checksum at the end rejects damaged ones.
+** Only strings, numbers and booleans can be dumped; patterns
+** with functions or tables (Cmt, 'p / f', 'p / t') cannot.
+** =======================================================
+*/
+
+#define DUMPMAGIC	"\x1bLPG"
+#define DUMPFORMAT	1
+#define DUMPCHECK	0x01020304
+
+typedef struct DumpHeader {
+  char magic[4];
+  char version[8];  /* LPeg version */
+  byte format;
+  byte treesize;  /* sizeof(TTree) */
+  byte instsize;  /* sizeof(Instruction) */
+  byte numsize;  /* sizeof(lua_Number) */
+  byte intsize;  /* sizeof(lua_Integer) */
+  int check;  /* endianness */
+  int ntree;  /* tree size (in elements) */
+  int ncode;  /* code size (in elements) */
+  int nk;  /* number of constants */
+} DumpHeader;
+
+
+static void dumpheader (DumpHeader *h) {
+  memset(h, 0, sizeof(DumpHeader));
+  memcpy(h->magic, DUMPMAGIC, 4);
+  strncpy(h->version, VERSION, sizeof(h->version));
+  h->format = DUMPFORMAT;
+  h->treesize = sizeof(TTree);
+  h->instsize = sizeof(Instruction);
+  h->numsize = sizeof(lua_Number);
+  h->intsize = sizeof(lua_Integer);
+  h->check = DUMPCHECK;
+}
+
+
+/*
+** FNV-1a over the whole dump, stored at its end
+*/
+static unsigned int dumpsum (unsigned int h, const char *s, size_t l) {
+  size_t i;
+  for (i = 0; i < l; i++)
+    h = (h ^ (byte)s[i]) * 16777619u;
+  return h;
+}
+
+#define SUMSEED		2166136261u
+
+
+typedef struct DumpState {
+  luaL_Buffer b;
+  unsigned int sum;
+} DumpState;
+
+
+static void dumpblock (DumpState *D, const void *s, size_t l) {
+  D->sum = dumpsum(D->sum, (const char *)s, l);
+  luaL_addlstring(&D->b, (const char *)s, l);
+}
+
+
+static void dumptag (DumpState *D, char tag) {
+  dumpblock(D, &tag, 1);
+}
+
+
+static void checkdumpable (lua_State *L, int kidx, int nk) {
+  int i;
+  for (i = 1; i <= nk; i++) {
+    lua_rawgeti(L, kidx, i);
+    switch (lua_type(L, -1)) {
+      case LUA_TSTRING: case LUA_TNUMBER: case LUA_TBOOLEAN: break;
+      default:
+        luaL_error(L, "cannot dump a pattern with a %s constant",
+                      luaL_typename(L, -1));
+    }
+    lua_pop(L, 1);
+  }
+}
+
+
+/*
+** Dump the constants of ktable 'kidx'. Values are popped before
+** being added, as the buffer may live on the top of the stack;
+** strings stay anchored in the ktable.
+*/
+static void dumpktable (lua_State *L, DumpState *D, int kidx, int nk) {
+  int i;
+  for (i = 1; i <= nk; i++) {
+    lua_rawgeti(L, kidx, i);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      size_t l;
+      const char *s = lua_tolstring(L, -1, &l);
+      int len = (int)l;
+      lua_pop(L, 1);
+      dumptag(D, 's');
+      dumpblock(D, &len, sizeof(len));
+      dumpblock(D, s, l);
+    }
+    else if (lua_type(L, -1) == LUA_TBOOLEAN) {
+      int v = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      dumptag(D, v ? 't' : 'f');
+    }
+#if LUA_VERSION_NUM >= 503
+    else if (lua_isinteger(L, -1)) {
+      lua_Integer ii = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      dumptag(D, 'i');
+      dumpblock(D, &ii, sizeof(ii));
+    }
+#endif
+    else {
+      lua_Number n = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+      dumptag(D, 'n');
+      dumpblock(D, &n, sizeof(n));
+    }
+  }
+}
+
+
+/*
+** Dump a pattern, compiling it first, so that loading it needs
+** neither 'finalfix' nor the compiler.
+*/
+static int lp_dump (lua_State *L) {
+  Pattern *p = getpattern(L, 1);
+  DumpHeader h;
+  DumpState D;
+  int kidx;
+  if (p->code == NULL)  /* not compiled yet? */
+    prepcompile(L, p, 1);
+  dumpheader(&h);
+  h.ntree = getsize(L, 1);
+  h.ncode = p->codesize;
+  lua_getuservalue(L, 1);
+  kidx = lua_gettop(L);
+  h.nk = ktablelen(L, kidx);
+  checkdumpable(L, kidx, h.nk);  /* fail before filling the buffer */
+  D.sum = SUMSEED;
+  luaL_buffinit(L, &D.b);
+  dumpblock(&D, &h, sizeof(h));
+  dumpblock(&D, p->tree, h.ntree * sizeof(TTree));
+  dumpblock(&D, p->code, h.ncode * sizeof(Instruction));
+  dumpktable(L, &D, kidx, h.nk);
+  luaL_addlstring(&D.b, (const char *)&D.sum, sizeof(D.sum));
+  luaL_pushresult(&D.b);
+  return 1;
+}
+
+
+typedef struct LoadState {
+  lua_State *L;
+  const char *s;
+  size_t left;
+} LoadState;
+
+
+static const char *loadarray (LoadState *S, size_t n, size_t size) {
+  const char *b = S->s;
+  if (n > S->left / size)
+    luaL_error(S->L, "truncated pattern dump");
+  S->s += n * size;
+  S->left -= n * size;
+  return b;
+}
+
+
+static int loadint (LoadState *S) {
+  int n;
+  memcpy(&n, loadarray(S, 1, sizeof(n)), sizeof(n));
+  return n;
+}
+
+
+/*
+** Push the constants of a dump into a new ktable
+*/
+static void loadktable (LoadState *S, int nk) {
+  lua_State *L = S->L;
+  int i;
+  lua_createtable(L, nk, 0);
+  for (i = 1; i <= nk; i++) {
+    switch (*loadarray(S, 1, 1)) {
+      case 's': {
+        int l = loadint(S);
+        if (l < 0)
+          luaL_error(L, "corrupted pattern dump");
+        lua_pushlstring(L, loadarray(S, l, 1), l);
+        break;
+      }
+      case 'n': {
+        lua_Number n;
+        memcpy(&n, loadarray(S, 1, sizeof(n)), sizeof(n));
+        lua_pushnumber(L, n);
+        break;
+      }
+      case 'i': {
+        lua_Integer ii;
+        memcpy(&ii, loadarray(S, 1, sizeof(ii)), sizeof(ii));
+        lua_pushinteger(L, ii);
+        break;
+      }
+      case 't': lua_pushboolean(L, 1); break;
+      case 'f': lua_pushboolean(L, 0); break;
+      default: luaL_error(L, "corrupted pattern dump");
+    }
+    lua_rawseti(L, -2, i);
+  }
+}
+
+
+/*
+** Structural checks on a loaded tree: tags, keys and children must be
+** in range. Children always follow their parent (only calls may point
+** back, and they are not followed), so the walk ends.
+*/
+static int checktree (TTree *tree, TTree *t, int ntree, int nk) {
+ tailcall:
+  {
+    int i = t - tree;
+    if (t->tag > TRunTime)
+      return 0;
+    if (t->tag == TCapture && (t->cap == Cclose || t->cap > Cgroup ||
+                               t->cap == Cruntime))
+      return 0;
+    if (t->key > nk && !(t->tag == TCapture &&
+                         (t->cap == Carg || t->cap == Cnum)))
+      return 0;  /* 'key' is a number for these two */
+    if (t->tag == TSet && i + 1 + (int)bytes2slots(CHARSETSIZE) > ntree)
+      return 0;
+    if (t->tag == TCall) {
+      if (t->u.ps == 0 || i + t->u.ps < 0 || i + t->u.ps >= ntree ||
+          sib2(t)->tag != TRule)
+        return 0;
+      return 1;
+    }
+    if (t->tag == TOpenCall)
+      return 0;  /* dumps are made after 'finalfix' */
+    switch (numsiblings[t->tag]) {
+      case 1:
+        if (i + 1 >= ntree) return 0;
+        t = sib1(t); goto tailcall;
+      case 2:
+        if (i + 1 >= ntree || t->u.ps <= 1 || t->u.ps >= ntree - i ||
+            !checktree(tree, sib1(t), ntree, nk))
+          return 0;
+        t = sib2(t); goto tailcall;
+      default: return 1;
+    }
+  }
+}
+
+
+/*
+** Structural checks on loaded code: opcodes and capture keys must be
+** in range, jumps must land on instructions and the code must end
+** with IEnd. Like Lua bytecode, dumps should come from trusted sources;
+** these checks catch corruption, they do not make hostile code safe.
+*/
+static int checkcode (lua_State *L, Instruction *code, int ncode, int nk) {
+  byte *start = (byte *)lua_newuserdata(L, ncode);
+  int i, last = 0;
+  memset(start, 0, ncode);
+  for (i = 0; i < ncode; i += sizei(&code[i])) {
+    Opcode op = (Opcode)code[i].i.code;
+    if (op > ICloseRunTime || op == IOpenCall || i + sizei(&code[i]) > ncode)
+      return 0;
+    if (op == IFullCapture || op == IOpenCapture) {
+      int kind = getkind(&code[i]);
+      if (kind == Cclose || kind > Cgroup || kind == Cruntime)
+        return 0;
+      if ((code[i].i.key < 0 || code[i].i.key > nk) &&
+          kind != Carg && kind != Cnum)
+        return 0;
+    }
+    start[i] = 1;
+    last = i;
+  }
+  if ((Opcode)code[last].i.code != IEnd)
+    return 0;
+  for (i = 0; i < ncode; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case ITestAny: case ITestChar: case ITestSet: case IChoice: case IJmp:
+      case ICall: case ICommit: case IPartialCommit: case IBackCommit: {
+        int target = i + code[i + 1].offset;
+        if (target < 0 || target >= ncode || !start[target])
+          return 0;
+        break;
+      }
+      default: break;
+    }
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+static int lp_load (lua_State *L) {
+  LoadState S;
+  DumpHeader h, ref;
+  Pattern *p;
+  unsigned int sum;
+  S.L = L;
+  S.s = luaL_checklstring(L, 1, &S.left);
+  lua_settop(L, 1);
+  memcpy(&h, loadarray(&S, 1, sizeof(h)), sizeof(h));
+  dumpheader(&ref);
+  if (memcmp(h.magic, ref.magic, sizeof(h.magic)) != 0)
+    return luaL_error(L, "not a pattern dump");
+  if (memcmp(&h, &ref, offsetof(DumpHeader, ntree)) != 0)
+    return luaL_error(L, "pattern dump made by another LPeg version or platform");
+  if (S.left < sizeof(sum))
+    return luaL_error(L, "truncated pattern dump");
+  S.left -= sizeof(sum);  /* checksum is not part of the body */
+  memcpy(&sum, S.s + S.left, sizeof(sum));
+  if (sum != dumpsum(SUMSEED, S.s - sizeof(h), S.left + sizeof(h)))
+    return luaL_error(L, "corrupted pattern dump");
+  if (h.ntree <= 0 || h.ncode <= 0 || h.nk < 0 || h.nk > USHRT_MAX)
+    return luaL_error(L, "corrupted pattern dump");
+  newtree(L, h.ntree);
+  p = (Pattern *)lua_touserdata(L, -1);
+  memcpy(p->tree, loadarray(&S, h.ntree, sizeof(TTree)),
+         h.ntree * sizeof(TTree));
+  realloccode(L, p, h.ncode);  /* freed by 'lp_gc' if anything fails */
+  memcpy(p->code, loadarray(&S, h.ncode, sizeof(Instruction)),
+         h.ncode * sizeof(Instruction));
+  if (h.nk > 0) {
+    loadktable(&S, h.nk);
+    lua_setuservalue(L, -2);
+  }
+  if (S.left != 0 || !checktree(p->tree, p->tree, h.ntree, h.nk) ||
+      !checkcode(L, p->code, h.ncode, h.nk))
+    return luaL_error(L, "corrupted pattern dump");
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Library creation and functions not related to matching
@@ -1273,6 +1625,8 @@ static struct luaL_Reg pattreg[] = {
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
   {"type", lp_type},
+  {"dump", lp_dump},
+  {"load", lp_load},
   {NULL, NULL}
 };
 
@@ -0,0 +1,254 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xlua_hash.h"
+#include "xlua_thread.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define cache_getpid() _getpid()
+#else
+#include <unistd.h>
+#define cache_getpid() getpid()
+#endif
+
+/*
+** on-disk bytecode cache for xluaL_loadbuffer
+**
+** entries live in <dir>/<key>.luac, the key is the xxhash64 of the source (seeded with the
+** chunk name unless debug info is stripped, it is part of the bytecode then), its length, the
+** lua version and LUAC_COMPATIBLE_FORMAT. every entry starts with a header that repeats the key
+** and carries a hash of the bytecode, so truncated, foreign or hand edited files are rejected
+** and recompiled instead of reaching the undumper. entries are written to a temp file and
+** renamed into place, concurrent writers of the same key race harmlessly. states on several
+** threads may share the cache, the temp file sequence and the stats are atomic and every load
+** works on a copy of the settings taken under cache_lock.
+**
+** the entry hash only catches accidents, whoever can write the directory can replace the
+** bytecode. chunks that must run exactly the bytes that were checked (SignatureLoader) are
+** loaded with xluaL_loadbuffer_nocache.
+*/
+
+#define CACHE_MAGIC "XLBC"
+#define CACHE_FORMAT 1
+#define CACHE_DIR_SIZE 960
+#define CACHE_PATH_SIZE (CACHE_DIR_SIZE + 64) //"/<32 hex>_<8 hex>_<8 hex>.luac"
+
+#if USING_LUAJIT
+#define CACHE_VM_TAG 0x4A00 //luajit bytecode is not compatible with lua 5.1
+#else
+#define CACHE_VM_TAG 0
+#endif
+
+#if LUAC_COMPATIBLE_FORMAT
+#define CACHE_COMPATIBLE 1
+#else
+#define CACHE_COMPATIBLE 0
+#endif
+
+typedef struct {
+	char magic[4];
+	uint32_t format;
+	uint32_t version;    //LUA_VERSION_NUM | CACHE_VM_TAG
+	uint32_t flags;      //bit0: LUAC_COMPATIBLE_FORMAT, bit1: stripped, bit2: 64 bit size_t
+	uint64_t source_hash;
+	uint64_t source_size;
+	uint64_t code_hash;
+	uint64_t code_size;
+} CacheHeader;
+
+typedef struct {
+	char *buff;
+	size_t size;
+	size_t capacity;
+} CacheWriter;
+
+typedef struct {
+	int enabled;
+	int strip;
+	char dir[CACHE_DIR_SIZE];
+} CacheConfig;
+
+static CacheConfig cache_config;
+static xmutex_t cache_lock;
+static xonce_t cache_lock_once = XONCE_INIT;
+static volatile long cache_tmp_seq = 0;
+static volatile long cache_hits = 0;
+static volatile long cache_misses = 0;
+
+static void cache_lock_init(void) {
+	xmutex_init(&cache_lock);
+}
+
+//dir: cache directory, must exist, NULL or "" turns the cache off
+//strip: drop debug info from cached bytecode, error messages then lose line numbers
+LUA_API int xlua_set_bytecode_cache(const char *dir, int strip) {
+	size_t len = dir == NULL ? 0 : strlen(dir);
+	if (len >= CACHE_DIR_SIZE) {
+		return 0;
+	}
+	xonce(&cache_lock_once, cache_lock_init);
+	xmutex_lock(&cache_lock);
+	if (len == 0) {
+		cache_config.enabled = 0;
+	} else {
+		memcpy(cache_config.dir, dir, len + 1);
+		if (cache_config.dir[len - 1] == '/' || cache_config.dir[len - 1] == '\\') {
+			cache_config.dir[len - 1] = '\0';
+		}
+#if LUA_VERSION_NUM >= 503
+		cache_config.strip = strip;
+#else
+		cache_config.strip = 0; //lua_dump always keeps debug info here
+#endif
+		cache_config.enabled = 1;
+	}
+	xmutex_unlock(&cache_lock);
+	return 1;
+}
+
+LUA_API void xlua_bytecode_cache_stats(int *hits, int *misses) {
+	*hits = (int)cache_hits;
+	*misses = (int)cache_misses;
+}
+
+static void cache_make_header(CacheHeader *h, int strip, const char *buff, size_t size, const char *name) {
+	memset(h, 0, sizeof(CacheHeader));
+	memcpy(h->magic, CACHE_MAGIC, 4);
+	h->format = CACHE_FORMAT;
+	h->version = LUA_VERSION_NUM | CACHE_VM_TAG;
+	h->flags = CACHE_COMPATIBLE | (strip ? 2 : 0) | (sizeof(size_t) == 8 ? 4 : 0);
+	h->source_hash = xxh64(buff, size, strip || name == NULL ? 0 : xxh64(name, strlen(name), 0));
+	h->source_size = size;
+}
+
+static void cache_make_path(char *path, const char *dir, const CacheHeader *h) {
+	snprintf(path, CACHE_PATH_SIZE, "%s/%016llx%08x_%x_%x.luac", dir, (unsigned long long)h->source_hash,
+		(unsigned int)h->source_size, (unsigned int)h->version, (unsigned int)h->flags);
+}
+
+//1 and the chunk on the stack on a hit, 0 otherwise
+static int cache_read(lua_State *L, const char *path, const CacheHeader *expect, const char *name) {
+	CacheHeader h;
+	char *code;
+	int ok;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return 0;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(&h, expect, offsetof(CacheHeader, code_hash)) != 0
+		|| h.code_size == 0 || h.code_size > (uint64_t)64 * 1024 * 1024) {
+		fclose(f);
+		remove(path);
+		return 0;
+	}
+	code = (char *)malloc((size_t)h.code_size);
+	ok = code != NULL && fread(code, 1, (size_t)h.code_size, f) == (size_t)h.code_size && fgetc(f) == EOF
+		&& xxh64(code, (size_t)h.code_size, 0) == h.code_hash;
+	fclose(f);
+	if (ok) {
+		ok = luaL_loadbuffer(L, code, (size_t)h.code_size, name) == 0;
+		if (!ok) {
+			lua_pop(L, 1);
+		}
+	}
+	free(code);
+	if (!ok) {
+		remove(path);
+	}
+	return ok;
+}
+
+static int cache_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	CacheWriter *w = (CacheWriter *)ud;
+	if (w->size + sz > w->capacity) {
+		size_t capacity = w->capacity == 0 ? 4096 : w->capacity;
+		char *buff;
+		while (capacity < w->size + sz) {
+			capacity *= 2;
+		}
+		buff = (char *)realloc(w->buff, capacity);
+		if (buff == NULL) {
+			return 1;
+		}
+		w->buff = buff;
+		w->capacity = capacity;
+	}
+	memcpy(w->buff + w->size, p, sz);
+	w->size += sz;
+	return 0;
+}
+
+//the compiled function is at the top of the stack, failures only cost the cache entry
+static void cache_write(lua_State *L, const char *path, CacheHeader *h, int strip) {
+	CacheWriter w = {NULL, 0, 0};
+	char tmp[CACHE_PATH_SIZE + 48]; //".<pid>-<seq>.tmp"
+	FILE *f;
+	int ok;
+#if LUA_VERSION_NUM >= 503
+	ok = lua_dump(L, cache_writer, &w, strip) == 0;
+#else
+	ok = lua_dump(L, cache_writer, &w) == 0;
+#endif
+	if (ok && w.size > 0) {
+		h->code_hash = xxh64(w.buff, w.size, 0);
+		h->code_size = w.size;
+		snprintf(tmp, sizeof(tmp), "%s.%d-%lu.tmp", path, (int)cache_getpid(), (unsigned long)xatomic_inc(&cache_tmp_seq));
+		f = fopen(tmp, "wb");
+		if (f != NULL) {
+			ok = fwrite(h, sizeof(CacheHeader), 1, f) == 1 && fwrite(w.buff, 1, w.size, f) == w.size;
+			ok = fclose(f) == 0 && ok;
+			if (ok && rename(tmp, path) != 0) {
+				//windows does not replace, another writer got there first with the same content
+				ok = 0;
+			}
+			if (!ok) {
+				remove(tmp);
+			}
+		}
+	}
+	free(w.buff);
+}
+
+//-1 if the cache is off or does not apply, otherwise the luaL_loadbuffer result
+int xlua_bytecode_cache_load(lua_State *L, const char *buff, size_t size, const char *name) {
+	CacheConfig config;
+	CacheHeader h;
+	char path[CACHE_PATH_SIZE];
+	int status;
+	if (size == 0 || buff[0] == LUA_SIGNATURE[0]) {
+		return -1;
+	}
+	xonce(&cache_lock_once, cache_lock_init);
+	xmutex_lock(&cache_lock);
+	config = cache_config;
+	xmutex_unlock(&cache_lock);
+	if (!config.enabled) {
+		return -1;
+	}
+	cache_make_header(&h, config.strip, buff, size, name);
+	cache_make_path(path, config.dir, &h);
+	if (cache_read(L, path, &h, name)) {
+		xatomic_inc(&cache_hits);
+		return 0;
+	}
+	xatomic_inc(&cache_misses);
+	status = luaL_loadbuffer(L, buff, size, name);
+	if (status == 0) {
+		cache_write(L, path, &h, config.strip);
+	}
+	return status;
+}
@@ -0,0 +1,582 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <string.h>
+#include <stdint.h>
+
+/*
+** deferred command buffer. xlua.defer(f, ...) and xlua.defer_set(obj, key, value) record a call
+** instead of making it, the records are replayed in order by xlua_cmdbuf_flush (or xlua.flush)
+** at a sync point chosen by the game, typically once per frame.
+**
+** a record is [CommandHeader][CommandArg * nargs][string bytes][padding to 8 bytes]. nil,
+** booleans, numbers, strings and light userdata are copied into the record, any other value
+** (c# objects, tables, functions) is anchored in a per state table and referenced by slot,
+** c# structs are copied at record time so a later change to the struct is not seen. the
+** receiver is not copied, so the setter or method replayed on it still changes the struct the
+** caller holds: the object of defer_set, and the first argument when f is a c# function.
+**
+** c# functions marked with xlua_cmdbuf_mark are replayed by c# itself: the managed replay
+** function runs once per flush and asks xlua_cmdbuf_next for the records, so a batch of
+** deferred setters costs one transition into c# instead of one per call. everything else is
+** called from here.
+*/
+
+#define CMD_WRAPPER  1 //marked c# wrapper (GEN_CODE_MINIMIZE), callee is the wrapper id
+#define CMD_FUNCTION 2 //marked c# function, fn is its c function pointer
+#define CMD_CALL     3 //anything else, callee is the anchor slot of the function
+
+#define ARG_NIL      0
+#define ARG_BOOLEAN  1
+#define ARG_INTEGER  2
+#define ARG_NUMBER   3
+#define ARG_STRING   4
+#define ARG_LIGHTUD  5
+#define ARG_ANCHOR   6
+
+#define CMDBUF_MAX_ARGS 250
+
+typedef struct {
+	uint32_t size; //whole record, args, strings and padding included
+	uint16_t kind;
+	uint16_t nargs;
+	int32_t callee;
+	int32_t reserved;
+	void *fn;
+} CommandHeader;
+
+typedef struct {
+	int32_t tag;
+	uint32_t len; //string length
+	union {
+		int64_t i;
+		double d;
+		void *p;
+	} u;
+} CommandArg;
+
+typedef struct {
+	char *buf;
+	size_t head; //next record to replay
+	size_t tail; //end of the recorded data
+	size_t cap;
+	size_t end; //end of the records the running flush replays
+	int anchors; //anchor slots used since the buffer was last empty
+	int flushing;
+} CommandBuffer;
+
+//same layout as in xlua.c
+typedef struct {
+	int fake_id;
+	unsigned int len;
+	char data[1];
+} CmdStruct;
+
+extern int obj_newindexer(lua_State *L);
+extern int cls_newindexer(lua_State *L);
+extern int xlua_csharp_callee(lua_State *L, int idx, int *wrapperid, lua_CFunction *fn);
+extern void xlua_push_csharp_function(lua_State* L, lua_CFunction fn, int n);
+extern void xlua_push_csharp_wrapper(lua_State* L, int wrapperid);
+
+static int cmdbuf_tag = 0;
+static int cmdbuf_anchor_tag = 0;
+static int cmdbuf_mark_tag = 0;
+static int cmdbuf_replay_tag = 0;
+
+#if LUA_VERSION_NUM == 501
+#define cmdbuf_rawlen(L, i) lua_objlen(L, i)
+#else
+#define cmdbuf_rawlen(L, i) lua_rawlen(L, i)
+#endif
+
+static int cmdbuf_gc(lua_State *L) {
+	CommandBuffer *cb = (CommandBuffer *)lua_touserdata(L, 1);
+	void *ud;
+	lua_Alloc allocf = lua_getallocf(L, &ud);
+	if (cb->buf != NULL) {
+		allocf(ud, cb->buf, cb->cap, 0);
+		cb->buf = NULL;
+	}
+	return 0;
+}
+
+static CommandBuffer *cmdbuf_get(lua_State *L) {
+	CommandBuffer *cb;
+	lua_pushlightuserdata(L, &cmdbuf_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	cb = (CommandBuffer *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (cb == NULL) {
+		cb = (CommandBuffer *)lua_newuserdata(L, sizeof(CommandBuffer));
+		memset(cb, 0, sizeof(CommandBuffer));
+		lua_newtable(L);
+		lua_pushcfunction(L, cmdbuf_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_pushlightuserdata(L, &cmdbuf_tag);
+		lua_insert(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	return cb;
+}
+
+//pushes the table behind tag, created on first use
+static void cmdbuf_pushtable(lua_State *L, void *tag) {
+	lua_pushlightuserdata(L, tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, tag);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+}
+
+static char *cmdbuf_reserve(lua_State *L, CommandBuffer *cb, size_t size) {
+	if (cb->cap - cb->tail < size) {
+		void *ud;
+		lua_Alloc allocf = lua_getallocf(L, &ud);
+		size_t live = cb->tail - cb->head;
+		if (cb->head > 0 && cb->cap - live >= size && !cb->flushing) {
+			memmove(cb->buf, cb->buf + cb->head, live); //compact instead of growing
+		} else {
+			size_t cap = cb->cap == 0 ? 1024 : cb->cap;
+			char *buf;
+			while (cap - cb->tail < size) {
+				cap *= 2;
+			}
+			buf = (char *)allocf(ud, cb->buf, cb->cap, cap);
+			if (buf == NULL) {
+				luaL_error(L, "not enough memory for the command buffer");
+			}
+			cb->buf = buf;
+			cb->cap = cap;
+			return cb->buf + cb->tail;
+		}
+		cb->tail = live;
+		cb->head = 0;
+	}
+	return cb->buf + cb->tail;
+}
+
+//anchors the value at idx, returns its slot. byvalue copies a c# struct
+static int cmdbuf_anchor(lua_State *L, CommandBuffer *cb, int idx, int byvalue) {
+	CmdStruct *css = (CmdStruct *)lua_touserdata(L, idx);
+	cmdbuf_pushtable(L, &cmdbuf_anchor_tag);
+	if (byvalue && css != NULL && lua_type(L, idx) == LUA_TUSERDATA && cmdbuf_rawlen(L, idx) >= sizeof(int) + sizeof(unsigned int)
+		&& css->fake_id == -1 && cmdbuf_rawlen(L, idx) == css->len + sizeof(int) + sizeof(unsigned int)) {
+		//c# struct, keep the value it has now
+		size_t size = cmdbuf_rawlen(L, idx);
+		void *copy = lua_newuserdata(L, size);
+		memcpy(copy, css, size);
+		if (lua_getmetatable(L, idx)) {
+			lua_setmetatable(L, -2);
+		}
+	} else {
+		lua_pushvalue(L, idx);
+	}
+	lua_rawseti(L, -2, ++cb->anchors);
+	lua_pop(L, 1);
+	return cb->anchors;
+}
+
+static int cmdbuf_marked(lua_State *L, int wrapperid, lua_CFunction fn) {
+	int marked;
+	cmdbuf_pushtable(L, &cmdbuf_mark_tag);
+	if (fn != NULL) {
+		lua_pushlightuserdata(L, (void *)fn);
+	} else {
+		lua_pushinteger(L, wrapperid);
+	}
+	lua_rawget(L, -2);
+	marked = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	return marked;
+}
+
+//records a call of the function at func with the nargs values after it, receiver tells that
+//the first one is the object the call works on
+static void cmdbuf_record(lua_State *L, int func, int nargs, int receiver) {
+	CommandBuffer *cb = cmdbuf_get(L);
+	CommandHeader h;
+	CommandArg args[CMDBUF_MAX_ARGS];
+	size_t strlens = 0, size;
+	int i, kind, wrapperid = 0;
+	lua_CFunction fn = NULL;
+	char *p;
+
+	memset(&h, 0, sizeof(h));
+	kind = xlua_csharp_callee(L, func, &wrapperid, &fn);
+	switch (kind) {
+	case CMD_WRAPPER:
+		if (cmdbuf_marked(L, wrapperid, NULL)) {
+			h.kind = CMD_WRAPPER;
+			h.callee = wrapperid;
+		}
+		break;
+	case CMD_FUNCTION:
+		if (cmdbuf_marked(L, 0, fn)) {
+			h.kind = CMD_FUNCTION;
+			h.fn = (void *)fn;
+		}
+		break;
+	}
+	if (h.kind == 0) {
+		h.kind = CMD_CALL;
+		h.callee = cmdbuf_anchor(L, cb, func, 0);
+	}
+	if (receiver < 0) {
+		receiver = kind != 0;
+	}
+	h.nargs = (uint16_t)nargs;
+
+	for (i = 0; i < nargs; i++) {
+		int idx = func + 1 + i;
+		CommandArg *a = &args[i];
+		a->len = 0;
+		a->u.i = 0;
+		switch (lua_type(L, idx)) {
+		case LUA_TNIL:
+			a->tag = ARG_NIL;
+			break;
+		case LUA_TBOOLEAN:
+			a->tag = ARG_BOOLEAN;
+			a->u.i = lua_toboolean(L, idx);
+			break;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, idx)) {
+				a->tag = ARG_INTEGER;
+				a->u.i = lua_tointeger(L, idx);
+				break;
+			}
+#endif
+			a->tag = ARG_NUMBER;
+			a->u.d = lua_tonumber(L, idx);
+			break;
+		case LUA_TSTRING: {
+			size_t len;
+			lua_tolstring(L, idx, &len);
+			if (len > UINT32_MAX) {
+				luaL_error(L, "string argument too long for the command buffer");
+			}
+			a->tag = ARG_STRING;
+			a->len = (uint32_t)len;
+			strlens += len;
+			break;
+		}
+		case LUA_TLIGHTUSERDATA:
+			a->tag = ARG_LIGHTUD;
+			a->u.p = lua_touserdata(L, idx);
+			break;
+		default:
+			a->tag = ARG_ANCHOR;
+			a->u.i = cmdbuf_anchor(L, cb, idx, i > 0 || !receiver);
+			break;
+		}
+	}
+
+	size = (sizeof(CommandHeader) + sizeof(CommandArg) * nargs + strlens + 7) & ~(size_t)7;
+	if (size > UINT32_MAX) {
+		luaL_error(L, "command too large");
+	}
+	h.size = (uint32_t)size;
+	p = cmdbuf_reserve(L, cb, size);
+	memcpy(p, &h, sizeof(h));
+	if (nargs > 0) {
+		memcpy(p + sizeof(h), args, sizeof(CommandArg) * nargs);
+	}
+	p += sizeof(h) + sizeof(CommandArg) * nargs;
+	for (i = 0; i < nargs; i++) {
+		if (args[i].tag == ARG_STRING && args[i].len > 0) {
+			memcpy(p, lua_tostring(L, func + 1 + i), args[i].len);
+			p += args[i].len;
+		}
+	}
+	memset(p, 0, cb->buf + cb->tail + size - p);
+	cb->tail += size;
+}
+
+//xlua.defer(f, ...)
+static int cmdbuf_defer(lua_State *L) {
+	int nargs = lua_gettop(L) - 1;
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_argcheck(L, nargs <= CMDBUF_MAX_ARGS, CMDBUF_MAX_ARGS + 2, "too many arguments to defer");
+	cmdbuf_record(L, 1, nargs, -1);
+	return 0;
+}
+
+//the fallback of defer_set, a plain obj[key] = value
+static int cmdbuf_assign(lua_State *L) {
+	lua_settop(L, 3);
+	lua_settable(L, 1);
+	return 0;
+}
+
+//xlua.defer_set(obj, key, value), records the c# setter itself when the class has one
+static int cmdbuf_defer_set(lua_State *L) {
+	lua_settop(L, 3);
+	if (lua_getmetatable(L, 1)) {
+		lua_CFunction newindexer;
+		lua_pushliteral(L, "__newindex");
+		lua_rawget(L, -2);
+		newindexer = lua_tocfunction(L, -1);
+		if ((newindexer == obj_newindexer || newindexer == cls_newindexer) && lua_getupvalue(L, -1, 1) != NULL) {
+			if (lua_istable(L, -1)) {
+				lua_pushvalue(L, 2);
+				lua_gettable(L, -2);
+				if (lua_isfunction(L, -1)) {
+					if (newindexer == cls_newindexer) { //static setter(value)
+						lua_pushvalue(L, 3);
+						cmdbuf_record(L, lua_gettop(L) - 1, 1, 0);
+					} else { //setter(obj, value)
+						lua_pushvalue(L, 1);
+						lua_pushvalue(L, 3);
+						cmdbuf_record(L, lua_gettop(L) - 2, 2, 1);
+					}
+					return 0;
+				}
+			}
+		}
+		lua_settop(L, 3);
+	}
+	lua_pushcfunction(L, cmdbuf_assign);
+	lua_insert(L, 1);
+	cmdbuf_record(L, 1, 3, 1);
+	return 0;
+}
+
+static void cmdbuf_reset_if_empty(lua_State *L, CommandBuffer *cb) {
+	if (cb->head == cb->tail) {
+		cb->head = cb->tail = 0;
+		if (cb->anchors > 0) {
+			cb->anchors = 0;
+			lua_pushlightuserdata(L, &cmdbuf_anchor_tag);
+			lua_newtable(L);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+	}
+}
+
+//pushes anchored value slot and releases it
+static void cmdbuf_push_anchor(lua_State *L, int slot) {
+	cmdbuf_pushtable(L, &cmdbuf_anchor_tag);
+	lua_rawgeti(L, -1, slot);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, slot);
+	lua_remove(L, -2);
+}
+
+/*
+** pushes the arguments of the record at offset at. a push can run a __gc that defers more
+** and moves cb->buf, so the record is looked up again from its offset for every argument.
+*/
+static void cmdbuf_push_args(lua_State *L, CommandBuffer *cb, size_t at) {
+	int nargs = ((const CommandHeader *)(cb->buf + at))->nargs;
+	size_t s = at + sizeof(CommandHeader) + sizeof(CommandArg) * nargs;
+	int i;
+	luaL_checkstack(L, nargs + 2, "too many deferred arguments");
+	for (i = 0; i < nargs; i++) {
+		CommandArg a = ((const CommandArg *)(cb->buf + at + sizeof(CommandHeader)))[i];
+		switch (a.tag) {
+		case ARG_BOOLEAN:
+			lua_pushboolean(L, (int)a.u.i);
+			break;
+		case ARG_INTEGER:
+			lua_pushinteger(L, (lua_Integer)a.u.i);
+			break;
+		case ARG_NUMBER:
+			lua_pushnumber(L, (lua_Number)a.u.d);
+			break;
+		case ARG_STRING:
+			lua_pushlstring(L, cb->buf + s, a.len);
+			s += a.len;
+			break;
+		case ARG_LIGHTUD:
+			lua_pushlightuserdata(L, a.u.p);
+			break;
+		case ARG_ANCHOR:
+			cmdbuf_push_anchor(L, (int)a.u.i);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+		}
+	}
+}
+
+//pushes the function of a record that is called from here
+static void cmdbuf_push_callee(lua_State *L, const CommandHeader *h) {
+	switch (h->kind) {
+	case CMD_WRAPPER:
+		xlua_push_csharp_wrapper(L, h->callee);
+		break;
+	case CMD_FUNCTION:
+		xlua_push_csharp_function(L, (lua_CFunction)h->fn, 0);
+		break;
+	default:
+		cmdbuf_push_anchor(L, h->callee);
+		break;
+	}
+}
+
+/*
+** replays the records before end. when handoff is set a marked record is not called but
+** returned with its arguments at 1..nargs for the caller to run, the result is then its kind
+** and *wrapperid or *fn tell which function it is. 0 once every record has run. when
+** protect is set the other records run in lua_pcall and an error makes the result -1 with
+** the message on the top, the records after the failing one stay queued.
+*/
+static int cmdbuf_replay(lua_State *L, CommandBuffer *cb, int handoff, int protect, int *wrapperid, void **fn) {
+	while (cb->head < cb->end) {
+		const CommandHeader *h = (const CommandHeader *)(cb->buf + cb->head);
+		CommandHeader hc = *h;
+		size_t at = cb->head;
+		lua_settop(L, 0);
+		cb->head += hc.size;
+		if (handoff && hc.kind != CMD_CALL) {
+			cmdbuf_push_args(L, cb, at);
+			*wrapperid = hc.callee;
+			*fn = hc.fn;
+			return hc.kind;
+		}
+		cmdbuf_push_callee(L, &hc);
+		cmdbuf_push_args(L, cb, at);
+		if (protect) {
+			if (lua_pcall(L, hc.nargs, 0, 0) != 0) {
+				return -1;
+			}
+		} else {
+			lua_call(L, hc.nargs, 0);
+		}
+		//a replayed command may defer more, they wait for the next flush
+	}
+	lua_settop(L, 0);
+	return 0;
+}
+
+/*
+** called by the managed replay function for each record, see the header comment. it runs
+** inside the closure of that function, so an error raised by the last c# wrapper (the error
+** flag upvalue of the closure is set) is reported as -1 without going any further.
+*/
+LUA_API int xlua_cmdbuf_next(lua_State *L, int *wrapperid, void **fn) {
+	CommandBuffer *cb = cmdbuf_get(L);
+	int ret;
+	if (lua_toboolean(L, lua_upvalueindex(2))) {
+		return -1;
+	}
+	ret = cmdbuf_replay(L, cb, 1, 1, wrapperid, fn);
+	if (ret == -1) {
+		lua_pushboolean(L, 1);
+		lua_replace(L, lua_upvalueindex(2));
+	}
+	return ret;
+}
+
+//native replay, used when no managed replay function is set
+static int cmdbuf_run(lua_State *L) {
+	cmdbuf_replay(L, cmdbuf_get(L), 0, 0, NULL, NULL);
+	return 0;
+}
+
+//pops a c# function, flushes run it instead of replaying the marked records here
+LUA_API void xlua_cmdbuf_set_replay(lua_State *L) {
+	lua_pushlightuserdata(L, &cmdbuf_replay_tag);
+	lua_insert(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/*
+** runs every command recorded so far, in the order they were recorded. returns 0, or the
+** lua_pcall error code with the message on the top, the commands after the failing one are
+** kept for the next flush.
+*/
+LUA_API int xlua_cmdbuf_flush(lua_State *L) {
+	CommandBuffer *cb = cmdbuf_get(L);
+	int status;
+	if (cb->flushing || cb->head == cb->tail) {
+		return 0;
+	}
+	cb->flushing = 1;
+	cb->end = cb->tail;
+	lua_pushlightuserdata(L, &cmdbuf_replay_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushcfunction(L, cmdbuf_run);
+	}
+	status = lua_pcall(L, 0, 0, 0);
+	cb->flushing = 0;
+	cmdbuf_reset_if_empty(L, cb);
+	return status;
+}
+
+//number of bytes waiting in the buffer
+LUA_API int xlua_cmdbuf_pending(lua_State *L) {
+	CommandBuffer *cb = cmdbuf_get(L);
+	return (int)(cb->tail - cb->head);
+}
+
+//drops every recorded command without running it
+LUA_API void xlua_cmdbuf_clear(lua_State *L) {
+	CommandBuffer *cb = cmdbuf_get(L);
+	if (!cb->flushing) {
+		cb->head = cb->tail;
+		cmdbuf_reset_if_empty(L, cb);
+	}
+}
+
+/*
+** marks the c# function at idx as deferrable, a deferred call of it is then replayed by c#
+** directly. returns its c function pointer, NULL for a GEN_CODE_MINIMIZE wrapper (c# knows it
+** by id) or a value that is not a plain c# function.
+*/
+LUA_API void *xlua_cmdbuf_mark(lua_State *L, int idx) {
+	int wrapperid = 0;
+	lua_CFunction fn = NULL;
+	int kind;
+	idx = idx < 0 && idx > LUA_REGISTRYINDEX ? lua_gettop(L) + idx + 1 : idx;
+	kind = xlua_csharp_callee(L, idx, &wrapperid, &fn);
+	if (kind == 0) {
+		return NULL;
+	}
+	cmdbuf_pushtable(L, &cmdbuf_mark_tag);
+	if (kind == CMD_FUNCTION) {
+		lua_pushlightuserdata(L, (void *)fn);
+	} else {
+		lua_pushinteger(L, wrapperid);
+	}
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return kind == CMD_FUNCTION ? (void *)fn : NULL;
+}
+
+//xlua.flush()
+static int cmdbuf_lua_flush(lua_State *L) {
+	if (xlua_cmdbuf_flush(L) != 0) {
+		return lua_error(L);
+	}
+	return 0;
+}
+
+//the xlua.* functions, registered by luaopen_xlua
+LUA_API void xlua_cmdbuf_openlib(lua_State *L) {
+	lua_pushcfunction(L, cmdbuf_defer);
+	lua_setfield(L, -2, "defer");
+	lua_pushcfunction(L, cmdbuf_defer_set);
+	lua_setfield(L, -2, "defer_set");
+	lua_pushcfunction(L, cmdbuf_lua_flush);
+	lua_setfield(L, -2, "flush");
+}
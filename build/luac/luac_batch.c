@@ -0,0 +1,593 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+/*
+** batch compiler
+**
+** luac_batch [options] (dir | -m manifest)...
+**   -o file  write a single packed file, see script_pack.h
+**   -d dir   write one bytecode file per script under dir, keeping the relative paths
+**   -s       strip debug information
+**   -z       lz4 compress the entries of the packed file where it helps
+**   -j n     worker threads (default: number of cores)
+**   -t file  write per file compile times (ms, bytes, path), slowest first
+**
+** a directory contributes every *.lua and *.lua.txt below it, a manifest lists one path per
+** line ('#' starts a comment). each worker owns a lua_State, scripts are handed out one at a
+** time so a few huge files do not stall a whole slice. identical outputs are stored once in
+** the packed file.
+*/
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "xlua_thread.h"
+#include "xlua_hash.h"
+#include "script_pack.h"
+#include "3rd/llz4/lz4/lz4.h"
+#include "3rd/llz4/lz4/lz4hc.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define batch_mkdir(p) _mkdir(p)
+#else
+#include <dirent.h>
+#include <time.h>
+#define batch_mkdir(p) mkdir(p, 0755)
+#endif
+
+#define PROGNAME "luac_batch"
+
+typedef struct {
+	char *path;     //as found on disk
+	char *relpath;  //relative to the scanned directory, '/' separated
+	char *name;     //relpath without the script suffix
+	char *code;
+	size_t size;
+	char *error;
+	double ms;
+	uint64_t hash;
+	int blob;       //index of the entry whose code is written, for dedupe
+	char *packed;   //lz4 block, NULL if stored as is
+	size_t packed_size;
+} Script;
+
+typedef struct {
+	Script *scripts;
+	int count;
+	int capacity;
+	int next;
+	int stripping;
+	int compressing;
+	xmutex_t lock;
+} Batch;
+
+static void fatal(const char *message, const char *arg) {
+	fprintf(stderr, "%s: %s%s%s\n", PROGNAME, message, arg != NULL ? " " : "", arg != NULL ? arg : "");
+	exit(EXIT_FAILURE);
+}
+
+static char *batch_strdup(const char *s) {
+	size_t len = strlen(s);
+	char *p = (char *)malloc(len + 1);
+	if (p == NULL) {
+		fatal("not enough memory", NULL);
+	}
+	memcpy(p, s, len + 1);
+	return p;
+}
+
+static double now_ms(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+	size_t len = strlen(s), slen = strlen(suffix);
+	return len > slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+static void add_script(Batch *b, const char *path, const char *relpath) {
+	Script *s;
+	char *p;
+	size_t len;
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity == 0 ? 256 : b->capacity * 2;
+		b->scripts = (Script *)realloc(b->scripts, sizeof(Script) * b->capacity);
+		if (b->scripts == NULL) {
+			fatal("not enough memory", NULL);
+		}
+	}
+	s = &b->scripts[b->count++];
+	memset(s, 0, sizeof(Script));
+	s->path = batch_strdup(path);
+	s->relpath = batch_strdup(relpath);
+	for (p = s->relpath; *p; p++) {
+		if (*p == '\\') {
+			*p = '/';
+		}
+	}
+	while (s->relpath[0] == '.' && s->relpath[1] == '/') {
+		memmove(s->relpath, s->relpath + 2, strlen(s->relpath + 2) + 1);
+	}
+	s->name = batch_strdup(s->relpath);
+	len = strlen(s->name);
+	if (has_suffix(s->name, ".lua.txt")) {
+		s->name[len - 8] = '\0';
+	} else if (has_suffix(s->name, ".lua")) {
+		s->name[len - 4] = '\0';
+	}
+}
+
+static int is_dir(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+//a truncated path would name another file, so running out of room is fatal
+static void join_path(char *out, size_t size, const char *dir, const char *name) {
+	int n = snprintf(out, size, "%s%s%s", dir, dir[0] && name[0] ? "/" : "", name);
+	if (n < 0 || (size_t)n >= size) {
+		fatal("path too long", dir);
+	}
+}
+
+static void scan_dir(Batch *b, const char *root, const char *rel) {
+	char path[4096], child[4096];
+	join_path(path, sizeof(path), root, rel);
+#ifdef _WIN32
+	{
+		WIN32_FIND_DATAA fd;
+		HANDLE h;
+		char pattern[4096];
+		join_path(pattern, sizeof(pattern), path, "*");
+		h = FindFirstFileA(pattern, &fd);
+		if (h == INVALID_HANDLE_VALUE) {
+			fatal("cannot open directory", path);
+		}
+		do {
+			const char *n = fd.cFileName;
+			if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0) {
+				continue;
+			}
+			join_path(child, sizeof(child), rel, n);
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				scan_dir(b, root, child);
+			} else if (has_suffix(n, ".lua") || has_suffix(n, ".lua.txt")) {
+				join_path(path, sizeof(path), root, child);
+				add_script(b, path, child);
+			}
+		} while (FindNextFileA(h, &fd));
+		FindClose(h);
+	}
+#else
+	{
+		struct dirent *e;
+		DIR *d = opendir(path);
+		if (d == NULL) {
+			fatal("cannot open directory", path);
+		}
+		while ((e = readdir(d)) != NULL) {
+			char full[4096];
+			const char *n = e->d_name;
+			if (strcmp(n, ".") == 0 || strcmp(n, "..") == 0) {
+				continue;
+			}
+			join_path(child, sizeof(child), rel, n);
+			join_path(full, sizeof(full), root, child);
+			if (is_dir(full)) {
+				scan_dir(b, root, child);
+			} else if (has_suffix(n, ".lua") || has_suffix(n, ".lua.txt")) {
+				add_script(b, full, child);
+			}
+		}
+		closedir(d);
+	}
+#endif
+}
+
+static void read_manifest(Batch *b, const char *manifest) {
+	char line[4096];
+	FILE *f = fopen(manifest, "r");
+	if (f == NULL) {
+		fatal("cannot open manifest", manifest);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		size_t len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			line[--len] = '\0';
+		}
+		if (len == 0 || line[0] == '#') {
+			continue;
+		}
+		add_script(b, line, line);
+	}
+	fclose(f);
+}
+
+static char *read_file(const char *path, size_t *size, char **error) {
+	char *buff;
+	long len;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		*error = batch_strdup(strerror(errno));
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buff = (char *)malloc(len > 0 ? len : 1);
+	if (buff == NULL || (len > 0 && fread(buff, 1, len, f) != (size_t)len)) {
+		*error = batch_strdup("read error");
+		free(buff);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = (size_t)len;
+	return buff;
+}
+
+static int writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	Script *s = (Script *)ud;
+	char *code = (char *)realloc(s->code, s->size + sz);
+	if (code == NULL) {
+		return 1;
+	}
+	memcpy(code + s->size, p, sz);
+	s->code = code;
+	s->size += sz;
+	return 0;
+}
+
+static void compile(lua_State *L, Script *s, int stripping) {
+	size_t size = 0;
+	const char *src;
+	char chunkname[4096];
+	double start = now_ms();
+	char *buff = read_file(s->path, &size, &s->error);
+	if (buff == NULL) {
+		return;
+	}
+	src = buff;
+	//skip the utf8 bom editors like to add to .lua.txt
+	if (size >= 3 && memcmp(src, "\xEF\xBB\xBF", 3) == 0) {
+		src += 3;
+		size -= 3;
+	}
+	snprintf(chunkname, sizeof(chunkname), "@%s", s->relpath);
+	if (luaL_loadbuffer(L, src, size, chunkname) != 0) {
+		s->error = batch_strdup(lua_tostring(L, -1));
+	} else if (lua_dump(L, writer, s, stripping) != 0) {
+		s->error = batch_strdup("dump error");
+	}
+	lua_settop(L, 0);
+	free(buff);
+	s->ms = now_ms() - start;
+	if (s->error == NULL) {
+		s->hash = xxh64(s->code, s->size, 0);
+	}
+}
+
+static void worker(void *ud) {
+	Batch *b = (Batch *)ud;
+	lua_State *L = luaL_newstate();
+	if (L == NULL) {
+		fatal("cannot create state: not enough memory", NULL);
+	}
+	for (;;) {
+		int i;
+		xmutex_lock(&b->lock);
+		i = b->next < b->count ? b->next++ : -1;
+		xmutex_unlock(&b->lock);
+		if (i < 0) {
+			break;
+		}
+		compile(L, &b->scripts[i], b->stripping);
+		//keep the state small, the loaded prototypes are garbage already
+		lua_gc(L, LUA_GCCOLLECT, 0);
+	}
+	lua_close(L);
+}
+
+static int cmp_name(const void *a, const void *b) {
+	return strcmp(((const Script *)a)->name, ((const Script *)b)->name);
+}
+
+static int cmp_time(const void *a, const void *b) {
+	double d = (*(Script * const *)b)->ms - (*(Script * const *)a)->ms;
+	return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+//point every script at the first one with the same bytecode, returns the number of blobs
+static int dedupe(Batch *b) {
+	int i, j, blobs = 0;
+	//scripts are sorted by name, an open addressing table over the hashes keeps this linear
+	int capacity = 16;
+	int *table;
+	while (capacity < b->count * 2) {
+		capacity *= 2;
+	}
+	table = (int *)malloc(sizeof(int) * capacity);
+	if (table == NULL) {
+		fatal("not enough memory", NULL);
+	}
+	for (i = 0; i < capacity; i++) {
+		table[i] = -1;
+	}
+	for (i = 0; i < b->count; i++) {
+		Script *s = &b->scripts[i];
+		size_t slot = (size_t)(s->hash & (capacity - 1));
+		s->blob = i;
+		while ((j = table[slot]) >= 0) {
+			Script *o = &b->scripts[j];
+			if (o->hash == s->hash && o->size == s->size && memcmp(o->code, s->code, s->size) == 0) {
+				s->blob = j;
+				break;
+			}
+			slot = (slot + 1) & (capacity - 1);
+		}
+		if (s->blob == i) {
+			table[slot] = i;
+			blobs++;
+		}
+	}
+	free(table);
+	return blobs;
+}
+
+static void compress_blob(Script *s) {
+	int bound = LZ4_compressBound((int)s->size);
+	char *packed = (char *)malloc(bound > 0 ? bound : 1);
+	int size = packed == NULL ? 0 : LZ4_compress_HC(s->code, packed, (int)s->size, bound, 9);
+	if (size <= 0 || (size_t)size >= s->size - s->size / 8) {
+		free(packed); //not worth an inflate on load
+		return;
+	}
+	s->packed = packed;
+	s->packed_size = (size_t)size;
+}
+
+static void write_pack(Batch *b, const char *output, int stripping) {
+	ScriptPackHeader h;
+	ScriptPackEntry *entries;
+	uint64_t *offsets;
+	uint64_t names_size = 0, data_size = 0;
+	int i;
+	FILE *f;
+
+	for (i = 1; i < b->count; i++) {
+		if (strcmp(b->scripts[i - 1].name, b->scripts[i].name) == 0) {
+			fatal("duplicated module name", b->scripts[i].name);
+		}
+	}
+
+	entries = (ScriptPackEntry *)calloc(b->count > 0 ? b->count : 1, sizeof(ScriptPackEntry));
+	offsets = (uint64_t *)calloc(b->count > 0 ? b->count : 1, sizeof(uint64_t));
+	if (entries == NULL || offsets == NULL) {
+		fatal("not enough memory", NULL);
+	}
+	for (i = 0; i < b->count; i++) {
+		Script *s = &b->scripts[i];
+		Script *blob = &b->scripts[s->blob];
+		if (s->blob == i) {
+			if (b->compressing) {
+				compress_blob(s);
+			}
+			offsets[i] = data_size;
+			data_size += s->packed != NULL ? s->packed_size : s->size;
+		}
+		entries[i].name_offset = (uint32_t)names_size;
+		entries[i].name_len = (uint32_t)strlen(s->name);
+		entries[i].data_offset = offsets[s->blob];
+		entries[i].size = (uint32_t)(blob->packed != NULL ? blob->packed_size : blob->size);
+		entries[i].raw_size = (uint32_t)blob->size;
+		entries[i].flags = blob->packed != NULL ? SCRIPT_PACK_LZ4 : 0;
+		names_size += entries[i].name_len;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SCRIPT_PACK_MAGIC, 4);
+	h.version = SCRIPT_PACK_VERSION;
+	h.flags = SCRIPT_PACK_BYTECODE | (stripping ? SCRIPT_PACK_STRIPPED : 0);
+	h.count = (uint32_t)b->count;
+	h.names_offset = sizeof(h) + sizeof(ScriptPackEntry) * (uint64_t)b->count;
+	h.data_offset = h.names_offset + names_size;
+
+	f = fopen(output, "wb");
+	if (f == NULL) {
+		fatal("cannot open", output);
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(entries, sizeof(ScriptPackEntry), b->count, f);
+	for (i = 0; i < b->count; i++) {
+		fwrite(b->scripts[i].name, 1, entries[i].name_len, f);
+	}
+	for (i = 0; i < b->count; i++) {
+		Script *s = &b->scripts[i];
+		if (s->blob == i) {
+			if (s->packed != NULL) {
+				fwrite(s->packed, 1, s->packed_size, f);
+			} else {
+				fwrite(s->code, 1, s->size, f);
+			}
+		}
+	}
+	if (ferror(f) || fclose(f) != 0) {
+		fatal("cannot write", output);
+	}
+	free(entries);
+	free(offsets);
+}
+
+static void make_parents(char *path) {
+	char *p;
+	for (p = path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			batch_mkdir(path);
+			*p = '/';
+		}
+	}
+}
+
+static void write_dir(Batch *b, const char *dir) {
+	int i;
+	char path[4096];
+	for (i = 0; i < b->count; i++) {
+		Script *s = &b->scripts[i];
+		FILE *f;
+		join_path(path, sizeof(path), dir, s->relpath);
+		make_parents(path);
+		f = fopen(path, "wb");
+		if (f == NULL || fwrite(s->code, 1, s->size, f) != s->size || fclose(f) != 0) {
+			fatal("cannot write", path);
+		}
+	}
+}
+
+static void write_times(Batch *b, const char *output) {
+	int i;
+	Script **order = (Script **)malloc(sizeof(Script *) * (b->count > 0 ? b->count : 1));
+	FILE *f = fopen(output, "w");
+	if (order == NULL || f == NULL) {
+		fatal("cannot open", output);
+	}
+	for (i = 0; i < b->count; i++) {
+		order[i] = &b->scripts[i];
+	}
+	qsort(order, b->count, sizeof(Script *), cmp_time);
+	for (i = 0; i < b->count; i++) {
+		fprintf(f, "%.3f\t%u\t%s\n", order[i]->ms, (unsigned int)order[i]->size, order[i]->path);
+	}
+	fclose(f);
+	free(order);
+}
+
+static void usage(const char *message) {
+	fprintf(stderr, "%s: %s\n", PROGNAME, message);
+	fprintf(stderr,
+		"usage: %s [options] (dir | -m manifest)...\n"
+		"Available options are:\n"
+		"  -m file  compile the scripts listed in file, one path per line\n"
+		"  -o file  write a single packed file\n"
+		"  -d dir   write one bytecode file per script under dir\n"
+		"  -s       strip debug information\n"
+		"  -z       lz4 compress the packed file entries\n"
+		"  -j n     number of worker threads\n"
+		"  -t file  write per file compile times, slowest first\n",
+		PROGNAME);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	Batch b;
+	const char *pack = NULL, *outdir = NULL, *times = NULL;
+	int jobs = 0, i, failed = 0, blobs, sources = 0, started = 0;
+	xthread_t *threads;
+	double start;
+
+	memset(&b, 0, sizeof(b));
+	for (i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		int has_value = i + 1 < argc;
+		if (strcmp(a, "-s") == 0) {
+			b.stripping = 1;
+		} else if (strcmp(a, "-z") == 0) {
+			b.compressing = 1;
+		} else if (strcmp(a, "-o") == 0 && has_value) {
+			pack = argv[++i];
+		} else if (strcmp(a, "-d") == 0 && has_value) {
+			outdir = argv[++i];
+		} else if (strcmp(a, "-t") == 0 && has_value) {
+			times = argv[++i];
+		} else if (strcmp(a, "-j") == 0 && has_value) {
+			jobs = atoi(argv[++i]);
+		} else if (strcmp(a, "-m") == 0 && has_value) {
+			read_manifest(&b, argv[++i]);
+			sources++;
+		} else if (a[0] == '-') {
+			usage("unrecognized option or missing argument");
+		} else if (is_dir(a)) {
+			scan_dir(&b, a, "");
+			sources++;
+		} else {
+			fatal("not a directory", a);
+		}
+	}
+	if (sources == 0) {
+		usage("no input given");
+	}
+	if (pack == NULL && outdir == NULL) {
+		usage("no output given, use -o or -d");
+	}
+
+	if (jobs <= 0) {
+		jobs = xthread_cpu_count();
+	}
+	if (jobs > b.count) {
+		jobs = b.count > 0 ? b.count : 1;
+	}
+
+	start = now_ms();
+	xmutex_init(&b.lock);
+	threads = (xthread_t *)malloc(sizeof(xthread_t) * jobs);
+	for (i = 0; i < jobs; i++) {
+		if (!xthread_create(&threads[i], worker, &b)) {
+			break;
+		}
+		started++;
+	}
+	if (started == 0) {
+		worker(&b); //no threads on this platform
+	}
+	for (i = 0; i < started; i++) {
+		xthread_join(threads[i]);
+	}
+	free(threads);
+	xmutex_destroy(&b.lock);
+
+	if (times != NULL) {
+		write_times(&b, times);
+	}
+	for (i = 0; i < b.count; i++) {
+		if (b.scripts[i].error != NULL) {
+			fprintf(stderr, "%s: %s: %s\n", PROGNAME, b.scripts[i].path, b.scripts[i].error);
+			failed++;
+		}
+	}
+	if (failed > 0) {
+		fprintf(stderr, "%s: %d of %d scripts failed, nothing written\n", PROGNAME, failed, b.count);
+		return EXIT_FAILURE;
+	}
+
+	qsort(b.scripts, b.count, sizeof(Script), cmp_name);
+	blobs = dedupe(&b);
+	if (pack != NULL) {
+		write_pack(&b, pack, b.stripping);
+	}
+	if (outdir != NULL) {
+		write_dir(&b, outdir);
+	}
+	printf("%s: %d scripts, %d unique, %d threads, %.1f ms\n", PROGNAME, b.count, blobs, started > 0 ? started : 1, now_ms() - start);
+	return EXIT_SUCCESS;
+}
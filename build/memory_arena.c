@@ -0,0 +1,193 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+** region allocator for short-lived states
+**
+** blocks up to chunk_size / 8 are bumped out of big chunks, free is a no-op except
+** for the last block of the current chunk, larger blocks go to malloc. lua always
+** passes the old size of a block, so the size alone tells where a block lives.
+** all chunks are released at once when lua_close frees the main state.
+** memory freed by lua is not reused, so use it for states that are thrown away soon.
+*/
+
+#define ARENA_DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 16
+#define arena_align(s) (((s) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *prev;
+	size_t size;
+	size_t pos;
+} ArenaChunk;
+
+#define chunk_data(c) ((char *)(c) + arena_align(sizeof(ArenaChunk)))
+
+typedef struct {
+	ArenaChunk *current;
+	size_t chunk_size;
+	size_t max_block;
+	size_t used;
+	size_t reserved;
+	int armed;
+	void *last; //the last block bumped out of current
+} MemoryArena;
+
+#if !USING_LUAJIT
+
+static void arena_release(MemoryArena *a) {
+	ArenaChunk *c = a->current;
+	while (c != NULL) {
+		ArenaChunk *prev = c->prev;
+		free(c);
+		c = prev;
+	}
+	free(a);
+}
+
+static void *arena_bump(MemoryArena *a, size_t size) {
+	ArenaChunk *c = a->current;
+	size = arena_align(size);
+	if (c == NULL || c->pos + size > c->size) {
+		c = (ArenaChunk *)malloc(arena_align(sizeof(ArenaChunk)) + a->chunk_size);
+		if (c == NULL) {
+			return NULL;
+		}
+		c->prev = a->current;
+		c->size = a->chunk_size;
+		c->pos = 0;
+		a->current = c;
+		a->reserved += a->chunk_size;
+	}
+	a->last = chunk_data(c) + c->pos;
+	c->pos += size;
+	return a->last;
+}
+
+//try to resize the last block in place
+static int arena_resize_last(MemoryArena *a, void *ptr, size_t osize, size_t nsize) {
+	ArenaChunk *c = a->current;
+	size_t start;
+	if (ptr == NULL || ptr != a->last) {
+		return 0;
+	}
+	start = (char *)ptr - chunk_data(c);
+	if (start + arena_align(nsize) > c->size) {
+		return 0;
+	}
+	c->pos = start + arena_align(nsize);
+	return 1;
+}
+
+static void *arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	MemoryArena *a = (MemoryArena *)ud;
+	void *nptr;
+	if (ptr == NULL) {
+		osize = 0; //osize is the type of the new object
+	}
+
+	if (nsize == 0) {
+		if (osize > a->max_block) {
+			free(ptr);
+		} else if (ptr != NULL && ptr == a->last) { //lua frees NULL blocks of size 0 too
+			a->current->pos = (char *)ptr - chunk_data(a->current);
+			a->last = NULL;
+		}
+		a->used -= osize;
+		if (a->used == 0 && a->armed) { //the main state has been freed by lua_close
+			arena_release(a);
+		}
+		return NULL;
+	}
+
+	if (nsize > a->max_block) {
+		if (osize > a->max_block) {
+			nptr = realloc(ptr, nsize);
+		} else {
+			nptr = malloc(nsize);
+			if (nptr != NULL && ptr != NULL) {
+				memcpy(nptr, ptr, osize);
+			}
+		}
+	} else if (osize > a->max_block) {
+		nptr = arena_bump(a, nsize);
+		if (nptr != NULL) {
+			memcpy(nptr, ptr, nsize);
+			free(ptr);
+		}
+	} else if (arena_resize_last(a, ptr, osize, nsize) || nsize <= osize) {
+		nptr = ptr;
+	} else {
+		nptr = arena_bump(a, nsize);
+		if (nptr != NULL && ptr != NULL) {
+			memcpy(nptr, ptr, osize);
+		}
+	}
+
+	if (nptr != NULL) {
+		a->used = a->used - osize + nsize;
+	}
+	return nptr;
+}
+
+static int arena_panic(lua_State *L) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	fflush(stderr);
+	return 0;
+}
+
+LUA_API lua_State *xlua_newstate_arena(size_t chunk_size) {
+	lua_State *L;
+	MemoryArena *a = (MemoryArena *)malloc(sizeof(MemoryArena));
+	if (a == NULL) {
+		return NULL;
+	}
+	memset(a, 0, sizeof(MemoryArena));
+	a->chunk_size = arena_align(chunk_size > 0 ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE);
+	a->max_block = a->chunk_size / 8;
+	L = lua_newstate(arena_alloc, a);
+	if (L == NULL) {
+		arena_release(a);
+		return NULL;
+	}
+	a->armed = 1;
+	lua_atpanic(L, arena_panic);
+	return L;
+}
+
+//bytes reserved by the chunks of an arena state, 0 for other states
+LUA_API size_t xlua_arena_reserved(lua_State *L) {
+	void *ud = NULL;
+	if (lua_getallocf(L, &ud) != arena_alloc) {
+		return 0;
+	}
+	return ((MemoryArena *)ud)->reserved;
+}
+
+#else
+
+//luajit(non gc64) refuses custom allocators, fall back to the default one
+
+LUA_API lua_State *xlua_newstate_arena(size_t chunk_size) {
+	return luaL_newstate();
+}
+
+LUA_API size_t xlua_arena_reserved(lua_State *L) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+** per state memory quota
+**
+** soft limit: the first allocation that crosses it still succeeds, the callback is notified
+**             and a full gc is queued for xlua_memory_quota_collect, which runs it outside
+**             the allocator (LuaEnv.Tick calls it). refusing the allocation instead would
+**             only work for lua's own allocations, lauxlib buffers and the 3rd libs that call
+**             the allocator directly do not retry. the limit is armed again after the usage
+**             falls back under 7/8 of it.
+** hard limit: allocations that would cross it fail, lua raises a memory error.
+**
+** 0 means no limit. the callback runs inside the allocator and must not call any lua api.
+*/
+
+typedef void (*lua_MemoryQuotaCallback) (lua_State *L, size_t used, size_t limit, int hard);
+
+typedef struct {
+	size_t used;
+	size_t peak;
+	size_t soft_limit;
+	size_t hard_limit;
+	int soft_fired;
+	int gc_pending;
+	int armed;
+	lua_State *L;
+	lua_MemoryQuotaCallback callback;
+} MemoryQuota;
+
+#if !USING_LUAJIT
+
+static void *quota_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	MemoryQuota *q = (MemoryQuota *)ud;
+	void *nptr;
+	if (ptr == NULL) {
+		osize = 0; //osize is the type of the new object
+	}
+
+	if (nsize == 0) {
+		free(ptr);
+		q->used -= osize;
+		if (q->used == 0 && q->armed) { //the main state has been freed by lua_close
+			free(q);
+		} else if (q->soft_fired && q->used < q->soft_limit - q->soft_limit / 8) {
+			q->soft_fired = 0;
+		}
+		return NULL;
+	}
+
+	if (nsize > osize && q->armed) {
+		size_t used = q->used + (nsize - osize);
+		if (q->hard_limit != 0 && used > q->hard_limit) {
+			if (q->callback != NULL) {
+				q->callback(q->L, q->used, q->hard_limit, 1);
+			}
+			return NULL;
+		}
+		if (q->soft_limit != 0 && !q->soft_fired && used > q->soft_limit) {
+			q->soft_fired = 1;
+			q->gc_pending = 1;
+			if (q->callback != NULL) {
+				q->callback(q->L, used, q->soft_limit, 0);
+			}
+		}
+	}
+
+	nptr = realloc(ptr, nsize);
+	if (nptr == NULL) {
+		return NULL;
+	}
+	q->used = q->used - osize + nsize;
+	if (q->used > q->peak) {
+		q->peak = q->used;
+	}
+	if (q->soft_fired && q->used < q->soft_limit - q->soft_limit / 8) {
+		q->soft_fired = 0;
+	}
+	return nptr;
+}
+
+static int quota_panic(lua_State *L) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	fflush(stderr);
+	return 0;
+}
+
+static MemoryQuota *get_quota(lua_State *L) {
+	void *ud = NULL;
+	if (lua_getallocf(L, &ud) != quota_alloc) {
+		return NULL;
+	}
+	return (MemoryQuota *)ud;
+}
+
+LUA_API lua_State *xlua_newstate_quota(size_t soft_limit, size_t hard_limit) {
+	lua_State *L;
+	MemoryQuota *q = (MemoryQuota *)malloc(sizeof(MemoryQuota));
+	if (q == NULL) {
+		return NULL;
+	}
+	memset(q, 0, sizeof(MemoryQuota));
+	q->soft_limit = soft_limit;
+	q->hard_limit = hard_limit;
+	L = lua_newstate(quota_alloc, q);
+	if (L == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->L = L;
+	//lua can only run an emergency gc once the state is built
+	q->armed = 1;
+	lua_atpanic(L, quota_panic);
+	return L;
+}
+
+LUA_API int xlua_set_memory_quota(lua_State *L, size_t soft_limit, size_t hard_limit) {
+	MemoryQuota *q = get_quota(L);
+	if (q == NULL) {
+		return 0;
+	}
+	q->soft_limit = soft_limit;
+	q->hard_limit = hard_limit;
+	q->soft_fired = 0;
+	q->gc_pending = 0;
+	return 1;
+}
+
+//runs the full gc queued by a soft limit crossing, returns 1 if it did
+LUA_API int xlua_memory_quota_collect(lua_State *L) {
+	MemoryQuota *q = get_quota(L);
+	if (q == NULL || !q->gc_pending) {
+		return 0;
+	}
+	q->gc_pending = 0;
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	return 1;
+}
+
+LUA_API int xlua_set_memory_quota_callback(lua_State *L, lua_MemoryQuotaCallback callback) {
+	MemoryQuota *q = get_quota(L);
+	if (q == NULL) {
+		return 0;
+	}
+	q->callback = callback;
+	return 1;
+}
+
+LUA_API size_t xlua_memory_used(lua_State *L) {
+	MemoryQuota *q = get_quota(L);
+	if (q == NULL) {
+		return ((size_t)lua_gc(L, LUA_GCCOUNT, 0) << 10) + (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+	}
+	return q->used;
+}
+
+LUA_API size_t xlua_memory_peak(lua_State *L) {
+	MemoryQuota *q = get_quota(L);
+	return q == NULL ? 0 : q->peak;
+}
+
+#else
+
+//luajit(non gc64) refuses custom allocators, quotas are not supported there
+
+LUA_API lua_State *xlua_newstate_quota(size_t soft_limit, size_t hard_limit) {
+	return luaL_newstate();
+}
+
+LUA_API int xlua_set_memory_quota(lua_State *L, size_t soft_limit, size_t hard_limit) {
+	return 0;
+}
+
+LUA_API int xlua_set_memory_quota_callback(lua_State *L, lua_MemoryQuotaCallback callback) {
+	return 0;
+}
+
+LUA_API int xlua_memory_quota_collect(lua_State *L) {
+	return 0;
+}
+
+LUA_API size_t xlua_memory_used(lua_State *L) {
+	return ((size_t)lua_gc(L, LUA_GCCOUNT, 0) << 10) + (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+LUA_API size_t xlua_memory_peak(lua_State *L) {
+	return 0;
+}
+
+#endif
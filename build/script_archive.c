@@ -0,0 +1,279 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "script_pack.h"
+#include "3rd/llz4/lz4/lz4.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#if defined(WINAPI_FAMILY) && WINAPI_FAMILY != WINAPI_FAMILY_DESKTOP_APP
+#define ARCHIVE_NO_MMAP //uwp: read the whole file instead
+#endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+** native package searcher over a packed script file (see script_pack.h, written by luac_batch)
+**
+** the file is mapped read only and owned by a userdata kept as the searcher upvalue, so it is
+** unmapped when the state is closed. lookups binary search the sorted index, "a.b" is looked
+** up as "a/b". chunks are loaded straight from the mapping, lz4 entries are inflated into a
+** temporary buffer first.
+*/
+
+#define ARCHIVE_MT "xlua_script_archive"
+
+#if LUA_VERSION_NUM == 501
+#define lua_rawlen lua_objlen
+#endif
+
+typedef struct {
+	const char *base;
+	size_t size;
+	const ScriptPackHeader *header;
+	const ScriptPackEntry *entries;
+	const char *names;
+	size_t names_size;
+	const char *data;
+	size_t data_size;
+#ifdef ARCHIVE_NO_MMAP
+	char *buffer;
+#endif
+} ScriptArchive;
+
+static int archive_map(ScriptArchive *a, const char *path) {
+#if defined(ARCHIVE_NO_MMAP)
+	long len;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	a->buffer = len > 0 ? (char *)malloc(len) : NULL;
+	if (a->buffer == NULL || fread(a->buffer, 1, len, f) != (size_t)len) {
+		free(a->buffer);
+		a->buffer = NULL;
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	a->base = a->buffer;
+	a->size = (size_t)len;
+	return 1;
+#elif defined(_WIN32)
+	LARGE_INTEGER len;
+	HANDLE mapping;
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	if (!GetFileSizeEx(file, &len) || len.QuadPart == 0) {
+		CloseHandle(file);
+		return 0;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) {
+		return 0;
+	}
+	a->base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); //the view keeps the mapping alive
+	if (a->base == NULL) {
+		return 0;
+	}
+	a->size = (size_t)len.QuadPart;
+	return 1;
+#else
+	struct stat st;
+	void *p;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); //the mapping keeps the file alive
+	if (p == MAP_FAILED) {
+		return 0;
+	}
+	a->base = (const char *)p;
+	a->size = (size_t)st.st_size;
+	return 1;
+#endif
+}
+
+static void archive_unmap(ScriptArchive *a) {
+	if (a->base == NULL) {
+		return;
+	}
+#if defined(ARCHIVE_NO_MMAP)
+	free(a->buffer);
+	a->buffer = NULL;
+#elif defined(_WIN32)
+	UnmapViewOfFile(a->base);
+#else
+	munmap((void *)a->base, a->size);
+#endif
+	a->base = NULL;
+}
+
+static int archive_check(ScriptArchive *a) {
+	const ScriptPackHeader *h = (const ScriptPackHeader *)a->base;
+	if (a->size < sizeof(ScriptPackHeader) || memcmp(h->magic, SCRIPT_PACK_MAGIC, 4) != 0
+		|| h->version != SCRIPT_PACK_VERSION) {
+		return 0;
+	}
+	if (h->names_offset != sizeof(ScriptPackHeader) + (uint64_t)h->count * sizeof(ScriptPackEntry)
+		|| h->data_offset < h->names_offset || h->data_offset > a->size) {
+		return 0;
+	}
+	a->header = h;
+	a->entries = (const ScriptPackEntry *)(a->base + sizeof(ScriptPackHeader));
+	a->names = a->base + h->names_offset;
+	a->names_size = (size_t)(h->data_offset - h->names_offset);
+	a->data = a->base + h->data_offset;
+	a->data_size = a->size - (size_t)h->data_offset;
+	return 1;
+}
+
+//NULL if the name is missing or the entry points outside of the file
+static const ScriptPackEntry *archive_find(ScriptArchive *a, const char *name, size_t len) {
+	uint32_t lo = 0, hi = a->header->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const ScriptPackEntry *e = &a->entries[mid];
+		size_t n;
+		int c;
+		if ((uint64_t)e->name_offset + e->name_len > a->names_size) {
+			return NULL;
+		}
+		n = e->name_len < len ? e->name_len : len;
+		c = memcmp(a->names + e->name_offset, name, n);
+		if (c == 0) {
+			c = e->name_len < len ? -1 : (e->name_len > len ? 1 : 0);
+		}
+		if (c == 0) {
+			return e->data_offset <= a->data_size && e->size <= a->data_size - e->data_offset ? e : NULL;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+static int archive_gc(lua_State *L) {
+	archive_unmap((ScriptArchive *)lua_touserdata(L, 1));
+	return 0;
+}
+
+static int archive_searcher(lua_State *L) {
+	ScriptArchive *a = (ScriptArchive *)lua_touserdata(L, lua_upvalueindex(1));
+	size_t len;
+	const char *module = luaL_checklstring(L, 1, &len);
+	const char *name;
+	const char *code;
+	size_t size;
+	const ScriptPackEntry *e;
+	//name and the inflated chunk are lua objects, a memory error while loading leaks nothing
+	lua_pushfstring(L, "@%s", luaL_gsub(L, module, ".", "/"));
+	name = lua_tostring(L, -1);
+
+	e = archive_find(a, name + 1, len);
+	if (e == NULL) {
+		lua_pushfstring(L, "\n\tno entry '%s' in script archive", module);
+		return 1;
+	}
+	code = a->data + e->data_offset;
+	size = e->size;
+	if (e->flags & SCRIPT_PACK_LZ4) {
+		char *inflated;
+		//lz4 inflates a block at most 255 times, a larger raw_size is a corrupted entry
+		if (e->raw_size > LZ4_MAX_INPUT_SIZE || e->raw_size > (uint64_t)e->size * 255) {
+			return luaL_error(L, "error loading module '%s' from script archive:\n\tbad lz4 block size", module);
+		}
+		inflated = (char *)lua_newuserdata(L, e->raw_size > 0 ? e->raw_size : 1);
+		if (LZ4_decompress_safe(code, inflated, (int)e->size, (int)e->raw_size) != (int)e->raw_size) {
+			return luaL_error(L, "error loading module '%s' from script archive:\n\tcorrupted lz4 block", module);
+		}
+		code = inflated;
+		size = e->raw_size;
+	}
+	if (luaL_loadbuffer(L, code, size, name) != 0) {
+		return luaL_error(L, "error loading module '%s' from script archive:\n\t%s", module, lua_tostring(L, -1));
+	}
+	lua_pushstring(L, module);
+	return 2;
+}
+
+//maps path and inserts a searcher for it at package.searchers[index] (package.loaders on 5.1),
+//a negative index counts from the end. returns 0 if the file is missing or not a script pack
+LUA_API int xlua_add_archive(lua_State *L, const char *path, int index) {
+	int top = lua_gettop(L);
+	int len, i;
+	ScriptArchive *a = (ScriptArchive *)lua_newuserdata(L, sizeof(ScriptArchive));
+	memset(a, 0, sizeof(ScriptArchive));
+	if (!archive_map(a, path)) {
+		lua_settop(L, top);
+		return 0;
+	}
+	if (!archive_check(a)) {
+		archive_unmap(a);
+		lua_settop(L, top);
+		return 0;
+	}
+	if (luaL_newmetatable(L, ARCHIVE_MT)) {
+		lua_pushcfunction(L, archive_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_pushcclosure(L, archive_searcher, 1);
+
+	lua_getglobal(L, "package");
+#if LUA_VERSION_NUM == 501
+	lua_getfield(L, -1, "loaders");
+#else
+	lua_getfield(L, -1, "searchers");
+#endif
+	if (!lua_istable(L, -1)) {
+		lua_settop(L, top);
+		return 0;
+	}
+	len = (int)lua_rawlen(L, -1);
+	index = index < 0 ? len + index + 2 : index;
+	if (index < 1 || index > len + 1) {
+		index = len + 1;
+	}
+	for (i = len + 1; i > index; i--) {
+		lua_rawgeti(L, -1, i - 1);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushvalue(L, top + 1);
+	lua_rawseti(L, -2, index);
+	lua_settop(L, top);
+	return 1;
+}
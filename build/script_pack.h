@@ -0,0 +1,52 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#ifndef SCRIPT_PACK_H
+#define SCRIPT_PACK_H
+
+/*
+** packed script file, written by luac/luac_batch.c
+**
+** [ScriptPackHeader][ScriptPackEntry * count][names][data]
+**
+** entries are sorted by name (byte order) so readers can binary search a mapped file.
+** names are module paths with '/' separators and without the .lua/.lua.txt suffix, they
+** are not zero terminated. several entries may share the same data (deduplicated output).
+** all integers are little endian, offsets are relative to the start of their section.
+*/
+
+#include <stdint.h>
+
+#define SCRIPT_PACK_MAGIC "XLPK"
+#define SCRIPT_PACK_VERSION 1
+
+#define SCRIPT_PACK_STRIPPED 1 //debug info stripped
+#define SCRIPT_PACK_BYTECODE 2 //data is bytecode, source otherwise
+
+#define SCRIPT_PACK_LZ4 1 //entry flag, data is a lz4 block of raw_size bytes
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t count;
+	uint64_t names_offset;
+	uint64_t data_offset;
+} ScriptPackHeader;
+
+typedef struct {
+	uint32_t name_offset;
+	uint32_t name_len;
+	uint64_t data_offset;
+	uint32_t size;
+	uint32_t raw_size;
+	uint32_t flags;
+	uint32_t reserved;
+} ScriptPackEntry;
+
+#endif
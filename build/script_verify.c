@@ -0,0 +1,439 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "xlua_thread.h"
+
+/*
+** script verification by sha256 manifest
+**
+** the manifest uses the sha256sum format ("<64 hex digits> <path>" per line) and is expected
+** to be signature checked by the caller (SignatureLoader, once). after that:
+**   xlua_verify_files  hashes the listed files on worker threads and compares them,
+**   xlua_verify_trust  accepts the listed digests without reading any file,
+**   xlua_verify_buffer checks a loaded script against the accepted digests.
+** accepted digests are cached process wide, so an archive or a script is hashed against the
+** manifest once, not once per require or per LuaEnv.
+*/
+
+#define SHA256_SIZE 32
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buffer[64];
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *p) {
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i;
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) | ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	}
+	for (i = 16; i < 64; i++) {
+		uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_init(Sha256 *s) {
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(s->state, init, sizeof(init));
+	s->count = 0;
+}
+
+static void sha256_update(Sha256 *s, const unsigned char *data, size_t len) {
+	size_t used = (size_t)(s->count & 63);
+	s->count += len;
+	if (used > 0) {
+		size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(s->buffer + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		sha256_block(s->state, s->buffer);
+	}
+	while (len >= 64) {
+		sha256_block(s->state, data);
+		data += 64;
+		len -= 64;
+	}
+	memcpy(s->buffer, data, len);
+}
+
+static void sha256_final(Sha256 *s, unsigned char *out) {
+	unsigned char pad[72];
+	uint64_t bits = s->count * 8;
+	size_t used = (size_t)(s->count & 63);
+	size_t padlen = (used < 56 ? 56 : 120) - used;
+	int i;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) {
+		pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+	}
+	sha256_update(s, pad, padlen + 8);
+	for (i = 0; i < 8; i++) {
+		out[i * 4] = (unsigned char)(s->state[i] >> 24);
+		out[i * 4 + 1] = (unsigned char)(s->state[i] >> 16);
+		out[i * 4 + 2] = (unsigned char)(s->state[i] >> 8);
+		out[i * 4 + 3] = (unsigned char)s->state[i];
+	}
+}
+
+LUA_API void xlua_sha256(const char *data, int len, unsigned char *out) {
+	Sha256 s;
+	sha256_init(&s);
+	sha256_update(&s, (const unsigned char *)data, (size_t)len);
+	sha256_final(&s, out);
+}
+
+/*
+** accepted digests, an open addressing set shared by every state
+*/
+
+static unsigned char *verified = NULL;
+static size_t verified_capacity = 0;
+static size_t verified_count = 0;
+static xmutex_t verified_lock;
+static xonce_t verified_lock_once = XONCE_INIT;
+
+static void verified_lock_create(void) {
+	xmutex_init(&verified_lock);
+}
+
+static void verified_lock_init(void) {
+	xonce(&verified_lock_once, verified_lock_create);
+}
+
+static size_t digest_slot(const unsigned char *digest, size_t capacity) {
+	size_t h;
+	memcpy(&h, digest, sizeof(h)); //a sha256 is as good a hash as any
+	return h & (capacity - 1);
+}
+
+static int digest_is_empty(const unsigned char *slot) {
+	int i;
+	for (i = 0; i < SHA256_SIZE; i++) {
+		if (slot[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//the lock must be held
+static int verified_find(const unsigned char *digest) {
+	size_t i;
+	if (verified_count == 0) {
+		return 0;
+	}
+	for (i = digest_slot(digest, verified_capacity);; i = (i + 1) & (verified_capacity - 1)) {
+		unsigned char *slot = verified + i * SHA256_SIZE;
+		if (memcmp(slot, digest, SHA256_SIZE) == 0) {
+			return 1;
+		}
+		if (digest_is_empty(slot)) {
+			return 0;
+		}
+	}
+}
+
+//the lock must be held, 0 if out of memory
+static int verified_add(const unsigned char *digest) {
+	size_t i;
+	if (digest_is_empty(digest) || verified_find(digest)) {
+		return 1;
+	}
+	if ((verified_count + 1) * 2 > verified_capacity) {
+		size_t capacity = verified_capacity == 0 ? 256 : verified_capacity * 2;
+		unsigned char *table = (unsigned char *)calloc(capacity, SHA256_SIZE);
+		if (table == NULL) {
+			return 0;
+		}
+		for (i = 0; i < verified_capacity; i++) {
+			unsigned char *old = verified + i * SHA256_SIZE;
+			if (!digest_is_empty(old)) {
+				size_t j = digest_slot(old, capacity);
+				while (!digest_is_empty(table + j * SHA256_SIZE)) {
+					j = (j + 1) & (capacity - 1);
+				}
+				memcpy(table + j * SHA256_SIZE, old, SHA256_SIZE);
+			}
+		}
+		free(verified);
+		verified = table;
+		verified_capacity = capacity;
+	}
+	for (i = digest_slot(digest, verified_capacity); !digest_is_empty(verified + i * SHA256_SIZE);
+		i = (i + 1) & (verified_capacity - 1)) {
+	}
+	memcpy(verified + i * SHA256_SIZE, digest, SHA256_SIZE);
+	verified_count++;
+	return 1;
+}
+
+/*
+** manifest
+*/
+
+typedef struct {
+	unsigned char digest[SHA256_SIZE];
+	char *path;
+	int ok;
+} ManifestEntry;
+
+typedef struct {
+	ManifestEntry *entries;
+	int count;
+	int next;
+	const char *root;
+	xmutex_t lock;
+} Manifest;
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static void manifest_free(Manifest *m) {
+	int i;
+	for (i = 0; i < m->count; i++) {
+		free(m->entries[i].path);
+	}
+	free(m->entries);
+}
+
+//0 on a malformed manifest
+static int manifest_parse(Manifest *m, const char *text, size_t len) {
+	const char *p = text, *end = text + len;
+	int capacity = 0;
+	memset(m, 0, sizeof(Manifest));
+	while (p < end) {
+		const char *line = p, *eol = p, *path;
+		ManifestEntry *e;
+		int i;
+		while (eol < end && *eol != '\n') {
+			eol++;
+		}
+		p = eol < end ? eol + 1 : end;
+		while (eol > line && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t')) {
+			eol--;
+		}
+		if (eol == line || line[0] == '#') {
+			continue;
+		}
+		if (eol - line < SHA256_SIZE * 2 + 2) {
+			manifest_free(m);
+			return 0;
+		}
+		if (m->count == capacity) {
+			ManifestEntry *entries;
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			entries = (ManifestEntry *)realloc(m->entries, sizeof(ManifestEntry) * capacity);
+			if (entries == NULL) {
+				manifest_free(m);
+				return 0;
+			}
+			m->entries = entries;
+		}
+		e = &m->entries[m->count];
+		memset(e, 0, sizeof(ManifestEntry));
+		for (i = 0; i < SHA256_SIZE; i++) {
+			int hi = hex_value(line[i * 2]), lo = hex_value(line[i * 2 + 1]);
+			if (hi < 0 || lo < 0) {
+				manifest_free(m);
+				return 0;
+			}
+			e->digest[i] = (unsigned char)(hi << 4 | lo);
+		}
+		path = line + SHA256_SIZE * 2;
+		while (path < eol && (*path == ' ' || *path == '\t')) {
+			path++;
+		}
+		if (path < eol && *path == '*') { //binary mode marker of sha256sum
+			path++;
+		}
+		e->path = (char *)malloc(eol - path + 1);
+		if (e->path == NULL) {
+			manifest_free(m);
+			return 0;
+		}
+		memcpy(e->path, path, eol - path);
+		e->path[eol - path] = '\0';
+		m->count++;
+	}
+	return 1;
+}
+
+static int hash_file(const char *path, unsigned char *out) {
+	unsigned char buff[64 * 1024];
+	size_t n;
+	Sha256 s;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return 0;
+	}
+	sha256_init(&s);
+	while ((n = fread(buff, 1, sizeof(buff), f)) > 0) {
+		sha256_update(&s, buff, n);
+	}
+	n = ferror(f);
+	fclose(f);
+	if (n) {
+		return 0;
+	}
+	sha256_final(&s, out);
+	return 1;
+}
+
+static void verify_worker(void *ud) {
+	Manifest *m = (Manifest *)ud;
+	char path[4096];
+	unsigned char digest[SHA256_SIZE];
+	for (;;) {
+		ManifestEntry *e;
+		int i;
+		xmutex_lock(&m->lock);
+		i = m->next < m->count ? m->next++ : -1;
+		xmutex_unlock(&m->lock);
+		if (i < 0) {
+			break;
+		}
+		e = &m->entries[i];
+		if (m->root != NULL && m->root[0] != '\0') {
+			snprintf(path, sizeof(path), "%s/%s", m->root, e->path);
+		} else {
+			snprintf(path, sizeof(path), "%s", e->path);
+		}
+		e->ok = hash_file(path, digest) && memcmp(digest, e->digest, SHA256_SIZE) == 0;
+	}
+}
+
+//hash every file of the manifest (paths relative to root) on `threads` workers, 0 means one per
+//core. matching digests are accepted. returns the number of missing or modified files, -1 if
+//the manifest is malformed. the first bad path is copied to failed
+LUA_API int xlua_verify_files(const char *root, const char *manifest, int len, int threads, char *failed, int failed_size) {
+	Manifest m;
+	xthread_t *workers;
+	int i, started = 0, bad = 0;
+	if (!manifest_parse(&m, manifest, (size_t)len)) {
+		return -1;
+	}
+	m.root = root;
+	if (threads <= 0) {
+		threads = xthread_cpu_count();
+	}
+	if (threads > m.count) {
+		threads = m.count > 0 ? m.count : 1;
+	}
+	xmutex_init(&m.lock);
+	workers = (xthread_t *)malloc(sizeof(xthread_t) * threads);
+	for (i = 0; workers != NULL && i < threads - 1; i++) {
+		if (!xthread_create(&workers[i], verify_worker, &m)) {
+			break;
+		}
+		started++;
+	}
+	verify_worker(&m); //the calling thread works too
+	for (i = 0; i < started; i++) {
+		xthread_join(workers[i]);
+	}
+	free(workers);
+	xmutex_destroy(&m.lock);
+
+	verified_lock_init();
+	xmutex_lock(&verified_lock);
+	for (i = 0; i < m.count; i++) {
+		if (!m.entries[i].ok || !verified_add(m.entries[i].digest)) {
+			if (bad++ == 0 && failed != NULL && failed_size > 0) {
+				strncpy(failed, m.entries[i].path, failed_size - 1);
+				failed[failed_size - 1] = '\0';
+			}
+		}
+	}
+	xmutex_unlock(&verified_lock);
+	manifest_free(&m);
+	return bad;
+}
+
+//accept every digest of an already signature checked manifest, -1 if it is malformed
+LUA_API int xlua_verify_trust(const char *manifest, int len) {
+	Manifest m;
+	int i, ok = 1;
+	if (!manifest_parse(&m, manifest, (size_t)len)) {
+		return -1;
+	}
+	verified_lock_init();
+	xmutex_lock(&verified_lock);
+	for (i = 0; i < m.count && ok; i++) {
+		ok = verified_add(m.entries[i].digest);
+	}
+	xmutex_unlock(&verified_lock);
+	manifest_free(&m);
+	return ok ? m.count : -1;
+}
+
+//1 if the sha256 of the buffer has been accepted
+LUA_API int xlua_verify_buffer(const char *data, int len) {
+	unsigned char digest[SHA256_SIZE];
+	int found;
+	xlua_sha256(data, len, digest);
+	verified_lock_init();
+	xmutex_lock(&verified_lock);
+	found = verified_find(digest);
+	xmutex_unlock(&verified_lock);
+	return found;
+}
+
+LUA_API void xlua_verify_reset(void) {
+	verified_lock_init();
+	xmutex_lock(&verified_lock);
+	free(verified);
+	verified = NULL;
+	verified_capacity = 0;
+	verified_count = 0;
+	xmutex_unlock(&verified_lock);
+}
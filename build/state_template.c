@@ -0,0 +1,194 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include <stdlib.h>
+#include <string.h>
+#include "xlua_thread.h"
+
+/*
+** state templates
+**
+** a worker thread keeps up to `capacity` states that already ran luaopen_xlua, luaopen_i64lib
+** and an optional warmup chunk (e.g. require the modules reachable through package.path or
+** package.preload). the warmup runs before the c# side is attached, so it must not touch CS.
+*/
+
+extern void luaopen_xlua(lua_State *L);
+extern int luaopen_i64lib(lua_State *L);
+
+#define TEMPLATE_ERROR_SIZE 256
+
+typedef struct {
+	lua_State **ready;
+	int capacity;
+	int count;
+	int stop;
+	int failed;
+	int threaded;
+	char *warmup;
+	size_t warmup_len;
+	char *chunkname;
+	char error[TEMPLATE_ERROR_SIZE];
+	xmutex_t lock;
+	xcond_t cond;
+	xthread_t worker;
+} StateTemplate;
+
+static char *template_strdup(const char *s, size_t len) {
+	char *p = (char *)malloc(len + 1);
+	if (p != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+//NULL on failure, the message is kept in tpl->error
+static lua_State *template_build(StateTemplate *tpl) {
+	lua_State *L = luaL_newstate();
+	if (L == NULL) {
+		xmutex_lock(&tpl->lock);
+		strcpy(tpl->error, "not enough memory");
+		xmutex_unlock(&tpl->lock);
+		return NULL;
+	}
+	luaopen_xlua(L);
+	luaopen_i64lib(L);
+	lua_settop(L, 0);
+	if (tpl->warmup != NULL) {
+		if (luaL_loadbuffer(L, tpl->warmup, tpl->warmup_len, tpl->chunkname) || lua_pcall(L, 0, 0, 0)) {
+			const char *msg = lua_tostring(L, -1);
+			xmutex_lock(&tpl->lock);
+			strncpy(tpl->error, msg != NULL ? msg : "warmup failed", TEMPLATE_ERROR_SIZE - 1);
+			tpl->error[TEMPLATE_ERROR_SIZE - 1] = '\0';
+			xmutex_unlock(&tpl->lock);
+			lua_close(L);
+			return NULL;
+		}
+		lua_settop(L, 0);
+	}
+	return L;
+}
+
+static void template_worker(void *ud) {
+	StateTemplate *tpl = (StateTemplate *)ud;
+	lua_State *L;
+	xmutex_lock(&tpl->lock);
+	for (;;) {
+		while (!tpl->stop && tpl->count >= tpl->capacity) {
+			xcond_wait(&tpl->cond, &tpl->lock);
+		}
+		if (tpl->stop) {
+			break;
+		}
+		xmutex_unlock(&tpl->lock);
+		L = template_build(tpl);
+		xmutex_lock(&tpl->lock);
+		if (L == NULL) {
+			//a broken warmup would fail again, leave it to xlua_template_acquire
+			tpl->failed = 1;
+			xcond_broadcast(&tpl->cond);
+			break;
+		}
+		tpl->ready[tpl->count++] = L;
+		xcond_broadcast(&tpl->cond);
+	}
+	xmutex_unlock(&tpl->lock);
+}
+
+LUA_API StateTemplate *xlua_template_new(int capacity, const char *warmup, int warmup_len, const char *chunkname) {
+	StateTemplate *tpl = (StateTemplate *)malloc(sizeof(StateTemplate));
+	if (tpl == NULL) {
+		return NULL;
+	}
+	memset(tpl, 0, sizeof(StateTemplate));
+	tpl->capacity = capacity > 0 ? capacity : 1;
+	tpl->ready = (lua_State **)malloc(sizeof(lua_State *) * tpl->capacity);
+	if (warmup != NULL) {
+		tpl->warmup_len = warmup_len < 0 ? strlen(warmup) : (size_t)warmup_len;
+		tpl->warmup = template_strdup(warmup, tpl->warmup_len);
+		chunkname = chunkname != NULL ? chunkname : "=template";
+		tpl->chunkname = template_strdup(chunkname, strlen(chunkname));
+	}
+	if (tpl->ready == NULL || (warmup != NULL && (tpl->warmup == NULL || tpl->chunkname == NULL))) {
+		free(tpl->ready);
+		free(tpl->warmup);
+		free(tpl->chunkname);
+		free(tpl);
+		return NULL;
+	}
+	xmutex_init(&tpl->lock);
+	xcond_init(&tpl->cond);
+	tpl->threaded = xthread_create(&tpl->worker, template_worker, tpl);
+	return tpl;
+}
+
+//hand out a prepared state, build one on the calling thread when none is ready.
+//returns NULL if the warmup fails, see xlua_template_error
+LUA_API lua_State *xlua_template_acquire(StateTemplate *tpl) {
+	lua_State *L = NULL;
+	xmutex_lock(&tpl->lock);
+	if (tpl->count > 0) {
+		L = tpl->ready[--tpl->count];
+		xcond_broadcast(&tpl->cond);
+	}
+	xmutex_unlock(&tpl->lock);
+	return L != NULL ? L : template_build(tpl);
+}
+
+//block until `count` states are ready, or the worker gave up
+LUA_API int xlua_template_wait(StateTemplate *tpl, int count) {
+	int ready;
+	xmutex_lock(&tpl->lock);
+	if (count > tpl->capacity) {
+		count = tpl->capacity;
+	}
+	while (tpl->threaded && !tpl->failed && tpl->count < count) {
+		xcond_wait(&tpl->cond, &tpl->lock);
+	}
+	ready = tpl->count;
+	xmutex_unlock(&tpl->lock);
+	return ready;
+}
+
+LUA_API int xlua_template_ready(StateTemplate *tpl) {
+	int ready;
+	xmutex_lock(&tpl->lock);
+	ready = tpl->count;
+	xmutex_unlock(&tpl->lock);
+	return ready;
+}
+
+LUA_API const char *xlua_template_error(StateTemplate *tpl) {
+	return tpl->error[0] != '\0' ? tpl->error : NULL;
+}
+
+LUA_API void xlua_template_delete(StateTemplate *tpl) {
+	int i;
+	xmutex_lock(&tpl->lock);
+	tpl->stop = 1;
+	xcond_broadcast(&tpl->cond);
+	xmutex_unlock(&tpl->lock);
+	if (tpl->threaded) {
+		xthread_join(tpl->worker);
+	}
+	for (i = 0; i < tpl->count; i++) {
+		lua_close(tpl->ready[i]);
+	}
+	xcond_destroy(&tpl->cond);
+	xmutex_destroy(&tpl->lock);
+	free(tpl->ready);
+	free(tpl->warmup);
+	free(tpl->chunkname);
+	free(tpl);
+}
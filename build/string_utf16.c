@@ -0,0 +1,221 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+** utf-16 <-> utf-8 string marshaling, lets c# push and read strings without a managed byte[].
+** ascii runs are converted 8 code units at a time with sse2/neon, everything else goes through
+** the scalar codec. invalid sequences become U+FFFD, the same as System.Text.Encoding.UTF8.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF16_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define UTF16_NEON
+#endif
+
+#define REPLACEMENT_CHAR 0xFFFD
+
+//narrows the leading ascii run of s (at most len units) into d, returns its length
+static int ascii_narrow(const uint16_t *s, int len, char *d) {
+	int i = 0;
+#if defined(UTF16_SSE2)
+	const __m128i mask = _mm_set1_epi16((short)0xFF80);
+	for (; i + 8 <= len; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), _mm_setzero_si128())) != 0xFFFF) {
+			break;
+		}
+		_mm_storel_epi64((__m128i *)(d + i), _mm_packus_epi16(v, v));
+	}
+#elif defined(UTF16_NEON)
+	for (; i + 8 <= len; i += 8) {
+		uint16x8_t v = vld1q_u16(s + i);
+		uint64x2_t high = vreinterpretq_u64_u16(vcgtq_u16(v, vdupq_n_u16(0x7F)));
+		if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1)) {
+			break;
+		}
+		vst1_u8((uint8_t *)(d + i), vmovn_u16(v));
+	}
+#endif
+	for (; i < len && s[i] < 0x80; i++) {
+		d[i] = (char)s[i];
+	}
+	return i;
+}
+
+//widens the leading ascii run of s (at most len bytes) into d, d == NULL only measures
+static int ascii_widen(const unsigned char *s, int len, uint16_t *d) {
+	int i = 0;
+#if defined(UTF16_SSE2)
+	for (; i + 8 <= len; i += 8) {
+		__m128i v = _mm_loadl_epi64((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v) != 0) {
+			break;
+		}
+		if (d != NULL) {
+			_mm_storeu_si128((__m128i *)(d + i), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+		}
+	}
+#elif defined(UTF16_NEON)
+	for (; i + 8 <= len; i += 8) {
+		uint8x8_t v = vld1_u8(s + i);
+		if (vget_lane_u64(vreinterpret_u64_u8(vshr_n_u8(v, 7)), 0) != 0) {
+			break;
+		}
+		if (d != NULL) {
+			vst1q_u16(d + i, vmovl_u8(v));
+		}
+	}
+#endif
+	for (; i < len && s[i] < 0x80; i++) {
+		if (d != NULL) {
+			d[i] = s[i];
+		}
+	}
+	return i;
+}
+
+//encodes the non ascii code point at s[*pos] into d (4 bytes of room), returns the bytes written
+static int utf8_encode(const uint16_t *s, int len, int *pos, char *d) {
+	uint32_t c = s[(*pos)++];
+	if (c < 0x800) {
+		d[0] = (char)(0xC0 | (c >> 6));
+		d[1] = (char)(0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c >= 0xD800 && c <= 0xDBFF && *pos < len && s[*pos] >= 0xDC00 && s[*pos] <= 0xDFFF) {
+		c = 0x10000 + ((c - 0xD800) << 10) + (s[(*pos)++] - 0xDC00);
+		d[0] = (char)(0xF0 | (c >> 18));
+		d[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+		d[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+		d[3] = (char)(0x80 | (c & 0x3F));
+		return 4;
+	}
+	if (c >= 0xD800 && c <= 0xDFFF) { //lone surrogate
+		c = REPLACEMENT_CHAR;
+	}
+	d[0] = (char)(0xE0 | (c >> 12));
+	d[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+	d[2] = (char)(0x80 | (c & 0x3F));
+	return 3;
+}
+
+//decodes the non ascii sequence at s[*pos], an invalid one consumes its longest valid prefix
+static uint32_t utf8_decode(const unsigned char *s, size_t len, size_t *pos) {
+	size_t i = *pos;
+	uint32_t c = s[i++];
+	int need;
+	unsigned char lo = 0x80, hi = 0xBF;
+	if (c >= 0xC2 && c <= 0xDF) {
+		need = 1;
+		c &= 0x1F;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		need = 2;
+		if (c == 0xE0) lo = 0xA0;
+		if (c == 0xED) hi = 0x9F; //no surrogates
+		c &= 0x0F;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		need = 3;
+		if (c == 0xF0) lo = 0x90;
+		if (c == 0xF4) hi = 0x8F;
+		c &= 0x07;
+	} else {
+		*pos = i;
+		return REPLACEMENT_CHAR;
+	}
+	while (need-- > 0) {
+		if (i >= len || s[i] < lo || s[i] > hi) {
+			*pos = i;
+			return REPLACEMENT_CHAR;
+		}
+		c = (c << 6) | (s[i++] & 0x3F);
+		lo = 0x80;
+		hi = 0xBF;
+	}
+	*pos = i;
+	return c;
+}
+
+//pushes the utf-8 encoding of s (len utf-16 units)
+LUA_API void xlua_pushutf16(lua_State *L, const uint16_t *s, int len) {
+	luaL_Buffer b;
+	int i = 0;
+	luaL_buffinit(L, &b);
+	while (i < len) {
+		char *d = luaL_prepbuffer(&b);
+		int n = 0;
+		while (i < len && n + 4 <= LUAL_BUFFERSIZE) {
+			if (s[i] < 0x80) {
+				int room = LUAL_BUFFERSIZE - n;
+				int k = ascii_narrow(s + i, len - i < room ? len - i : room, d + n);
+				n += k;
+				i += k;
+			} else {
+				n += utf8_encode(s, len, &i, d + n);
+			}
+		}
+		luaL_addsize(&b, n);
+	}
+	luaL_pushresult(&b);
+}
+
+//decodes the string (or number) at index into buf, returns the utf-16 length, -1 if it is
+//neither. at most size units are written, call again with a larger buf if the result is bigger
+LUA_API int xlua_toutf16(lua_State *L, int index, uint16_t *buf, int size) {
+	size_t len, i = 0;
+	int n = 0;
+	const unsigned char *s = (const unsigned char *)lua_tolstring(L, index, &len);
+	if (s == NULL) {
+		return -1;
+	}
+	if (buf == NULL) {
+		size = 0;
+	}
+	while (i < len) {
+		if (s[i] < 0x80) {
+			size_t left = len - i;
+			int run = left > INT32_MAX ? INT32_MAX : (int)left;
+			int k;
+			if (n < size) {
+				int room = size - n;
+				k = ascii_widen(s + i, run < room ? run : room, buf + n);
+				if (k == room) { //buffer full, measure the rest of the run
+					k += ascii_widen(s + i + k, run - k, NULL);
+				}
+			} else {
+				k = ascii_widen(s + i, run, NULL);
+			}
+			n += k;
+			i += k;
+		} else {
+			uint32_t c = utf8_decode(s, len, &i);
+			if (c >= 0x10000) {
+				if (n + 1 < size) {
+					buf[n] = (uint16_t)(0xD800 + ((c - 0x10000) >> 10));
+					buf[n + 1] = (uint16_t)(0xDC00 + ((c - 0x10000) & 0x3FF));
+				}
+				n += 2;
+			} else {
+				if (n < size) {
+					buf[n] = (uint16_t)c;
+				}
+				n++;
+			}
+		}
+	}
+	return n;
+}
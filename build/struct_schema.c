@@ -0,0 +1,338 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <string.h>
+#include <stdint.h>
+#include "i64lib.h"
+#include "xlua_struct.h"
+
+/*
+** struct schemas, a table <-> blittable buffer copy in one call instead of a rawget and a cast
+** per field. a schema lists the fields of a c# struct: name, offset, type tag and element count
+** (> 1 for an inline array, read from a lua array). a T_STRUCT field points to a schema
+** registered before it, so schemas can nest but never form a cycle.
+**
+** the schema is a userdata kept alive by a registry ref, its uservalue table holds the field
+** names at [i] and the nested schemas at [nfields + i].
+*/
+
+#if LUA_VERSION_NUM == 501
+#define lua_setuservalue(L, idx) lua_setfenv(L, idx)
+#define lua_getuservalue(L, idx) lua_getfenv(L, idx)
+#endif
+
+typedef struct Schema Schema;
+
+typedef struct {
+	int offset;
+	int type;
+	int count;
+	int size; //of one element
+	const Schema *sub;
+} SchemaField;
+
+struct Schema {
+	int size;
+	int depth; //of nesting, to check the stack once
+	int nfields;
+	SchemaField fields[1];
+};
+
+static const int type_sizes[] = {1, 1, 2, 2, 4, 4, 8, 8, 4, 8};
+
+//range of the integer tags up to T_UINT32, 64 bits values are stored as they are
+static const int64_t type_min[] = {INT8_MIN, 0, INT16_MIN, 0, INT32_MIN, 0};
+static const int64_t type_max[] = {INT8_MAX, UINT8_MAX, INT16_MAX, UINT16_MAX, INT32_MAX, UINT32_MAX};
+
+static int schema_tag = 0;
+
+static void push_schema_meta(lua_State *L) {
+	lua_pushlightuserdata(L, &schema_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, &schema_tag);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+}
+
+static const Schema *to_schema(lua_State *L, int idx) {
+	const Schema *s = (const Schema *)lua_touserdata(L, idx);
+	int ok;
+	if (s == NULL || !lua_getmetatable(L, idx)) {
+		return NULL;
+	}
+	push_schema_meta(L);
+	ok = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return ok ? s : NULL;
+}
+
+//registers a schema of size bytes, counts and subs may be NULL (no arrays, no nested schema).
+//subs[i] is the ref of the schema of a T_STRUCT field. returns the ref of the schema (release it
+//with luaL_unref), -1 if a field is invalid or does not fit in size
+LUA_API int xlua_schema_register(lua_State *L, int size, int nfields, const char **names, const int *offsets,
+		const int *types, const int *counts, const int *subs) {
+	int i, top = lua_gettop(L);
+	Schema *s;
+	if (size <= 0 || nfields <= 0 || names == NULL || offsets == NULL || types == NULL) {
+		return -1;
+	}
+	s = (Schema *)lua_newuserdata(L, sizeof(Schema) + (nfields - 1) * sizeof(SchemaField));
+	s->size = size;
+	s->depth = 1;
+	s->nfields = nfields;
+	lua_createtable(L, nfields * 2, 0);
+	for (i = 0; i < nfields; i++) {
+		SchemaField *f = &s->fields[i];
+		f->offset = offsets[i];
+		f->type = types[i];
+		f->count = counts == NULL ? 1 : counts[i];
+		f->sub = NULL;
+		if (f->type == T_STRUCT) {
+			if (subs == NULL) {
+				goto invalid;
+			}
+			lua_rawgeti(L, LUA_REGISTRYINDEX, subs[i]);
+			f->sub = to_schema(L, -1);
+			if (f->sub == NULL) {
+				goto invalid;
+			}
+			f->size = f->sub->size;
+			if (f->sub->depth + 1 > s->depth) {
+				s->depth = f->sub->depth + 1;
+			}
+			lua_rawseti(L, -2, nfields + i + 1);
+		} else if (f->type >= T_INT8 && f->type <= T_DOUBLE) {
+			f->size = type_sizes[f->type];
+		} else {
+			goto invalid;
+		}
+		if (names[i] == NULL || f->offset < 0 || f->count < 1 || (int64_t)f->offset + (int64_t)f->size * f->count > size) {
+			goto invalid;
+		}
+		lua_pushstring(L, names[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setuservalue(L, -2);
+	push_schema_meta(L);
+	lua_setmetatable(L, -2);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+invalid:
+	lua_settop(L, top);
+	return -1;
+}
+
+static int to_int64(lua_State *L, int idx, int64_t *v) {
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		lua_Number n;
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, idx)) {
+			*v = (int64_t)lua_tointeger(L, idx);
+			return 1;
+		}
+#endif
+		n = lua_tonumber(L, idx);
+		if (n >= -9223372036854775808.0 && n < 9223372036854775808.0 && n == (lua_Number)(int64_t)n) {
+			*v = (int64_t)n;
+			return 1;
+		}
+		return 0;
+	}
+	if (lua_isint64(L, idx) || lua_isuint64(L, idx)) {
+		*v = lua_toint64(L, idx);
+		return 1;
+	}
+	return 0;
+}
+
+#define STORE(ctype, v) do { ctype v_ = (ctype)(v); memcpy(p, &v_, sizeof(ctype)); } while (0)
+#define LOAD(ctype, push) do { ctype v_; memcpy(&v_, p, sizeof(ctype)); push(L, v_); } while (0)
+
+//the value on the top into one element of type at p. fails (leaving the c# cast to the
+//regular casters) on a value that is not a number or does not fit the type exactly
+static int store_primitive(lua_State *L, int type, char *p) {
+	int64_t v;
+	if (type == T_FLOAT || type == T_DOUBLE) {
+		if (lua_type(L, -1) != LUA_TNUMBER) {
+			return 0;
+		}
+		if (type == T_FLOAT) {
+			STORE(float, lua_tonumber(L, -1));
+		} else {
+			STORE(double, lua_tonumber(L, -1));
+		}
+		return 1;
+	}
+	if (!to_int64(L, -1, &v)) {
+		return 0;
+	}
+	if (type <= T_UINT32 && (v < type_min[type] || v > type_max[type])) {
+		return 0;
+	}
+	switch (type) {
+		case T_INT8: STORE(int8_t, v); break;
+		case T_UINT8: STORE(uint8_t, v); break;
+		case T_INT16: STORE(int16_t, v); break;
+		case T_UINT16: STORE(uint16_t, v); break;
+		case T_INT32: STORE(int32_t, v); break;
+		case T_UINT32: STORE(uint32_t, v); break;
+		default: STORE(int64_t, v); break; //T_INT64 and T_UINT64
+	}
+	return 1;
+}
+
+static void push_primitive(lua_State *L, int type, const char *p) {
+	switch (type) {
+		case T_INT8: LOAD(int8_t, lua_pushinteger); break;
+		case T_UINT8: LOAD(uint8_t, lua_pushinteger); break;
+		case T_INT16: LOAD(int16_t, lua_pushinteger); break;
+		case T_UINT16: LOAD(uint16_t, lua_pushinteger); break;
+		case T_INT32: LOAD(int32_t, lua_pushinteger); break;
+#if LUA_VERSION_NUM >= 503
+		case T_UINT32: LOAD(uint32_t, lua_pushinteger); break;
+#else
+		case T_UINT32: LOAD(uint32_t, lua_pushnumber); break;
+#endif
+		case T_INT64: LOAD(int64_t, lua_pushint64); break;
+		case T_UINT64: LOAD(uint64_t, lua_pushuint64); break;
+		case T_FLOAT: LOAD(float, lua_pushnumber); break;
+		default: LOAD(double, lua_pushnumber); break;
+	}
+}
+
+static int table_tostruct(lua_State *L, int t, const Schema *s, int uv, char *buf);
+static void struct_totable(lua_State *L, const Schema *s, int uv, const char *buf);
+
+//the value on the top into one element of field i of s
+static int store_element(lua_State *L, const Schema *s, int uv, int i, char *p) {
+	int ok;
+	if (s->fields[i].type != T_STRUCT) {
+		return store_primitive(L, s->fields[i].type, p);
+	}
+	if (!lua_istable(L, -1)) {
+		return 0;
+	}
+	lua_rawgeti(L, uv, s->nfields + i + 1);
+	lua_getuservalue(L, -1);
+	ok = table_tostruct(L, lua_gettop(L) - 2, s->fields[i].sub, lua_gettop(L), p);
+	lua_pop(L, 2);
+	return ok;
+}
+
+//t and uv are absolute indices. nil fields and nil array elements are left as they are in buf
+static int table_tostruct(lua_State *L, int t, const Schema *s, int uv, char *buf) {
+	int i, j;
+	for (i = 0; i < s->nfields; i++) {
+		const SchemaField *f = &s->fields[i];
+		int ok = 1;
+		lua_rawgeti(L, uv, i + 1);
+		lua_rawget(L, t);
+		if (lua_isnil(L, -1)) {
+			ok = 1;
+		} else if (f->count == 1) {
+			ok = store_element(L, s, uv, i, buf + f->offset);
+		} else if (lua_istable(L, -1)) {
+			for (j = 0; ok && j < f->count; j++) {
+				lua_rawgeti(L, -1, j + 1);
+				ok = lua_isnil(L, -1) || store_element(L, s, uv, i, buf + f->offset + j * f->size);
+				lua_pop(L, 1);
+			}
+		} else {
+			ok = 0;
+		}
+		lua_pop(L, 1);
+		if (!ok) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void push_element(lua_State *L, const Schema *s, int uv, int i, const char *p) {
+	if (s->fields[i].type != T_STRUCT) {
+		push_primitive(L, s->fields[i].type, p);
+		return;
+	}
+	lua_rawgeti(L, uv, s->nfields + i + 1);
+	lua_getuservalue(L, -1);
+	struct_totable(L, s->fields[i].sub, lua_gettop(L), p);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+//[-0, +1], uv is an absolute index. each level takes 6 slots at most
+static void struct_totable(lua_State *L, const Schema *s, int uv, const char *buf) {
+	int i, j;
+	lua_createtable(L, 0, s->nfields);
+	for (i = 0; i < s->nfields; i++) {
+		const SchemaField *f = &s->fields[i];
+		lua_rawgeti(L, uv, i + 1);
+		if (f->count == 1) {
+			push_element(L, s, uv, i, buf + f->offset);
+		} else {
+			lua_createtable(L, f->count, 0);
+			for (j = 0; j < f->count; j++) {
+				push_element(L, s, uv, i, buf + f->offset + j * f->size);
+				lua_rawseti(L, -2, j + 1);
+			}
+		}
+		lua_rawset(L, -3);
+	}
+}
+
+//fills buf (the size of the schema) from the table at index, fields missing from the table are
+//left untouched. returns 0 if index is not a table or a field has a value of another type, buf
+//may be partly written then
+LUA_API int xlua_table_tostruct(lua_State *L, int index, int schema_ref, void *buf) {
+	const Schema *s;
+	int ok;
+	if (!lua_istable(L, index)) {
+		return 0;
+	}
+	if (index < 0 && index > LUA_REGISTRYINDEX) {
+		index = lua_gettop(L) + index + 1;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, schema_ref);
+	s = to_schema(L, -1);
+	if (s == NULL || !lua_checkstack(L, s->depth * 6)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_getuservalue(L, -1);
+	ok = table_tostruct(L, index, s, lua_gettop(L), (char *)buf);
+	lua_pop(L, 2);
+	return ok;
+}
+
+//pushes a table built from buf, with the metatable at meta_ref unless it is -1. returns 0 and
+//pushes nothing if schema_ref is not a schema or the stack can not grow
+LUA_API int xlua_struct_totable(lua_State *L, int schema_ref, const void *buf, int meta_ref) {
+	const Schema *s;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, schema_ref);
+	s = to_schema(L, -1);
+	if (s == NULL || !lua_checkstack(L, s->depth * 6)) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_getuservalue(L, -1);
+	struct_totable(L, s, lua_gettop(L), (const char *)buf);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	if (meta_ref != -1) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, meta_ref);
+		lua_setmetatable(L, -2);
+	}
+	return 1;
+}
@@ -0,0 +1,374 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include <string.h>
+#include <stdint.h>
+
+#if USING_LUAJIT
+#include "lj_obj.h"
+#include "lj_tab.h"
+#else
+#include "lstate.h"
+#include "ltable.h"
+#endif
+
+/*
+** bulk table export, lets c# read a whole table in one call instead of a lua_next plus a few
+** lua_type/lua_tonumber/lua_tolstring calls per entry.
+**
+** the table slots are walked directly, array part first, then the hash part. the cursor is a
+** slot number so a large table can be read in several batches without rescanning it, as with
+** lua_next the table must not get new keys between two batches.
+**
+** a batch is a sequence of records:
+**   [ExportRecord][key string bytes][value string bytes][padding to 8 bytes]
+** numbers, integers and booleans live in the record, strings follow it. values of any other
+** type (tables, functions, userdata...) get EXPORT_OTHER with their lua type in the payload,
+** c# reads them the usual way.
+*/
+
+#define EXPORT_NIL     0
+#define EXPORT_BOOLEAN 1
+#define EXPORT_INTEGER 2
+#define EXPORT_NUMBER  3
+#define EXPORT_STRING  4
+#define EXPORT_OTHER   5
+
+typedef union {
+	int64_t i;
+	double d;
+} ExportPayload;
+
+typedef struct {
+	uint8_t key_tag;
+	uint8_t value_tag;
+	uint16_t reserved;
+	uint32_t size; //whole record, strings and padding included
+	uint32_t key_len;
+	uint32_t value_len;
+	ExportPayload key;
+	ExportPayload value;
+} ExportRecord;
+
+typedef struct {
+	int tag;
+	ExportPayload payload;
+	const char *str;
+	size_t len;
+} ExportValue;
+
+#if USING_LUAJIT
+
+#define table_asize(t) ((int)(t)->asize)
+#define table_nsize(t) ((int)(t)->hmask + 1)
+#define table_aslot(t, i) arrayslot(t, i)
+#define array_key(i) (i) //luajit keeps t[0] in the array part
+#define table_node(t, i) (&noderef((t)->node)[i])
+#define node_val(n) (&(n)->val)
+#define node_key(n, tmp) (&(n)->key)
+typedef cTValue ExportTValue;
+typedef GCtab ExportTable;
+
+static void export_tvalue(ExportTValue *o, ExportValue *v) {
+	if (tvisnil(o)) {
+		v->tag = EXPORT_NIL;
+	} else if (tvisbool(o)) {
+		v->tag = EXPORT_BOOLEAN;
+		v->payload.i = tvistrue(o);
+	} else if (tvisint(o)) {
+		v->tag = EXPORT_INTEGER;
+		v->payload.i = intV(o);
+	} else if (tvisnum(o)) {
+		v->tag = EXPORT_NUMBER;
+		v->payload.d = numV(o);
+	} else if (tvisstr(o)) {
+		v->tag = EXPORT_STRING;
+		v->str = strVdata(o);
+		v->len = strV(o)->len;
+	} else {
+		v->tag = EXPORT_OTHER;
+		v->payload.i = tvistab(o) ? LUA_TTABLE : tvisfunc(o) ? LUA_TFUNCTION : tvisthread(o) ? LUA_TTHREAD
+			: tvislightud(o) ? LUA_TLIGHTUSERDATA : LUA_TUSERDATA;
+	}
+}
+
+#else
+
+#if LUA_VERSION_NUM >= 504
+#define table_asize(t) ((int)luaH_realasize(t))
+#else
+#define table_asize(t) ((int)(t)->sizearray)
+#endif
+#define table_nsize(t) ((int)sizenode(t))
+#define table_aslot(t, i) (&(t)->array[i])
+#define array_key(i) ((i) + 1)
+#define table_node(t, i) gnode(t, i)
+#define node_val(n) gval(n)
+#if LUA_VERSION_NUM >= 504
+#define node_key(n, tmp) node_key54(n, tmp)
+static const TValue *node_key54(const Node *n, TValue *tmp) {
+	//5.4 keeps the key fields inline in the node, getnodekey without the liveness check
+	tmp->value_ = n->u.key_val;
+	tmp->tt_ = n->u.key_tt;
+	return tmp;
+}
+#elif LUA_VERSION_NUM == 503
+#define node_key(n, tmp) gkey(n)
+#else
+#define node_key(n, tmp) ((const TValue *)key2tval(n))
+#endif
+typedef const TValue ExportTValue;
+typedef Table ExportTable;
+
+static void export_tvalue(ExportTValue *o, ExportValue *v) {
+	if (ttisnil(o)) { //empty slots and dead keys too
+		v->tag = EXPORT_NIL;
+	} else if (ttisboolean(o)) {
+		v->tag = EXPORT_BOOLEAN;
+#if LUA_VERSION_NUM >= 504
+		v->payload.i = ttistrue(o);
+#else
+		v->payload.i = bvalue(o) != 0;
+#endif
+	}
+#if LUA_VERSION_NUM >= 503
+	else if (ttisinteger(o)) {
+		v->tag = EXPORT_INTEGER;
+		v->payload.i = ivalue(o);
+	} else if (ttisfloat(o)) {
+		v->tag = EXPORT_NUMBER;
+		v->payload.d = fltvalue(o);
+	}
+#else
+	else if (ttisnumber(o)) {
+		v->tag = EXPORT_NUMBER;
+		v->payload.d = nvalue(o);
+	}
+#endif
+	else if (ttisstring(o)) {
+		v->tag = EXPORT_STRING;
+		v->str = svalue(o);
+#if LUA_VERSION_NUM >= 503
+		v->len = vslen(o);
+#else
+		v->len = tsvalue(o)->len;
+#endif
+	} else {
+		v->tag = EXPORT_OTHER;
+#if LUA_VERSION_NUM >= 504
+		v->payload.i = ttype(o);
+#elif LUA_VERSION_NUM == 503
+		v->payload.i = ttnov(o);
+#else
+		v->payload.i = ttype(o);
+#endif
+	}
+}
+
+#endif
+
+static size_t record_size(const ExportValue *k, const ExportValue *v) {
+	size_t size = sizeof(ExportRecord) + (k->tag == EXPORT_STRING ? k->len : 0) + (v->tag == EXPORT_STRING ? v->len : 0);
+	return (size + 7) & ~(size_t)7;
+}
+
+static void write_record(char *p, size_t size, const ExportValue *k, const ExportValue *v) {
+	ExportRecord r;
+	size_t klen = k->tag == EXPORT_STRING ? k->len : 0;
+	size_t vlen = v->tag == EXPORT_STRING ? v->len : 0;
+	r.key_tag = (uint8_t)k->tag;
+	r.value_tag = (uint8_t)v->tag;
+	r.reserved = 0;
+	r.size = (uint32_t)size;
+	r.key_len = (uint32_t)klen;
+	r.value_len = (uint32_t)vlen;
+	r.key = k->payload;
+	r.value = v->payload;
+	memcpy(p, &r, sizeof(r));
+	if (klen > 0) {
+		memcpy(p + sizeof(r), k->str, klen);
+	}
+	if (vlen > 0) {
+		memcpy(p + sizeof(r) + klen, v->str, vlen);
+	}
+	memset(p + sizeof(r) + klen + vlen, 0, size - sizeof(r) - klen - vlen);
+}
+
+//writes the entries of the table at index into buf, starting at slot *cursor (0 for the first
+//batch), until buf is full. returns the bytes written and moves *cursor past them, it is -1
+//once the whole table has been read. if the next record alone does not fit in size bytes the
+//result is minus the size it needs, -2 if index is not a table
+LUA_API int xlua_table_export(lua_State *L, int index, int *cursor, char *buf, int size) {
+	int asize, nsize, slot, used = 0;
+	const ExportTable *t;
+	if (!lua_istable(L, index)) {
+		return -2;
+	}
+	t = (const ExportTable *)lua_topointer(L, index);
+	asize = table_asize(t);
+	nsize = table_nsize(t);
+	for (slot = *cursor < 0 ? asize + nsize : *cursor; slot < asize + nsize; slot++) {
+		ExportValue k, v;
+		size_t rsize;
+		k.str = v.str = NULL;
+		k.len = v.len = 0;
+		k.payload.i = v.payload.i = 0;
+		if (slot < asize) {
+			export_tvalue(table_aslot(t, slot), &v);
+			if (v.tag == EXPORT_NIL) {
+				continue;
+			}
+			k.tag = EXPORT_INTEGER;
+			k.payload.i = array_key(slot);
+		} else {
+#if !USING_LUAJIT && LUA_VERSION_NUM >= 504
+			TValue tmp;
+#else
+			int tmp;
+#endif
+			const Node *n = table_node(t, slot - asize);
+			export_tvalue(node_val(n), &v);
+			if (v.tag == EXPORT_NIL) {
+				continue;
+			}
+			export_tvalue(node_key(n, &tmp), &k);
+			(void)tmp;
+		}
+		rsize = record_size(&k, &v);
+		if ((size_t)(size - used) < rsize) {
+			if (used == 0) {
+				*cursor = slot;
+				return rsize > INT32_MAX ? INT32_MIN : -(int)rsize;
+			}
+			break;
+		}
+		write_record(buf + used, rsize, &k, &v);
+		used += (int)rsize;
+	}
+	*cursor = slot < asize + nsize ? slot : -1;
+	return used;
+}
+
+//a positive integer key, as lua_next would hand it to a lua_isinteger/IS_INT_EQUIVALENT check
+static int positive_key(const ExportValue *k, size_t *i) {
+	if (k->tag == EXPORT_INTEGER && k->payload.i > 0) {
+		*i = (size_t)k->payload.i;
+		return 1;
+	}
+	if (k->tag == EXPORT_NUMBER && k->payload.d >= 1 && k->payload.d <= 9007199254740992.0 && k->payload.d == (double)(int64_t)k->payload.d) {
+		*i = (size_t)k->payload.d;
+		return 1;
+	}
+	return 0;
+}
+
+//counts the entries of the table at index from its slots, without lua_next. returns 1 if its
+//keys are exactly 1..count (the empty table too), 0 otherwise or if index is not a table
+LUA_API int xlua_table_shape(lua_State *L, int index, size_t *count) {
+	int asize, nsize, slot, seq = 1;
+	size_t n = 0, max = 0, i;
+	const ExportTable *t;
+	*count = 0;
+	if (!lua_istable(L, index)) {
+		return 0;
+	}
+	t = (const ExportTable *)lua_topointer(L, index);
+	asize = table_asize(t);
+	nsize = table_nsize(t);
+	for (slot = 0; slot < asize; slot++) {
+		ExportValue v;
+		export_tvalue(table_aslot(t, slot), &v);
+		if (v.tag != EXPORT_NIL) {
+			n++;
+			if (array_key(slot) > 0) {
+				max = (size_t)array_key(slot);
+			} else {
+				seq = 0;
+			}
+		}
+	}
+	for (slot = 0; slot < nsize; slot++) {
+#if !USING_LUAJIT && LUA_VERSION_NUM >= 504
+		TValue tmp;
+#else
+		int tmp;
+#endif
+		const Node *node = table_node(t, slot);
+		ExportValue k, v;
+		k.len = v.len = 0;
+		export_tvalue(node_val(node), &v);
+		if (v.tag == EXPORT_NIL) {
+			continue;
+		}
+		n++;
+		export_tvalue(node_key(node, &tmp), &k);
+		(void)tmp;
+		if (seq && positive_key(&k, &i)) {
+			max = i > max ? i : max;
+		} else {
+			seq = 0;
+		}
+	}
+	*count = n;
+	return seq && max == n;
+}
+
+//the number at t[i], read in place when it is in the array part
+static int number_at(lua_State *L, int index, const ExportTable *t, int asize, int i, double *n) {
+	int slot = i - array_key(0);
+	if (slot < asize) {
+		ExportValue v;
+		export_tvalue(table_aslot(t, slot), &v);
+		if (v.tag == EXPORT_INTEGER) {
+			*n = (double)v.payload.i;
+			return 1;
+		}
+		*n = v.payload.d;
+		return v.tag == EXPORT_NUMBER;
+	} else {
+		int isnum;
+		lua_rawgeti(L, index, i);
+		isnum = lua_type(L, -1) == LUA_TNUMBER;
+		*n = isnum ? (double)lua_tonumber(L, -1) : 0;
+		lua_pop(L, 1);
+		return isnum;
+	}
+}
+
+/*
+** t[1..count] copied into a c array, numbers only. returns how many were copied, it stops
+** before the first element that is not a number (or not an int32 for ints) so the caller can
+** fall back to its regular per element conversion from there.
+*/
+
+#define TABLE_TO_ARRAY(name, type, check) \
+LUA_API int xlua_table_to##name(lua_State *L, int index, type *buf, int count) { \
+	int i, asize; \
+	const ExportTable *t; \
+	if (!lua_istable(L, index)) { \
+		return 0; \
+	} \
+	t = (const ExportTable *)lua_topointer(L, index); \
+	asize = table_asize(t); \
+	for (i = 0; i < count; i++) { \
+		double n; \
+		if (!number_at(L, index, t, asize, i + 1, &n) || !(check)) { \
+			return i; \
+		} \
+		buf[i] = (type)n; \
+	} \
+	return count; \
+}
+
+TABLE_TO_ARRAY(doubles, double, 1)
+TABLE_TO_ARRAY(floats, float, 1)
+TABLE_TO_ARRAY(ints, int32_t, n >= INT32_MIN && n <= INT32_MAX && n == (double)(int32_t)n)
@@ -13,13 +13,21 @@
 #include "lauxlib.h"
 
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "i64lib.h"
+#include "xlua_struct.h"
 
 #if USING_LUAJIT
 #include "lj_obj.h"
 #else
 #include "lstate.h"
+#include "ltable.h"
+#endif
+
+#if LUA_VERSION_NUM == 501
+#define lua_setuservalue(L, idx) lua_setfenv(L, idx)
+#define lua_getuservalue(L, idx) lua_getfenv(L, idx)
 #endif
 
 /*
@@ -39,6 +47,31 @@ LUA_API int xlua_get_registry_index() {
 	return LUA_REGISTRYINDEX;
 }
 
+//releases the registry refs of n finalized bridge objects in one call. for a delegate the
+//registry[func] = ref entry used to share bridges is cleared too, if it still maps to this ref
+LUA_API void xlua_unref_batch(lua_State *L, const int *refs, const int *is_delegate, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		if (is_delegate[i]) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, refs[i]);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+			} else {
+				lua_pushvalue(L, -1);
+				lua_rawget(L, LUA_REGISTRYINDEX);
+				if (lua_type(L, -1) == LUA_TNUMBER && (int)lua_tointeger(L, -1) == refs[i]) {
+					lua_pop(L, 1);
+					lua_pushnil(L);
+					lua_rawset(L, LUA_REGISTRYINDEX);
+				} else { //another bridge took the function since
+					lua_pop(L, 2);
+				}
+			}
+		}
+		luaL_unref(L, LUA_REGISTRYINDEX, refs[i]);
+	}
+}
+
 LUA_API int xlua_get_lib_version() {
 	return 105;
 }
@@ -201,8 +234,136 @@ LUA_API void xlua_pushlstring (lua_State *L, const char *s, int len) {
 	lua_pushlstring(L, s, len);
 }
 
+/*
+** string identity, lets c# cache the System.String of a short (interned) string by address.
+** a cached string must stay alive, its address could otherwise be reused by a new string
+** before any gc callback could tell c#, so every short string handed out is anchored in a
+** per state table. the table is dropped when it reaches its limit or on xlua_strid_reset,
+** which starts a new epoch: c# drops the entries cached in an older one.
+*/
+
+typedef struct {
+	unsigned int epoch;
+	int count;
+	int limit;
+} StrIdState;
+
+static int strid_tag = 0;
+
+#define STRID_DEFAULT_LIMIT 4096
+
+//pushes the anchor table
+static StrIdState *strid_state(lua_State *L) {
+	StrIdState *st;
+	lua_pushlightuserdata(L, &strid_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	st = (StrIdState *)lua_touserdata(L, -1);
+	if (st == NULL) {
+		lua_pop(L, 1);
+		st = (StrIdState *)lua_newuserdata(L, sizeof(StrIdState));
+		st->epoch = 1;
+		st->count = 0;
+		st->limit = STRID_DEFAULT_LIMIT;
+		lua_newtable(L);
+		lua_setuservalue(L, -2);
+		lua_pushlightuserdata(L, &strid_tag);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_getuservalue(L, -1);
+	lua_remove(L, -2);
+	return st;
+}
+
+//st is the state of the anchor table on the top
+static void strid_flush(lua_State *L, StrIdState *st) {
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, &strid_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	lua_getuservalue(L, -1);
+	lua_remove(L, -2);
+	st->epoch++;
+	st->count = 0;
+}
+
+//returns the address identifying the string at index (NULL if it is not a string) with its
+//cached hash (0 if a long string was never hashed), byte length and epoch. only short strings
+//are interned and anchored, the address of a long one identifies that object only
+LUA_API const void *xlua_tostrid(lua_State *L, int index, unsigned int *hash, int *len, int *isshort, unsigned int *epoch) {
+	size_t l;
+	const char *s;
+	StrIdState *st;
+	if (lua_type(L, index) != LUA_TSTRING) {
+		return NULL;
+	}
+	index = lua_absindex(L, index);
+	s = lua_tolstring(L, index, &l);
+	*len = (int)l;
+#if USING_LUAJIT
+	*hash = ((const GCstr *)s - 1)->hash;
+	*isshort = 1;
+#elif LUA_VERSION_NUM == 501
+	*hash = ((const TString *)s - 1)->tsv.hash;
+	*isshort = 1;
+#else
+	{
+#if LUA_VERSION_NUM == 503
+		const TString *ts = (const TString *)(s - sizeof(UTString));
+		*isshort = ts->tt == LUA_TSHRSTR;
+#else
+		const TString *ts = (const TString *)(s - offsetof(TString, contents));
+		*isshort = ts->tt == LUA_VSHRSTR;
+#endif
+		*hash = (*isshort || ts->extra) ? ts->hash : 0;
+	}
+#endif
+	st = strid_state(L);
+	if (*isshort) {
+		lua_pushvalue(L, index);
+		lua_rawget(L, -2);
+		if (lua_isnil(L, -1)) {
+			if (st->count >= st->limit) {
+				lua_pop(L, 1);
+				strid_flush(L, st);
+				lua_pushnil(L);
+			}
+			lua_pushvalue(L, index);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -4);
+			st->count++;
+		}
+		lua_pop(L, 1);
+	}
+	*epoch = st->epoch;
+	lua_pop(L, 1);
+	return s;
+}
+
+//drops the anchored strings and starts a new epoch, limit > 0 also sets how many strings
+//are anchored before an automatic reset
+LUA_API unsigned int xlua_strid_reset(lua_State *L, int limit) {
+	StrIdState *st = strid_state(L);
+	strid_flush(L, st);
+	if (limit > 0) {
+		st->limit = limit;
+	}
+	lua_pop(L, 1);
+	return st->epoch;
+}
+
+extern int xlua_bytecode_cache_load(lua_State *L, const char *buff, size_t size, const char *name);
+
 LUALIB_API int xluaL_loadbuffer (lua_State *L, const char *buff, int size,
                                 const char *name) {
+	int status = xlua_bytecode_cache_load(L, buff, (size_t)size, name);
+	return status >= 0 ? status : luaL_loadbuffer(L, buff, size, name);
+}
+
+//xluaL_loadbuffer that never uses the bytecode cache, the chunk is compiled from buff itself
+LUALIB_API int xluaL_loadbuffer_nocache (lua_State *L, const char *buff, int size,
+                                const char *name) {
 	return luaL_loadbuffer(L, buff, size, name);
 }
 
@@ -310,6 +471,104 @@ LUA_API int xlua_psettable_bypath(lua_State* L, int idx, const char *path) {
     return lua_pcall(L, 3, 0, 0);
 }
 
+/*
+** compiled paths, the bypath walk with the path split and its keys interned once. a compiled
+** path is a c closure kept by a registry ref, upvalue 1 is the segment count, 2 the whole path
+** (for errors), the keys follow. intermediate tables are not cached, a script may replace them
+** any time and checking a cached one costs the same lookups as the walk itself.
+*/
+
+#define PATH_MAX_SEGMENTS 250
+
+//(root) returns root.k1.k2..., nil if it hits a non table before the last key. (root, value) sets it
+static int c_lua_path(lua_State* L) {
+	int i, n = (int)lua_tointeger(L, lua_upvalueindex(1));
+	int set = lua_gettop(L) > 1;
+	lua_pushvalue(L, 1);
+	for (i = 1; i <= n; i++) {
+		lua_pushvalue(L, lua_upvalueindex(i + 2));
+		if (set && i == n) {
+			lua_pushvalue(L, 2);
+			lua_settable(L, -3);
+			return 0;
+		}
+		lua_gettable(L, -2);
+		if (i < n && lua_type(L, -1) != LUA_TTABLE) {
+			if (set) {
+				return luaL_error(L, "can not set value to %s", lua_tostring(L, lua_upvalueindex(2)));
+			}
+			lua_pushnil(L);
+			return 1;
+		}
+		lua_remove(L, -2);
+	}
+	return 1;
+}
+
+//returns the ref of the compiled path (release it with lua_unref), -1 if it has too many segments
+LUA_API int xlua_path_compile(lua_State* L, const char *path) {
+	int n = 0;
+	const char *pos = NULL;
+	if (!lua_checkstack(L, PATH_MAX_SEGMENTS + 3)) {
+		return -1;
+	}
+	lua_pushinteger(L, 0);
+	lua_pushstring(L, path);
+	do {
+		if (n == PATH_MAX_SEGMENTS) {
+			lua_pop(L, n + 2);
+			return -1;
+		}
+		pos = strchr(path, '.');
+		lua_pushlstring(L, path, NULL == pos ? strlen(path) : (size_t)(pos - path));
+		path = pos + 1;
+		n++;
+	} while (pos);
+	lua_pushinteger(L, n);
+	lua_replace(L, -(n + 3));
+	lua_pushcclosure(L, c_lua_path, n + 2);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+LUA_API int xlua_pgettable_bypathref(lua_State* L, int idx, int path_ref) {
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, path_ref);
+	lua_pushvalue(L, idx);
+	return lua_pcall(L, 1, 1, 0);
+}
+
+LUA_API int xlua_psettable_bypathref(lua_State* L, int idx, int path_ref) {
+	int top = lua_gettop(L);
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, path_ref);
+	lua_pushvalue(L, idx);
+	lua_pushvalue(L, top);
+	lua_remove(L, top);
+	return lua_pcall(L, 2, 0, 0);
+}
+
+static int c_lua_gettable_bypathrefs(lua_State* L) {
+	const int *path_refs = (const int *)lua_touserdata(L, 2);
+	int i, n = (int)lua_tointeger(L, 3);
+	luaL_checkstack(L, n + 2, "too many paths");
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, path_refs[i]);
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 1);
+	}
+	return n;
+}
+
+//pushes the values of n compiled paths in one pcall
+LUA_API int xlua_pgettable_bypathrefs(lua_State* L, int idx, const int *path_refs, int n) {
+	idx = lua_absindex(L, idx);
+	lua_pushcfunction(L, c_lua_gettable_bypathrefs);
+	lua_pushvalue(L, idx);
+	lua_pushlightuserdata(L, (void *)path_refs);
+	lua_pushinteger(L, n);
+	return lua_pcall(L, 3, LUA_MULTRET, 0);
+}
+
 static int c_lua_getglobal(lua_State* L) {
 	lua_getglobal(L, lua_tostring(L, 1));
 	return 1;
@@ -803,6 +1062,28 @@ LUA_API void xlua_push_csharp_wrapper(lua_State* L, int wrapperid)
     lua_pushcclosure(L, csharp_function_wrapper_wrapper, 2);
 }
 
+//1 for a GEN_CODE_MINIMIZE wrapper, 2 for a c# function without extra upvalues, 0 otherwise
+LUA_API int xlua_csharp_callee(lua_State *L, int idx, int *wrapperid, lua_CFunction *fn) {
+	lua_CFunction f = lua_tocfunction(L, idx);
+	if (f == csharp_function_wrapper_wrapper) {
+		lua_getupvalue(L, idx, 1);
+		*wrapperid = xlua_tointeger(L, -1);
+		lua_pop(L, 1);
+		return 1;
+	}
+	if (f == csharp_function_wrap) {
+		if (lua_getupvalue(L, idx, 3) != NULL) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		lua_getupvalue(L, idx, 1);
+		*fn = lua_tocfunction(L, -1);
+		lua_pop(L, 1);
+		return 2;
+	}
+	return 0;
+}
+
 LUALIB_API int xlua_upvalueindex(int n) {
 	return lua_upvalueindex(2 + n);
 }
@@ -1096,17 +1377,6 @@ LUA_API int xlua_is_eq_str(lua_State *L, int idx, const char* str, int str_len)
 	}
 }
 
-#define T_INT8   0
-#define T_UINT8  1
-#define T_INT16  2
-#define T_UINT16 3
-#define T_INT32  4
-#define T_UINT32 5
-#define T_INT64  6
-#define T_UINT64 7
-#define T_FLOAT  8
-#define T_DOUBLE 9
-
 #define DIRECT_ACCESS(type, push_func, to_func) \
 int xlua_struct_get_##type(lua_State *L) {\
 	CSharpStruct *css = (CSharpStruct *)lua_touserdata(L, 1);\
@@ -1225,22 +1495,307 @@ LUA_API void* xlua_gl(lua_State *L) {
 	return G(L);
 }
 
+#if !USING_LUAJIT && LUA_VERSION_NUM >= 503
+/*
+** table.new / table.clear, same semantics as the luajit extensions
+*/
+static int table_new(lua_State *L) {
+	int narr = (int)luaL_checkinteger(L, 1);
+	int nrec = (int)luaL_optinteger(L, 2, 0);
+	lua_createtable(L, narr > 0 ? narr : 0, nrec > 0 ? nrec : 0);
+	return 1;
+}
+
+#ifdef isdummy
+#define table_isdummy(t) isdummy(t)
+#else
+//lua 5.3.3 keeps its dummy node private, take it from an empty table
+static const Node *dummynode = NULL;
+#define table_isdummy(t) ((t)->node == dummynode)
+#endif
+
+//keep the array part and the node vector, only drop the contents
+static int table_clear(lua_State *L) {
+	Table *t;
+	unsigned int i, size;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	t = (Table *)lua_topointer(L, 1);
+#if LUA_VERSION_NUM >= 504
+	size = luaH_realasize(t);
+	for (i = 0; i < size; i++) {
+		setempty(&t->array[i]);
+	}
+#else
+	size = t->sizearray;
+	for (i = 0; i < size; i++) {
+		setnilvalue(&t->array[i]);
+	}
+#endif
+	if (!table_isdummy(t)) {
+		size = sizenode(t);
+		for (i = 0; i < size; i++) {
+			Node *n = gnode(t, i);
+			gnext(n) = 0;
+#if LUA_VERSION_NUM >= 504
+			setnilkey(n);
+			setempty(gval(n));
+#else
+			setnilvalue(wgkey(n));
+			setnilvalue(gval(n));
+#endif
+		}
+		t->lastfree = gnode(t, size);
+	}
+	return 0;
+}
+
+static void luaopen_tableext(lua_State *L) {
+#ifndef isdummy
+	lua_newtable(L);
+	dummynode = ((Table *)lua_topointer(L, -1))->node;
+	lua_pop(L, 1);
+#endif
+
+	lua_getglobal(L, "table");
+	lua_pushcfunction(L, table_new);
+	lua_setfield(L, -2, "new");
+	lua_pushcfunction(L, table_clear);
+	lua_setfield(L, -2, "clear");
+	lua_pop(L, 1);
+
+	//so that `require "table.new"` works as it does in luajit
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushcfunction(L, table_new);
+	lua_setfield(L, -2, "table.new");
+	lua_pushcfunction(L, table_clear);
+	lua_setfield(L, -2, "table.clear");
+	lua_pop(L, 1);
+}
+#endif
+
+/*
+** coroutine pool, finished coroutines started by co_spawn are parked and reused
+**
+** a parked thread is dead like any finished coroutine, coroutine.status reports it and
+** coroutine.resume refuses it. a handle taken with coroutine.running() must still not be kept
+** after f returned: once co_spawn reuses the thread the same handle resumes the new task.
+*/
+#define CO_POOL_DEFAULT_CAPACITY 256
+
+typedef struct {
+	int capacity;
+	int size;
+	lua_Integer created;
+	lua_Integer reused;
+	lua_Integer recycled;
+	lua_Integer discarded;
+} CoPool;
+
+static int co_pool_tag = 0;
+
+//[-0, +1], push the pool of the state, the idle threads are kept in its uservalue
+static CoPool *co_pool_get(lua_State *L) {
+	CoPool *pool;
+	lua_pushlightuserdata(L, &co_pool_tag);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_isnil(L, -1)) {
+		return (CoPool *)lua_touserdata(L, -1);
+	}
+	lua_pop(L, 1);
+	pool = (CoPool *)lua_newuserdata(L, sizeof(CoPool));
+	memset(pool, 0, sizeof(CoPool));
+	pool->capacity = CO_POOL_DEFAULT_CAPACITY;
+#if LUA_VERSION_NUM >= 503
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+#endif
+	lua_pushlightuserdata(L, &co_pool_tag);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	return pool;
+}
+
+#if LUA_VERSION_NUM >= 503
+//the function returned, park the thread and hand its results to the resumer. the thread is
+//dead once they are taken, co_pool_pop skips it until then
+static int co_body_done(lua_State *L, int status, lua_KContext ctx) {
+	CoPool *pool = co_pool_get(L);
+	if (pool->size < pool->capacity) {
+		lua_getuservalue(L, -1);
+		lua_pushthread(L);
+		lua_rawseti(L, -2, ++pool->size);
+		lua_pop(L, 1);
+		pool->recycled++;
+	} else {
+		pool->discarded++;
+	}
+	lua_pop(L, 1);
+	return lua_gettop(L);
+}
+
+//stack: f, args...
+static int co_body(lua_State *L) {
+	lua_callk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, co_body_done);
+	return co_body_done(L, LUA_OK, 0);
+}
+
+//[-0, +1], push an idle thread or nil
+static void co_pool_pop(lua_State *L, CoPool *pool, int pool_idx) {
+	lua_State *co;
+	lua_getuservalue(L, pool_idx);
+	while (pool->size > 0) {
+		lua_rawgeti(L, -1, pool->size);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, pool->size--);
+		co = lua_tothread(L, -1);
+		if (lua_status(co) == LUA_OK && lua_gettop(co) == 0) {
+			lua_remove(L, -2);
+			pool->reused++;
+			return;
+		}
+		//its results were never taken
+		lua_pop(L, 1);
+		pool->discarded++;
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+}
+#endif
+
+//like coroutine.resume(coroutine.create(f), ...), but the thread comes from the pool
+static int co_spawn(lua_State *L) {
+	int nargs = lua_gettop(L);
+	int status, nres;
+	CoPool *pool;
+	lua_State *co;
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	pool = co_pool_get(L);
+#if LUA_VERSION_NUM >= 503
+	co_pool_pop(L, pool, -1);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newthread(L);
+		pool->created++;
+	}
+	co = lua_tothread(L, -1);
+	lua_replace(L, -2);
+	lua_insert(L, 1);
+	if (!lua_checkstack(co, nargs + 1)) {
+		return luaL_error(L, "too many arguments to spawn");
+	}
+	lua_pushcfunction(co, co_body);
+	lua_xmove(L, co, nargs);
+#if LUA_VERSION_NUM >= 504
+	status = lua_resume(co, L, nargs, &nres);
+#else
+	status = lua_resume(co, L, nargs);
+	nres = lua_gettop(co);
+#endif
+#else
+	pool->created++;
+	lua_pop(L, 1);
+	co = lua_newthread(L);
+	lua_insert(L, 1);
+	lua_xmove(L, co, nargs);
+	status = lua_resume(co, nargs - 1);
+	nres = lua_gettop(co);
+#endif
+	if (status == 0 || status == LUA_YIELD) {
+		if (!lua_checkstack(L, nres + 1)) {
+			lua_pop(co, nres);
+			return luaL_error(L, "too many results to resume");
+		}
+		lua_pushboolean(L, 1);
+		lua_xmove(co, L, nres);
+		return nres + 1;
+	}
+	lua_pushboolean(L, 0);
+	lua_xmove(co, L, 1);
+#if LUA_VERSION_NUM >= 504
+	lua_resetthread(co);
+	lua_settop(co, 0);
+	pool = co_pool_get(L);
+	if (pool->size < pool->capacity) {
+		lua_getuservalue(L, -1);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, ++pool->size);
+		lua_pop(L, 1);
+		pool->recycled++;
+	} else {
+		pool->discarded++;
+	}
+	lua_pop(L, 1);
+#elif LUA_VERSION_NUM >= 503
+	pool->discarded++;
+#endif
+	return 2;
+}
+
+//xlua.co_pool([capacity]), returns the previous capacity
+static int co_pool_capacity(lua_State *L) {
+	int set = !lua_isnoneornil(L, 1);
+	lua_Integer n = set ? luaL_checkinteger(L, 1) : 0; //before co_pool_get pushes the pool
+	CoPool *pool = co_pool_get(L);
+	int capacity = pool->capacity;
+	if (set) {
+		pool->capacity = n < 0 ? 0 : (n > INT_MAX ? INT_MAX : (int)n);
+#if LUA_VERSION_NUM >= 503
+		lua_getuservalue(L, -1);
+		while (pool->size > pool->capacity) {
+			lua_pushnil(L);
+			lua_rawseti(L, -2, pool->size--);
+		}
+		lua_pop(L, 1);
+#endif
+	}
+	lua_pushinteger(L, capacity);
+	return 1;
+}
+
+static int co_pool_stats(lua_State *L) {
+	CoPool *pool = co_pool_get(L);
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, pool->capacity);
+	lua_setfield(L, -2, "capacity");
+	lua_pushinteger(L, pool->size);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, pool->created);
+	lua_setfield(L, -2, "created");
+	lua_pushinteger(L, pool->reused);
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, pool->recycled);
+	lua_setfield(L, -2, "recycled");
+	lua_pushinteger(L, pool->discarded);
+	lua_setfield(L, -2, "discarded");
+	return 1;
+}
+
 static const luaL_Reg xlualib[] = {
 	{"sethook", profiler_set_hook},
 	{"genaccessor", gen_css_access},
 	{"structclone", css_clone},
+	{"co_spawn", co_spawn},
+	{"co_pool", co_pool_capacity},
+	{"co_stats", co_pool_stats},
 	{NULL, NULL}
 };
 
 extern void luaopen_all3rd(lua_State* L);
+extern void xlua_cmdbuf_openlib(lua_State *L);
 LUA_API void luaopen_xlua(lua_State *L) {
 	luaL_openlibs(L);
+
+#if !USING_LUAJIT && LUA_VERSION_NUM >= 503
+	luaopen_tableext(L);
+#endif
 	
 #if LUA_VERSION_NUM >= 503
 	luaL_newlib(L, xlualib);
+	xlua_cmdbuf_openlib(L);
 	lua_setglobal(L, "xlua");
 #else
 	luaL_register(L, "xlua", xlualib);
+	xlua_cmdbuf_openlib(L);
     lua_pop(L, 1);
 #endif
 
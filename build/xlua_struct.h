@@ -0,0 +1,28 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#ifndef XLUA_STRUCT_H
+#define XLUA_STRUCT_H
+
+/*
+** field type tags of c# structs, shared by the genaccessor closures and the struct schemas
+*/
+
+#define T_INT8   0
+#define T_UINT8  1
+#define T_INT16  2
+#define T_UINT16 3
+#define T_INT32  4
+#define T_UINT32 5
+#define T_INT64  6
+#define T_UINT64 7
+#define T_FLOAT  8
+#define T_DOUBLE 9
+#define T_STRUCT 10 //nested schema, struct_schema.c only
+
+#endif
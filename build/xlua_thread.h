@@ -0,0 +1,182 @@
+/*
+ *Tencent is pleased to support the open source community by making xLua available.
+ *Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ *Licensed under the MIT License (the "License"); you may not use this file except in compliance with the License. You may obtain a copy of the License at
+ *http://opensource.org/licenses/MIT
+ *Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
+*/
+
+#ifndef XLUA_THREAD_H
+#define XLUA_THREAD_H
+
+/*
+** minimal thread/mutex/condition wrapper for the native helpers that work off the main thread.
+** define XLUA_NO_THREAD on platforms without threads, xthread_create then fails and callers
+** do the work inline. xatomic_inc and xonce are for state shared by several lua states.
+*/
+
+#ifdef _MSC_VER
+#define XTHREAD_API static __inline
+#else
+#define XTHREAD_API static inline
+#endif
+
+typedef void (*xthread_func)(void *ud);
+
+#if defined(XLUA_NO_THREAD)
+
+typedef int xthread_t;
+typedef int xmutex_t;
+typedef int xcond_t;
+typedef int xonce_t;
+#define XONCE_INIT 0
+
+XTHREAD_API int xthread_create(xthread_t *t, xthread_func f, void *ud) { return 0; }
+XTHREAD_API void xthread_join(xthread_t t) {}
+XTHREAD_API void xmutex_init(xmutex_t *m) {}
+XTHREAD_API void xmutex_destroy(xmutex_t *m) {}
+XTHREAD_API void xmutex_lock(xmutex_t *m) {}
+XTHREAD_API void xmutex_unlock(xmutex_t *m) {}
+XTHREAD_API void xcond_init(xcond_t *c) {}
+XTHREAD_API void xcond_destroy(xcond_t *c) {}
+XTHREAD_API void xcond_wait(xcond_t *c, xmutex_t *m) {}
+XTHREAD_API void xcond_signal(xcond_t *c) {}
+XTHREAD_API void xcond_broadcast(xcond_t *c) {}
+XTHREAD_API int xthread_cpu_count(void) { return 1; }
+XTHREAD_API long xatomic_inc(volatile long *p) { return ++*p; }
+XTHREAD_API void xonce(xonce_t *o, void (*f)(void)) {
+	if (!*o) {
+		*o = 1;
+		f();
+	}
+}
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+#include <process.h>
+#include <stdlib.h>
+
+typedef HANDLE xthread_t;
+typedef CRITICAL_SECTION xmutex_t;
+typedef CONDITION_VARIABLE xcond_t;
+typedef INIT_ONCE xonce_t;
+#define XONCE_INIT INIT_ONCE_STATIC_INIT
+
+typedef struct {
+	xthread_func f;
+	void *ud;
+} xthread_start;
+
+static unsigned __stdcall xthread_entry(void *p) {
+	xthread_start s = *(xthread_start *)p;
+	free(p);
+	s.f(s.ud);
+	return 0;
+}
+
+XTHREAD_API int xthread_create(xthread_t *t, xthread_func f, void *ud) {
+	xthread_start *s = (xthread_start *)malloc(sizeof(xthread_start));
+	if (s == NULL) {
+		return 0;
+	}
+	s->f = f;
+	s->ud = ud;
+	*t = (HANDLE)_beginthreadex(NULL, 0, xthread_entry, s, 0, NULL);
+	if (*t == 0) {
+		free(s);
+		return 0;
+	}
+	return 1;
+}
+
+XTHREAD_API void xthread_join(xthread_t t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+XTHREAD_API void xmutex_init(xmutex_t *m) { InitializeCriticalSection(m); }
+XTHREAD_API void xmutex_destroy(xmutex_t *m) { DeleteCriticalSection(m); }
+XTHREAD_API void xmutex_lock(xmutex_t *m) { EnterCriticalSection(m); }
+XTHREAD_API void xmutex_unlock(xmutex_t *m) { LeaveCriticalSection(m); }
+XTHREAD_API void xcond_init(xcond_t *c) { InitializeConditionVariable(c); }
+XTHREAD_API void xcond_destroy(xcond_t *c) {}
+XTHREAD_API void xcond_wait(xcond_t *c, xmutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+XTHREAD_API void xcond_signal(xcond_t *c) { WakeConditionVariable(c); }
+XTHREAD_API void xcond_broadcast(xcond_t *c) { WakeAllConditionVariable(c); }
+
+XTHREAD_API int xthread_cpu_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+XTHREAD_API long xatomic_inc(volatile long *p) { return InterlockedIncrement(p); }
+
+static BOOL CALLBACK xonce_entry(PINIT_ONCE o, PVOID f, PVOID *ctx) {
+	((void (*)(void))f)();
+	return TRUE;
+}
+
+XTHREAD_API void xonce(xonce_t *o, void (*f)(void)) { InitOnceExecuteOnce(o, xonce_entry, (PVOID)f, NULL); }
+
+#else
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef pthread_t xthread_t;
+typedef pthread_mutex_t xmutex_t;
+typedef pthread_cond_t xcond_t;
+typedef pthread_once_t xonce_t;
+#define XONCE_INIT PTHREAD_ONCE_INIT
+
+typedef struct {
+	xthread_func f;
+	void *ud;
+} xthread_start;
+
+static void *xthread_entry(void *p) {
+	xthread_start s = *(xthread_start *)p;
+	free(p);
+	s.f(s.ud);
+	return NULL;
+}
+
+XTHREAD_API int xthread_create(xthread_t *t, xthread_func f, void *ud) {
+	xthread_start *s = (xthread_start *)malloc(sizeof(xthread_start));
+	if (s == NULL) {
+		return 0;
+	}
+	s->f = f;
+	s->ud = ud;
+	if (pthread_create(t, NULL, xthread_entry, s) != 0) {
+		free(s);
+		return 0;
+	}
+	return 1;
+}
+
+XTHREAD_API void xthread_join(xthread_t t) { pthread_join(t, NULL); }
+XTHREAD_API void xmutex_init(xmutex_t *m) { pthread_mutex_init(m, NULL); }
+XTHREAD_API void xmutex_destroy(xmutex_t *m) { pthread_mutex_destroy(m); }
+XTHREAD_API void xmutex_lock(xmutex_t *m) { pthread_mutex_lock(m); }
+XTHREAD_API void xmutex_unlock(xmutex_t *m) { pthread_mutex_unlock(m); }
+XTHREAD_API void xcond_init(xcond_t *c) { pthread_cond_init(c, NULL); }
+XTHREAD_API void xcond_destroy(xcond_t *c) { pthread_cond_destroy(c); }
+XTHREAD_API void xcond_wait(xcond_t *c, xmutex_t *m) { pthread_cond_wait(c, m); }
+XTHREAD_API void xcond_signal(xcond_t *c) { pthread_cond_signal(c); }
+XTHREAD_API void xcond_broadcast(xcond_t *c) { pthread_cond_broadcast(c); }
+
+XTHREAD_API int xthread_cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+XTHREAD_API long xatomic_inc(volatile long *p) { return __sync_add_and_fetch(p, 1); }
+XTHREAD_API void xonce(xonce_t *o, void (*f)(void)) { pthread_once(o, f); }
+
+#endif
+
+#endif